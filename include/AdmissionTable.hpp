@@ -0,0 +1,56 @@
+#ifndef ADMISSIONTABLE_HPP
+#define ADMISSIONTABLE_HPP
+
+#include <cstddef>
+#include <vector>
+
+enum AdmissionVerdict {
+  ADMISSION_OK,
+  ADMISSION_NO_ADDRESS,
+  ADMISSION_PER_IP,
+  ADMISSION_RATE
+};
+
+// Per-address connection accounting for the accept path: how many sockets an
+// IPv4 peer holds open and how many it opened in the current one-second
+// window. Open addressing with linear probing over a power-of-two table of
+// 16-byte slots; address 0 marks an empty slot, so a peer without a known
+// address is refused rather than counted.
+// Idle entries are kept until their rate window has passed, so a host cannot
+// reset its rate by disconnecting, and are swept when the table needs to grow.
+class AdmissionTable {
+
+public:
+  AdmissionTable();
+  ~AdmissionTable();
+
+  void setLimits(std::size_t maxPerIp, std::size_t maxPerSecond);
+  AdmissionVerdict admit(unsigned int addr, unsigned long nowSec);
+  void adopt(unsigned int addr, unsigned long nowSec);
+  void release(unsigned int addr);
+
+  std::size_t size() const;
+  std::size_t capacity() const;
+
+private:
+  struct Slot {
+    unsigned int addr;
+    unsigned int active;
+    unsigned int windowCount;
+    unsigned int windowStart;
+  };
+
+  AdmissionTable(const AdmissionTable &other);
+  AdmissionTable &operator=(const AdmissionTable &other);
+
+  std::size_t probe(unsigned int addr) const;
+  std::size_t claim(unsigned int addr, unsigned long nowSec);
+  void rehash(std::size_t capacity, unsigned long nowSec);
+
+  std::vector<Slot> _slots;
+  std::size_t _used;
+  std::size_t _max_per_ip;
+  std::size_t _max_per_second;
+};
+
+#endif
@@ -2,27 +2,69 @@
 #define CHANNEL_HPP
 
 #include "Client.hpp"
+#include "InviteSet.hpp"
+#include "MaskList.hpp"
+#include <ctime>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+// Outcome of charging one message to a +f channel's bucket. TRIPPED is the
+// first refusal after the bucket ran dry, so its action fires only once.
+enum FloodVerdict {
+  FLOOD_PASS,
+  FLOOD_TRIPPED,
+  FLOOD_LIMITED
+};
+
 class Channel {
 private:
   std::string _name;
   std::string _topic;
   std::string _key;
   std::size_t _limit;
+  std::size_t _refs;
+  std::time_t _created_at;
+  std::time_t _topic_set_at;
 
   std::map<int, Client *> _members;
+  // Member fd -> the server's join sequence number when it joined, so a
+  // sliced broadcast can leave out whoever arrived after its line was sent.
+  std::map<int, unsigned long> _joined;
 
-  std::vector<int> _operators;
-  std::vector<int> _invitedFds;
-  std::vector<int> _membersBanned;
+  std::set<int> _operators;
+  InviteSet _invites;
+  MaskList _bans;
+  MaskList _excepts;
+  MaskList _invex;
 
   bool _modeI;
   bool _modeT;
   bool _modeK;
   bool _modeL;
+  bool _modeU;
+  bool _modeM;
+  bool _modeF;
+
+  // +f: channel-wide token bucket, refilled at _flood_messages per
+  // _flood_seconds. The level is kept in message-milliseconds so the refill
+  // stays in integers: each message costs _flood_seconds * 1000.
+  unsigned _flood_messages;
+  unsigned _flood_seconds;
+  char _flood_action;
+  unsigned long _flood_level;
+  unsigned long _flood_stamp;
+  bool _flood_tripped;
+  unsigned long _moderated_until;
+
+  // NAMES cache: each entry is the tail of one RPL_NAMREPLY line,
+  // " = <channel> :<names>\r\n", cut so the full line stays within 512 bytes.
+  mutable std::vector<std::string> _names_chunks;
+  mutable std::size_t _names_budget;
+  mutable bool _names_valid;
+
+  void appendNamesEntry(const std::string &entry) const;
 
 public:
   Channel();
@@ -31,13 +73,19 @@ public:
   Channel(const Channel &other);
   Channel &operator=(const Channel &other);
 
+  void reset(const std::string &name);
+  void retain();
+  std::size_t release();
+  std::size_t getRefs() const;
+
   bool isMember(int clientFd) const;
   bool isOperator(int clientFd) const;
+  bool joinedBy(int clientFd, unsigned long seq) const;
   bool isInviteOnly() const;
   bool isTopicRestricted() const;
   bool hasKey() const;
   bool isFull() const;
-  bool isInvitedFd(int clientFd) const;
+  bool isInvited(unsigned long clientId, unsigned long nowMs) const;
 
   void setName(const std::string &name);
   void setTopic(const std::string &topic);
@@ -48,24 +96,46 @@ public:
   std::size_t getMembersNumber() const;
   const std::string &getKey() const;
   const std::string &getTopic() const;
+  std::time_t getCreatedAt() const;
+  std::time_t getTopicSetAt() const;
+  void setCreatedAt(std::time_t createdAt);
+  void setTopicSetAt(std::time_t topicSetAt);
   const std::string &getName() const;
-  const std::string getUserList() const;
+  const std::vector<std::string> &getNamesChunks(std::size_t budget) const;
+  std::vector<std::string> getOperatorNamesChunks(std::size_t budget, int viewerFd) const;
+  void invalidateNames();
   const std::map<int, Client *> &getMembers() const;
-  const std::vector<int> &getInvitedFds() const ;
+  std::size_t getInviteCount() const;
+  void getInvites(std::vector<std::pair<unsigned long, unsigned long> > &out) const;
 
-  void addMember(Client *client);
+  void addMember(Client *client, unsigned long joinSeq);
   void removeMember(int clientFd);
   void addOperator(int clientFd);
   void removeOperator(int clientFd);
-  void addBanned(int clientFd);
-  void removeBanned(int clientFd);
+  MaskList &getMaskList(char mode);
+  const MaskList &getMaskList(char mode) const;
+  bool isBanned(const std::string &hostmask) const;
+  bool isInviteExempt(const std::string &hostmask) const;
 
   void setMode(char mode, bool setting);
   bool getMode(char mode) const;
 
+  void setFlood(unsigned messages, unsigned seconds, char action);
+  std::string getFloodParam() const;
+  char getFloodAction() const;
+  FloodVerdict consumeFloodToken(unsigned long nowMs);
+  void setModeratedUntil(unsigned long untilMs);
+  unsigned long getModeratedUntil() const;
+
   void broadcast(const std::string &message, int excludeFd);
+  void broadcastOnce(const std::string &message, int excludeFd, unsigned long epoch);
+  void broadcastToOperators(const std::string &message, int excludeFd);
+  void broadcastToOperatorsOnce(const std::string &message, int excludeFd, unsigned long epoch,
+                                std::vector<int> &reached);
 
-  void inviteMember(int clientFd);
+  void inviteMember(unsigned long clientId, unsigned long expiresMs, unsigned long nowMs);
+  bool consumeInvite(unsigned long clientId, unsigned long nowMs);
+  void pruneInvites(unsigned long nowMs);
   bool canSetMode(int clientFd) const;
   bool canKick(int clientFd) const;
   bool canInvite(int clientFd) const;
@@ -2,26 +2,45 @@
 #define CLIENT_HPP
 
 #include <iostream>
+#include <vector>
+
+// IRCv3 capabilities a client can negotiate with CAP REQ, one bit each.
+enum ClientCap {
+  CAP_SERVER_TIME = 1 << 0,
+  CAP_CHATHISTORY = 1 << 1,
+  CAP_SEARCH = 1 << 2,
+  CAP_MESSAGE_TAGS = 1 << 3,
+  CAP_BATCH = 1 << 4,
+  CAP_CAP_NOTIFY = 1 << 5,
+  CAP_NO_IMPLICIT_NAMES = 1 << 6
+};
 
 class Client {
 
 public:
   Client();
-  explicit Client(const int FD);
+  Client(const int FD, const unsigned long ID);
   ~Client();
   Client operator=(Client const &other);
 
+  void reset(const int FD, const unsigned long ID);
+
   void setPassword(bool state);
   void setNickname(const std::string &nickname);
   void setUsername(const std::string &username);
   void setRealname(const std::string &realname);
+  void setLastActivity(unsigned long now);
+  void setPingSentAt(unsigned long now);
 
   bool isAuthenticated() const;
   bool hasPassword() const;
   bool hasNick() const;
   bool hasUser() const;
   int getFd() const;
-  const std::string &getBuffer() const;
+  unsigned long getId() const;
+  unsigned long getLastActivity() const;
+  unsigned long getPingSentAt() const;
+  std::string getBuffer() const;
   const std::string &getNickname() const;
   const std::string &getUsername() const;
   const std::string &getRealname() const;
@@ -32,21 +51,67 @@ public:
   void appendToBuffer(const std::string &data);
   std::string extractCommand();
   void queueOutput(const std::string &data);
+  void queueTagged(const std::string &line);
   bool hasPendingOutput() const;
   std::string &getOutputBuffer();
   void consumeOutput(std::size_t count);
+  void setFlushQueue(std::vector<int> *queue);
+  std::size_t markFlushed();
+  void addChannel(const std::string &name);
+  void removeChannel(const std::string &name);
+  const std::vector<std::string> &getChannels() const;
+  bool markDelivered(unsigned long epoch);
+  void setReadyQueued(bool queued);
+  bool isReadyQueued() const;
+  void setClosing(bool closing);
+  bool isClosing() const;
+  bool isReadPaused() const;
+  void setRecvArmed(bool armed);
+  bool isRecvArmed() const;
+  void setAddress(unsigned int addr);
+  unsigned int getAddress() const;
+  bool addMonitor(const std::string &nick);
+  bool removeMonitor(const std::string &nick);
+  const std::vector<std::string> &getMonitored() const;
+  void clearMonitored();
+  void setCap(unsigned int cap, bool enabled);
+  bool hasCap(unsigned int cap) const;
+  unsigned int getCaps() const;
+  void setCapVersion(unsigned int version);
+  unsigned int getCapVersion() const;
+  void setNegotiating(bool negotiating);
+  bool isNegotiating() const;
 
 private:
+  void markQueued();
+
   bool _is_authenticated;
   bool _has_password;
   bool _has_nick;
   bool _has_user;
   int _fd;
+  unsigned long _id;
+  unsigned long _last_activity;
+  unsigned long _ping_sent_at;
   std::string _buffer;
+  std::size_t _buffer_start;
   std::string _out_buffer;
+  std::vector<int> *_flush_queue;
+  bool _flush_pending;
+  std::size_t _queued_writes;
   std::string _nickname;
   std::string _username;
   std::string _realname;
+  std::vector<std::string> _channels;
+  unsigned long _delivery_epoch;
+  bool _ready_queued;
+  bool _closing;
+  bool _recv_armed;
+  unsigned int _addr;
+  std::vector<std::string> _monitored;
+  unsigned int _caps;
+  unsigned int _cap_version;
+  bool _negotiating;
 };
 
 #endif
@@ -0,0 +1,56 @@
+#ifndef HISTORYLINE_HPP
+#define HISTORYLINE_HPP
+
+#include <cstddef>
+#include <string>
+
+// One stored channel message: the relayed line exactly as members received
+// it, its message id and its wall-clock time in milliseconds. Immutable once
+// created and reference counted, so the channel ring and every replay in
+// flight share a single copy; the last HistoryRef to let go deletes it.
+class HistoryLine {
+
+public:
+  static HistoryLine *create(unsigned long seq, unsigned long timeMs, const std::string &line);
+
+  void retain();
+  void release();
+
+  unsigned long getSeq() const;
+  const std::string &getMsgid() const;
+  unsigned long getTime() const;
+  const std::string &getLine() const;
+  std::size_t getBytes() const;
+
+private:
+  HistoryLine(unsigned long seq, const std::string &msgid, unsigned long timeMs, const std::string &line);
+  ~HistoryLine();
+  HistoryLine(const HistoryLine &other);
+  HistoryLine &operator=(const HistoryLine &other);
+
+  std::size_t _refs;
+  const unsigned long _seq;
+  const std::string _msgid;
+  const unsigned long _time;
+  const std::string _line;
+};
+
+// Counted handle to a HistoryLine.
+class HistoryRef {
+
+public:
+  HistoryRef();
+  explicit HistoryRef(HistoryLine *line);
+  HistoryRef(const HistoryRef &other);
+  ~HistoryRef();
+
+  HistoryRef &operator=(const HistoryRef &other);
+
+  const HistoryLine *operator->() const;
+  const HistoryLine *get() const;
+
+private:
+  HistoryLine *_line;
+};
+
+#endif
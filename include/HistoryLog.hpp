@@ -0,0 +1,203 @@
+#ifndef HISTORYLOG_HPP
+#define HISTORYLOG_HPP
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "./HistoryLine.hpp"
+
+// A segment is sealed once it grows past this size; compaction only merges
+// neighbours whose combined size stays under it.
+const std::size_t HISTORY_SEGMENT_BYTES = 16 * 1024 * 1024;
+// Records waiting for the writer. Past this the log is falling behind the
+// disk and new lines are only kept in memory.
+const std::size_t HISTORY_PENDING_LIMIT = 65536;
+// Recovered records the writer hands the visitor between two batches, and
+// how long it waits before offering more to a visitor that had no room.
+const std::size_t HISTORY_SEED_RECORDS = 4096;
+const unsigned long HISTORY_SEED_RETRY_MS = 10;
+
+// Where one stored line lives: its keys and the record's place on disk.
+struct HistoryLogEntry {
+  unsigned long seq;
+  unsigned long timeMs;
+  unsigned int segment;
+  unsigned int offset;
+};
+
+// Sees every intact record found on disk when the log is opened, oldest
+// first. begin() is called from open(), visit() and finish() from the writer
+// thread; finish() comes even when reading back stopped half way. A visitor
+// that cannot take a record yet returns false and is offered it again later.
+// An empty line is a fence: whatever the channel said before it is gone.
+class HistoryLogVisitor {
+
+public:
+  virtual ~HistoryLogVisitor() {}
+  virtual void begin() {}
+  virtual bool visit(const std::string &channel, unsigned long seq, unsigned long timeMs,
+                     const std::string &line) = 0;
+  virtual void finish() {}
+};
+
+struct HistoryLogStats {
+  std::size_t segments;
+  unsigned long diskBytes;
+  std::size_t pending;
+  unsigned long commits;
+  unsigned long written;
+  unsigned long dropped;
+  unsigned long failed;
+  unsigned long merges;
+  unsigned long expired;
+};
+
+// Disk copy of the channel history: one append-only log shared by every
+// channel, split into numbered segment files. The event loop only queues
+// records under a short lock; a writer thread first indexes what is already
+// on disk, then takes whatever has accumulated,
+// writes it with one write() and one fdatasync() (group commit), rotates
+// segments, drops the oldest ones past the size budget and merges small
+// neighbours. It reports each record's offset back through a notice queue
+// that the loop drains in collect(), so the per-channel index of seq, time
+// and position is only ever touched by the loop; the index recovered from
+// disk reaches it the same way. The recovered records are handed to the
+// visitor afterwards, a slice between two batches. Reads go through
+// read-only mappings of the segment files.
+class HistoryLog {
+
+public:
+  HistoryLog();
+  ~HistoryLog();
+
+  bool open(const std::string &directory, unsigned long maxBytes, HistoryLogVisitor *visitor = NULL);
+  void close();
+  bool isOpen() const;
+  const std::string &getError() const;
+
+  void append(const std::string &channel, unsigned long seq, unsigned long timeMs, const std::string &line);
+  void fence(const std::string &channel, unsigned long seq, unsigned long timeMs);
+  bool collect();
+
+  const std::deque<HistoryLogEntry> *find(const std::string &channel) const;
+  bool holds(const std::string &channel) const;
+  HistoryLine *load(const HistoryLogEntry &entry) const;
+  unsigned long getLastSeq() const;
+  unsigned long getLastTime() const;
+  HistoryLogStats getStats() const;
+
+private:
+  struct Record {
+    std::string channel;
+    unsigned long seq;
+    unsigned long timeMs;
+    std::string line;
+  };
+
+  struct Placed {
+    std::string channel;
+    unsigned long seq;
+    unsigned long timeMs;
+    bool fence;
+  };
+
+  enum NoticeKind {
+    NOTICE_RECOVERED,
+    NOTICE_WRITTEN,
+    NOTICE_FAILED,
+    NOTICE_DROPPED,
+    NOTICE_MERGED
+  };
+
+  // Writer to loop. RECOVERED counts 1 once the disk index is ready and 0 if
+  // the log could not be read back, WRITTEN carries the offsets of the next
+  // records in submission order, FAILED how many of them never reached the
+  // disk.
+  struct Notice {
+    NoticeKind kind;
+    unsigned int segment;
+    unsigned int merged;
+    unsigned int shift;
+    std::size_t count;
+    std::vector<unsigned int> offsets;
+  };
+
+  struct Segment {
+    unsigned int id;
+    std::size_t bytes;
+  };
+
+  struct Mapping {
+    const char *base;
+    std::size_t length;
+  };
+
+  // A recovered segment still to be handed to the visitor, mapped until it
+  // has been, so expiring or merging it meanwhile takes nothing away.
+  struct Seed {
+    Mapping mapping;
+    std::size_t end;
+  };
+
+  HistoryLog(const HistoryLog &other);
+  HistoryLog &operator=(const HistoryLog &other);
+
+  static void *writerMain(void *arg);
+  std::string segmentPath(unsigned int id) const;
+  bool recover();
+  std::size_t scanSegment(unsigned int id, const char *data, std::size_t size);
+  const Mapping *mapSegment(unsigned int id) const;
+  void unmapSegment(unsigned int id) const;
+  void index(const std::string &channel, const HistoryLogEntry &entry);
+  void applyNotice(Notice &notice);
+
+  void writerLoop();
+  bool isStopping();
+  bool seed();
+  void dropSeeds();
+  bool openActive();
+  void commit(std::vector<Record> &batch);
+  void expireSegments();
+  bool mergeSegments();
+  void publish(Notice &notice);
+
+  std::string _directory;
+  unsigned long _max_bytes;
+  HistoryLogVisitor *_visitor;
+  std::string _error;
+  bool _open;
+
+  // Loop thread only.
+  std::map<std::string, std::deque<HistoryLogEntry> > _index;
+  std::deque<Placed> _unplaced;
+  mutable std::map<unsigned int, Mapping> _mappings;
+  unsigned long _last_seq;
+  unsigned long _last_time;
+
+  // Shared, under _lock.
+  pthread_mutex_t _lock;
+  pthread_cond_t _wake;
+  pthread_t _writer;
+  std::vector<Record> _pending;
+  std::deque<Notice> _notices;
+  bool _stopping;
+  HistoryLogStats _stats;
+
+  // Writer thread until it reports NOTICE_RECOVERED, then the loop's.
+  std::map<std::string, std::deque<HistoryLogEntry> > _recovered;
+  unsigned long _recovered_seq;
+  unsigned long _recovered_time;
+
+  // Writer thread only once it is running.
+  std::deque<Seed> _seeds;
+  std::size_t _seed_offset;
+  std::vector<Segment> _segments;
+  int _active_fd;
+  std::string _scratch;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef HISTORYSTORE_HPP
+#define HISTORYSTORE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "./HistoryLine.hpp"
+#include "./HistoryLog.hpp"
+
+// Caps on what the history keeps. A channel drops its oldest line once
+// either per-channel bound is passed; when the total goes over the global
+// bound the oldest line server-wide goes first, whichever channel it is in.
+const std::size_t HISTORY_CHANNEL_LINES = 1000;
+const std::size_t HISTORY_CHANNEL_BYTES = 256 * 1024;
+const std::size_t HISTORY_TOTAL_BYTES = 32 * 1024 * 1024;
+
+// A CHATHISTORY reference point: a message id or a wall-clock time in ms.
+struct HistoryPoint {
+  bool byMsgid;
+  unsigned long seq;
+  unsigned long timeMs;
+};
+
+// Recent messages of every channel, keyed by channel name so the history
+// outlives the Channel object. Each channel keeps a ring of shared lines in
+// sequence order; sequence numbers are global and start from the wall clock
+// at startup, so message ids stay unique across restarts. Times never go
+// backwards within the store, which keeps both keys sorted in every ring and
+// lets queries binary search either one. With a log open every line is also
+// written to disk, and queries reaching past the ring continue there. A
+// fence cuts a name off from everything said under it so far, for a channel
+// whose history must not pass to whoever creates the name next.
+class HistoryStore {
+
+public:
+  HistoryStore();
+  ~HistoryStore();
+
+  bool openLog(const std::string &directory, unsigned long maxBytes, HistoryLogVisitor *visitor = NULL);
+  void closeLog();
+  const std::string &getLogError() const;
+  bool collectLog();
+  bool getLogStats(HistoryLogStats &stats) const;
+
+  static unsigned long wallClockMs();
+  static std::string formatTime(unsigned long timeMs);
+  static bool parsePoint(const std::string &token, HistoryPoint &point);
+
+  const HistoryLine *append(const std::string &channel, const std::string &line, unsigned long timeMs);
+  void restore(const std::string &channel, unsigned long seq, unsigned long timeMs, const std::string &line);
+  void fence(const std::string &channel);
+  void snapshot(std::vector<std::pair<std::string, HistoryRef> > &out) const;
+
+  void latest(const std::string &channel, const HistoryPoint *after, std::size_t limit,
+              std::vector<HistoryRef> &out) const;
+  void before(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+              std::vector<HistoryRef> &out) const;
+  void after(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+             std::vector<HistoryRef> &out) const;
+  void around(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+              std::vector<HistoryRef> &out) const;
+  void between(const std::string &channel, const HistoryPoint &from, const HistoryPoint &to, std::size_t limit,
+               std::vector<HistoryRef> &out) const;
+  bool lastTime(const std::string &channel, unsigned long &timeMs) const;
+  bool lookup(const std::string &channel, unsigned long seq, std::vector<HistoryRef> &out) const;
+
+  std::size_t channelCount() const;
+  std::size_t lineCount() const;
+  std::size_t byteCount() const;
+  unsigned long evictedCount() const;
+
+private:
+  struct ChannelHistory {
+    std::deque<HistoryRef> lines;
+    std::size_t bytes;
+    std::size_t pending;
+  };
+  typedef std::map<std::string, ChannelHistory> HistoryMap;
+
+  // Global arrival order, one entry per appended line. Entries whose line
+  // already left through its channel's own cap go stale and are skipped, or
+  // dropped in bulk by compactOrder().
+  struct OrderEntry {
+    HistoryMap::iterator channel;
+    unsigned long seq;
+  };
+
+  HistoryStore(const HistoryStore &other);
+  HistoryStore &operator=(const HistoryStore &other);
+
+  const std::deque<HistoryRef> *findRing(const std::string &channel) const;
+  const HistoryLine *keep(const std::string &channel, const HistoryRef &stored);
+  void dropOldest(ChannelHistory &history);
+  void releaseOrder(HistoryMap::iterator channel);
+  void evictGlobal();
+  void compactOrder();
+
+  HistoryMap _channels;
+  std::deque<OrderEntry> _order;
+  unsigned long _next_seq;
+  unsigned long _last_time;
+  std::size_t _lines;
+  std::size_t _bytes;
+  unsigned long _evicted;
+  HistoryLog _log;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef HOTRESTART_HPP
+#define HOTRESTART_HPP
+
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Environment variable through which the new process finds its end of the
+// hand-off socket.
+const char *const HANDOFF_ENV = "IRCSERV_UPGRADE_FD";
+// Descriptors per SCM_RIGHTS message; the kernel refuses more than 253.
+const std::size_t HANDOFF_FDS_PER_MESSAGE = 200;
+// How long either side waits on the other before giving up.
+const long HANDOFF_TIMEOUT_MS = 10000;
+
+// Transport of a hot restart. The running server writes its state with the
+// put* calls, starts the new binary with spawn() and hands everything over
+// with send(): a fixed header, the descriptors in SCM_RIGHTS batches, then
+// the state itself. The new process attach()es to the socket named in
+// HANDOFF_ENV, receive()s and reads the state back in the same order with the
+// take* calls, and acknowledge()s once it is ready to serve; until then the
+// old process keeps every socket and can carry on if anything fails. Numbers
+// travel in host byte order, both sides being on the same machine, and
+// descriptors are written as their index in the list that goes with them.
+class HotRestart {
+
+public:
+  HotRestart();
+  ~HotRestart();
+
+  bool spawn(const std::vector<std::string> &command);
+  bool attach(int socket);
+  bool send();
+  bool receive();
+  bool acknowledge();
+  bool awaitAcknowledgement();
+  void abandon();
+  const std::string &getError() const;
+
+  void putNumber(unsigned long value);
+  void putString(const std::string &text);
+  void putStrings(const std::vector<std::string> &texts);
+  void putFd(int fd);
+
+  unsigned long takeNumber();
+  std::string takeString();
+  void takeStrings(std::vector<std::string> &texts);
+  int takeFd();
+  bool isIntact() const;
+  bool atEnd() const;
+  std::size_t getBytes() const;
+  std::size_t getFdCount() const;
+
+private:
+  HotRestart(const HotRestart &other);
+  HotRestart &operator=(const HotRestart &other);
+
+  bool fail(const std::string &what);
+  bool setTimeouts();
+
+  int _socket;
+  pid_t _child;
+  std::string _data;
+  std::size_t _read;
+  std::vector<int> _fds;
+  std::vector<bool> _taken;
+  bool _intact;
+  std::string _error;
+};
+
+#endif
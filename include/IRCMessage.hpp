@@ -7,6 +7,11 @@
 #include <string>
 
 const std::size_t IRC_MAX_MESSAGE_LENGTH = 512;
+// IRCv3 message-tags: the tag section ('@' through the space) may add up to
+// 8191 bytes in front of the 512 of the message, of which a client may use
+// 4094 for its own ('+' prefixed) tags.
+const std::size_t IRC_MAX_TAGS_LENGTH = 8191;
+const std::size_t IRC_MAX_CLIENT_TAGS_LENGTH = 4094;
 const int IRC_PARAM_OFFSET = 1;
 const int IRC_WELCOME_COUNT = 5;
 
@@ -22,7 +27,11 @@ public:
 
   bool parse(const std::string &raw);
   bool isValid() const;
+  bool isTooLong() const;
 
+  const std::string &getTags() const;
+  bool getTag(const std::string &key, std::string &value) const;
+  void appendClientTags(std::string &out) const;
   const std::string &getPrefix() const;
   const std::string &getCommand() const;
   const std::vector<std::string> &getParams() const;
@@ -34,10 +43,14 @@ public:
 
   static std::string formatReply(const std::string &prefix, const std::string &code, const std::string &target,
                                  const std::string &message);
+  static void escapeTagValue(std::string &out, const std::string &value);
+  static void unescapeTagValue(std::string &out, const std::string &text, std::size_t begin, std::size_t end);
 
 private:
   bool _valid;
+  bool _tooLong;
   bool _hasTrailing;
+  std::string _tags;
   std::string _prefix;
   std::string _command;
   std::string _trailing;
@@ -0,0 +1,47 @@
+#ifndef INVITESET_HPP
+#define INVITESET_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Most invites a channel holds at once; past it the soonest to expire is
+// dropped to make room.
+const std::size_t INVITE_SET_LIMIT = 256;
+
+// Pending invites of one channel, keyed by client id (never reused, unlike
+// fds) with an expiry in milliseconds. Open addressing with linear probing
+// and backward-shift deletion, so no tombstones pile up; id 0 marks an empty
+// slot. The table is only allocated by the first invite.
+class InviteSet {
+
+public:
+  InviteSet();
+  ~InviteSet();
+
+  void add(unsigned long clientId, unsigned long expiresMs, unsigned long nowMs);
+  bool contains(unsigned long clientId, unsigned long nowMs) const;
+  bool consume(unsigned long clientId, unsigned long nowMs);
+  void remove(unsigned long clientId);
+  void prune(unsigned long nowMs);
+  void clear();
+
+  std::size_t size() const;
+  void collect(std::vector<std::pair<unsigned long, unsigned long> > &out) const;
+
+private:
+  struct Slot {
+    unsigned long clientId;
+    unsigned long expires;
+  };
+
+  std::size_t find(unsigned long clientId) const;
+  void erase(std::size_t index);
+  void evictSoonest();
+  void resize(std::size_t capacity);
+
+  std::vector<Slot> _slots;
+  std::size_t _used;
+};
+
+#endif
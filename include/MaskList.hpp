@@ -0,0 +1,59 @@
+#ifndef MASKLIST_HPP
+#define MASKLIST_HPP
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+struct MaskEntry {
+  std::string mask;
+  std::string setBy;
+  std::time_t setAt;
+};
+
+// A channel's +b, +e or +I list of nick!user@host globs. Each mask is
+// compiled once into its literal prefix, suffix and the '*'-separated pieces
+// in between, which match left to right without backtracking. Masks are
+// bucketed by the first few characters of their literal prefix, or failing
+// that of their suffix, so a lookup only runs the masks whose anchor agrees
+// with the hostmask; masks anchored on neither end are always tried.
+class MaskList {
+
+public:
+  MaskList();
+  ~MaskList();
+
+  static std::string normalize(const std::string &mask);
+  static std::string fold(const std::string &text);
+
+  bool add(const std::string &mask, const std::string &setBy, std::time_t setAt);
+  bool remove(const std::string &mask);
+  void clear();
+  bool matches(const std::string &foldedHostmask) const;
+
+  std::size_t size() const;
+  const std::vector<MaskEntry> &getEntries() const;
+
+private:
+  struct CompiledMask {
+    std::string prefix;
+    std::string suffix;
+    std::vector<std::string> pieces;
+    std::vector<std::string> pieceHeads;
+    bool hasStar;
+  };
+
+  static CompiledMask compile(const std::string &foldedMask);
+  static bool matchCompiled(const CompiledMask &compiled, const std::string &text);
+  void index(std::size_t position);
+  void rebuildIndex();
+
+  std::vector<MaskEntry> _entries;
+  std::vector<CompiledMask> _compiled;
+  std::map<std::string, std::vector<std::size_t> > _by_prefix;
+  std::map<std::string, std::vector<std::size_t> > _by_suffix;
+  std::vector<std::size_t> _unanchored;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef OBJECTPOOL_HPP
+#define OBJECTPOOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Slab-backed free-list pool. Objects are default-constructed a slab at a
+// time: released objects go back on the free list still holding their
+// buffers, so the next acquire() reuses both the object and whatever capacity
+// its members kept. Past a spike, trim() destroys slabs whose objects are all
+// idle while more than spareSlabs slabs' worth of objects would stay idle, so
+// memory follows the load back down instead of staying at its high water. It
+// is up to the owner to call trim() where no released object is still in use.
+template <typename T>
+class ObjectPool {
+
+public:
+  explicit ObjectPool(std::size_t slabSize = 64, std::size_t spareSlabs = 2)
+      : _slab_size(slabSize), _spare_slabs(spareSlabs), _live(0), _high_water(0), _reused(0), _freed(0),
+        _idle_slabs(0) {
+  }
+
+  ~ObjectPool() {
+    for (typename SlabMap::iterator it = _slabs.begin(); it != _slabs.end(); ++it)
+      delete[] it->first;
+  }
+
+  T *acquire() {
+    if (_free.empty()) {
+      T *slab = new T[_slab_size];
+      _slabs[slab] = _slab_size;
+      ++_idle_slabs;
+      for (std::size_t i = _slab_size; i > 0; --i)
+        _free.push_back(&slab[i - 1]);
+    } else {
+      ++_reused;
+    }
+
+    T *object = _free.back();
+    _free.pop_back();
+    typename SlabMap::iterator slab = slabOf(object);
+    if (slab->second-- == _slab_size)
+      --_idle_slabs;
+    if (++_live > _high_water)
+      _high_water = _live;
+    return object;
+  }
+
+  void release(T *object) {
+    if (object == NULL)
+      return;
+    _free.push_back(object);
+    --_live;
+    if (++slabOf(object)->second == _slab_size)
+      ++_idle_slabs;
+  }
+
+  void trim() {
+    const unsigned long freed = _freed;
+    for (typename SlabMap::iterator it = _slabs.begin();
+         it != _slabs.end() && _idle_slabs > 0 && _free.size() >= _slab_size * (_spare_slabs + 1);) {
+      if (it->second == _slab_size)
+        destroySlab(it++);
+      else
+        ++it;
+    }
+#ifdef __GLIBC__
+    // Slabs and the buffers their objects kept are mostly below the mmap
+    // threshold; without this the heap would keep the pages.
+    if (_freed != freed)
+      malloc_trim(0);
+#endif
+  }
+
+  std::size_t live() const {
+    return _live;
+  }
+
+  std::size_t idle() const {
+    return _free.size();
+  }
+
+  std::size_t highWater() const {
+    return _high_water;
+  }
+
+  std::size_t slabs() const {
+    return _slabs.size();
+  }
+
+  unsigned long reused() const {
+    return _reused;
+  }
+
+  unsigned long freed() const {
+    return _freed;
+  }
+
+private:
+  // Slab start -> number of its objects on the free list, ordered by address
+  // so an object finds its slab with one lookup.
+  typedef std::map<T *, std::size_t, std::greater<T *> > SlabMap;
+
+  struct InSlab {
+    InSlab(T *first, T *last) : _first(first), _last(last) {
+    }
+    bool operator()(T *object) const {
+      return object >= _first && object < _last;
+    }
+    T *_first;
+    T *_last;
+  };
+
+  ObjectPool(const ObjectPool &other);
+  ObjectPool &operator=(const ObjectPool &other);
+
+  typename SlabMap::iterator slabOf(T *object) {
+    return _slabs.lower_bound(object);
+  }
+
+  void destroySlab(typename SlabMap::iterator slab) {
+    T *first = slab->first;
+    _free.erase(std::remove_if(_free.begin(), _free.end(), InSlab(first, first + _slab_size)), _free.end());
+    _slabs.erase(slab);
+    delete[] first;
+    --_idle_slabs;
+    ++_freed;
+  }
+
+  std::size_t _slab_size;
+  std::size_t _spare_slabs;
+  std::size_t _live;
+  std::size_t _high_water;
+  unsigned long _reused;
+  unsigned long _freed;
+  std::size_t _idle_slabs;
+  SlabMap _slabs;
+  std::vector<T *> _free;
+};
+
+#endif
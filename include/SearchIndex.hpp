@@ -0,0 +1,172 @@
+#ifndef SEARCHINDEX_HPP
+#define SEARCHINDEX_HPP
+
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "./HistoryLog.hpp"
+
+// Messages the index covers; past it the oldest are forgotten.
+const std::size_t SEARCH_MAX_DOCS = 262144;
+// Documents per posting block.
+const std::size_t SEARCH_BLOCK = 128;
+// Postings a single query may decode before it settles for what it found.
+const std::size_t SEARCH_DECODE_BUDGET = 500000;
+
+// A SEARCH as the loop hands it over: lower-cased text tokens, the channels
+// the client may read (all of them already checked), an optional sender
+// nick and an optional time window in ms (0 when open).
+struct SearchQuery {
+  unsigned long id;
+  int fd;
+  unsigned long clientId;
+  std::vector<std::string> tokens;
+  std::vector<std::string> channels;
+  std::string nick;
+  unsigned long afterMs;
+  unsigned long beforeMs;
+  std::size_t limit;
+};
+
+struct SearchHit {
+  std::string channel;
+  unsigned long seq;
+};
+
+// Hits oldest first; truncated when the decode budget ran out.
+struct SearchResult {
+  unsigned long id;
+  int fd;
+  unsigned long clientId;
+  std::vector<SearchHit> hits;
+  bool truncated;
+};
+
+struct SearchStats {
+  std::size_t docs;
+  std::size_t tokens;
+  std::size_t postingBytes;
+  std::size_t pending;
+  unsigned long queries;
+  unsigned long truncated;
+  unsigned long compactions;
+};
+
+// Inverted index over channel history, from each token to the messages that
+// contain it. A worker thread owns the index: the loop queues new lines and
+// queries under a short lock, the worker indexes and answers them, and the
+// loop picks up the answers in collect(). Documents are numbered in arrival
+// order, so each posting list is an ascending run of document numbers stored
+// as varint deltas in blocks of SEARCH_BLOCK entries; every block keeps its
+// first number and byte offset, so a query can start from the newest block
+// and probe other lists without decoding them whole. The worker signals an
+// eventfd whenever it publishes answers, so the loop can sleep on it.
+class SearchIndex : public HistoryLogVisitor {
+
+public:
+  SearchIndex();
+  ~SearchIndex();
+
+  static void tokenize(const std::string &text, std::vector<std::string> &tokens);
+
+  bool start();
+  void stop();
+  void begin();
+  bool visit(const std::string &channel, unsigned long seq, unsigned long timeMs, const std::string &line);
+  void finish();
+  void add(const std::string &channel, unsigned long seq, unsigned long timeMs, const std::string &line);
+  void forget(const std::string &channel);
+  void submit(const SearchQuery &query);
+  void collect(std::vector<SearchResult> &results);
+  int getNotifyFd() const;
+  void clearNotify();
+  bool hasOutstanding() const;
+  SearchStats getStats() const;
+
+private:
+  struct Document {
+    unsigned long seq;
+    unsigned long timeMs;
+    unsigned int channel;
+    unsigned int nick;
+  };
+
+  struct Block {
+    unsigned long first;
+    std::size_t offset;
+  };
+
+  struct PostingList {
+    std::string bytes;
+    std::vector<Block> blocks;
+    unsigned long last;
+    std::size_t count;
+    std::size_t lastBlockCount;
+  };
+
+  struct Incoming {
+    std::string channel;
+    unsigned long seq;
+    unsigned long timeMs;
+    std::string line;
+  };
+
+  // A posting list being probed in descending document order.
+  struct Cursor {
+    const PostingList *list;
+    std::size_t block;
+    std::vector<unsigned long> decoded;
+  };
+
+  SearchIndex(const SearchIndex &other);
+  SearchIndex &operator=(const SearchIndex &other);
+
+  static void *workerMain(void *arg);
+  void workerLoop();
+  void index(const Incoming &incoming);
+  void forgetOldest();
+  void compact();
+  void compactNames();
+  void run(const SearchQuery &query, SearchResult &result);
+  bool accepts(const Document &document, const std::vector<bool> &channels, unsigned int nick,
+               const SearchQuery &query) const;
+  std::size_t decodeBlock(const PostingList &list, std::size_t block, std::vector<unsigned long> &out) const;
+  bool contains(Cursor &cursor, unsigned long doc, std::size_t &budget) const;
+  static unsigned int intern(std::map<std::string, unsigned int> &ids, std::vector<std::string> &names,
+                             const std::string &name);
+
+  // Worker thread only once it is running.
+  std::deque<Document> _docs;
+  unsigned long _first_doc;
+  unsigned long _compacted_floor;
+  std::map<std::string, PostingList> _postings;
+  std::map<std::string, unsigned int> _channel_ids;
+  std::vector<std::string> _channel_names;
+  std::map<std::string, unsigned int> _nick_ids;
+  std::vector<std::string> _nick_names;
+  std::size_t _posting_bytes;
+  std::vector<std::string> _scratch_tokens;
+
+  // Written by the worker, read by the loop; set up before the worker starts.
+  int _notify_fd;
+
+  // Shared, under _lock.
+  mutable pthread_mutex_t _lock;
+  pthread_cond_t _wake;
+  pthread_t _worker;
+  bool _running;
+  bool _stopping;
+  bool _seeding;
+  std::vector<Incoming> _incoming;
+  std::vector<Incoming> _deferred;
+  std::vector<SearchQuery> _queries;
+  std::vector<SearchResult> _results;
+  std::size_t _outstanding;
+  SearchStats _stats;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <arpa/inet.h>
 #include <cstdlib>
+#include <deque>
 #include <cstring>
 #include <fcntl.h>
 #include <map>
@@ -19,6 +20,13 @@
 #include "./Channel.hpp"
 #include "./Client.hpp"
 #include "./IRCMessage.hpp"
+#include "./AdmissionTable.hpp"
+#include "./HistoryStore.hpp"
+#include "./HotRestart.hpp"
+#include "./ObjectPool.hpp"
+#include "./SearchIndex.hpp"
+#include "./TimerWheel.hpp"
+#include "./UringBackend.hpp"
 
 enum errorCode {
 
@@ -30,6 +38,7 @@ enum errorCode {
   ERR_BANNEDFROMCHAN = 474, //"<channel> :Cannot join channel (+b)"
   ERR_BADCHANNELKEY = 475, //"<channel> :Cannot join channel (+k)"
   ERR_BADCHANMASK = 476, //"<channel> :Bad Channel Mask"
+  ERR_BANLISTFULL = 478, //"<channel> <char> :Channel list is full"
   
   //Erros de Permissão e Moderação (Comandos KICK, MODE, TOPIC, INVITE)
   ERR_CHANOPRIVSNEEDED = 482, //"<channel> :You're not channel operator"
@@ -38,11 +47,13 @@ enum errorCode {
   ERR_USERONCHANNEL = 443, //"<user> <channel> :is already on channel"
   ERR_KEYSET = 467, //"<channel> :Channel key already set"
   ERR_UNKNOWNMODE = 472, //"<char> :is unknown mode char to me"
+  ERR_INVALIDMODEPARAM = 696, //"<target> <mode char> <parameter> :Invalid mode parameter"
 
   //Erros de Comunicação (Comandos PRIVMSG e NOTICE)
   ERR_CANNOTSENDTOCHAN = 404, //"<channel name> :Cannot send to channel"
   ERR_NORECIPIENT = 411, //":No recipient given (<command>)"
   ERR_NOTEXTTOSEND = 412, //":No text to send"
+  ERR_TOOMANYTARGETS = 407, //"<target> :Too many recipients. No message delivered"
 
   //Erros Genéricos de Comando
   ERR_NEEDMOREPARAMS = 461, //"<command> :Not enough parameters"
@@ -59,6 +70,118 @@ enum errorCode {
   ERR_PASSWDMISMATCH = 464, //":Password incorrect"
 };
 
+enum FlushMode {
+  FLUSH_LATENCY,   // flush dirty clients at the end of every loop iteration
+  FLUSH_THROUGHPUT // hold output for a micro-window so more replies share a send()
+};
+
+enum EventBackend {
+  BACKEND_POLL,
+  BACKEND_URING
+};
+
+// Defaults for the settings main() reads from the environment.
+const unsigned long DEFAULT_FLUSH_WINDOW_US = 500;
+const std::size_t DEFAULT_MAX_CLIENTS = 1000;
+const std::size_t DEFAULT_MAX_PER_IP = 256;
+const std::size_t DEFAULT_MAX_CONN_RATE = 200;
+const unsigned long DEFAULT_HISTORY_MAX_MB = 256;
+const unsigned long DEFAULT_KEEPALIVE_SECONDS = 120;
+const unsigned long DEFAULT_PING_TIMEOUT_SECONDS = 60;
+const unsigned long DEFAULT_REGISTRATION_TIMEOUT_SECONDS = 60;
+const unsigned long DEFAULT_FLOOD_MODERATE_SECONDS = 30;
+
+struct ServerStats {
+  unsigned long pollCalls;
+  unsigned long acceptCalls;
+  unsigned long recvCalls;
+  unsigned long sendCalls;
+  unsigned long commands;
+  unsigned long queuedWrites;
+  unsigned long coalescedWrites;
+  unsigned long acceptCompletions;
+  unsigned long recvCompletions;
+  unsigned long channelsCreated;
+  unsigned long channelsReclaimed;
+  unsigned long listEntries;
+  unsigned long deferredClients;
+  unsigned long loopIterations;
+  unsigned long lastLoopUs;
+  unsigned long maxLoopUs;
+  unsigned long broadcastJobs;
+  unsigned long broadcastJobsDone;
+  unsigned long broadcastDeliveries;
+  unsigned long floodDropped;
+  unsigned long floodTrips;
+  unsigned long rejectedGlobal;
+  unsigned long rejectedPerIp;
+  unsigned long rejectedRate;
+  unsigned long historyQueries;
+  unsigned long historyReplayed;
+  unsigned long historyRefused;
+  unsigned long searchQueries;
+  unsigned long searchRefused;
+  unsigned long implicitNames;
+  unsigned long implicitNamesSkipped;
+  unsigned long upgradeClients;
+  unsigned long upgradeChannels;
+  unsigned long upgradeUs;
+  unsigned long upgradeFailures;
+};
+
+// A LIST in progress. Channels are walked in name order, or in member-count
+// order when a user-count bound is given, and each loop iteration resumes
+// after the last channel examined. Ages are in seconds, -1 when unset. Name
+// masks use the same compiled matcher and case folding as +b/+e/+I.
+struct ListQuery {
+  unsigned long clientId;
+  std::vector<std::string> names;
+  std::size_t nextName;
+  MaskList masks;
+  MaskList excludedMasks;
+  std::size_t minUsers;
+  std::size_t maxUsers;
+  long minCreatedAge;
+  long maxCreatedAge;
+  long minTopicAge;
+  long maxTopicAge;
+  bool bySize;
+  bool started;
+  std::size_t lastSize;
+  std::string lastName;
+};
+
+// A CHATHISTORY or SEARCH reply in progress: the matching lines are captured
+// when the command arrives and streamed a slice per loop iteration. For
+// clients with the batch capability the lines are framed as a batch of the
+// given type ("chathistory #chan"); ref is assigned when it opens.
+struct HistoryReplay {
+  unsigned long clientId;
+  std::vector<HistoryRef> lines;
+  std::size_t next;
+  std::string batch;
+  std::string ref;
+};
+
+// A channel broadcast too large to run inline. Members are visited in fd
+// order, resuming after lastFd, one slice per loop iteration; only those who
+// had joined by joinSeq, the server's join sequence number when the line was
+// sent, receive it. With a non-zero epoch the line is one target of a
+// deduplicated fan-out: members stamped with the epoch, already in one of
+// skipChannels at joinSeq or listed in skipFds were reached through another
+// target and are skipped.
+struct BroadcastJob {
+  std::string message;
+  int excludeFd;
+  unsigned long epoch;
+  unsigned long joinSeq;
+  std::vector<std::string> skipChannels;
+  std::vector<int> skipFds;
+  bool operatorsOnly;
+  bool started;
+  int lastFd;
+};
+
 class Server {
 
 public:
@@ -70,6 +193,14 @@ public:
   Server operator=(Server const &other);
 
   void run();
+  void setFlushPolicy(FlushMode mode, unsigned long windowUs);
+  void setBackend(EventBackend backend);
+  void setAdmissionLimits(std::size_t maxClients, std::size_t maxPerIp, std::size_t maxPerSecond);
+  void setHistoryLog(const std::string &directory, unsigned long maxBytes);
+  void setClientTimeouts(unsigned long keepaliveMs, unsigned long pingTimeoutMs, unsigned long registrationMs);
+  void setFloodModeration(unsigned long moderateMs);
+  void setUpgradeCommand(const std::vector<std::string> &command);
+  void setUpgradeSocket(int socket);
 
 private:
   // Type alias for command handler function pointers
@@ -82,56 +213,177 @@ private:
   std::vector<Client*> _clients;
   std::map<std::string, Channel *> _channels;
   std::vector<pollfd> _poll_fds;
+  std::vector<int> _poll_index;
   std::set<int> _welcomed_clients;
   std::map<std::string, MessageHandler> _message_handlers;
+  std::map<int, Client *> _clients_by_fd;
+  std::map<std::string, Client *> _clients_by_nick;
+  std::map<std::string, std::set<int> > _monitor_watchers;
+  unsigned long _next_client_id;
+  TimerWheel _timers;
+  ObjectPool<Client> _client_pool;
+  ObjectPool<Channel> _channel_pool;
+  AdmissionTable _admission;
+  std::size_t _max_clients;
+  unsigned long _keepalive_ms;
+  unsigned long _ping_timeout_ms;
+  unsigned long _registration_timeout_ms;
+  unsigned long _flood_moderate_ms;
+  std::vector<int> _dirty_fds;
+  std::vector<Channel *> _reclaim_channels;
+  unsigned long _delivery_epoch;
+  unsigned long _join_seq;
+  std::set<std::pair<std::size_t, std::string> > _channels_by_size;
+  std::map<int, ListQuery> _list_queries;
+  bool _list_backlog;
+  HistoryStore _history;
+  std::string _history_dir;
+  unsigned long _history_max_bytes;
+  std::map<int, std::deque<HistoryReplay> > _history_replays;
+  bool _history_backlog;
+  SearchIndex _search;
+  unsigned long _next_search_id;
+  std::vector<SearchResult> _search_results;
+  std::map<unsigned long, std::size_t> _searches_in_flight;
+  unsigned long _next_batch_id;
+  std::deque<std::pair<int, unsigned long> > _ready_clients;
+  std::map<Channel *, std::deque<BroadcastJob> > _broadcast_jobs;
+  FlushMode _flush_mode;
+  unsigned long _flush_window_us;
+  unsigned long _flush_deadline;
+  ServerStats _stats;
+  EventBackend _backend;
+  UringBackend *_uring;
+  std::vector<std::string> _upgrade_command;
+  int _upgrade_socket;
+  unsigned long _upgrade_deadline;
+  bool _handed_off;
 
   bool canJoin(const Client &client, const Channel &channel, const std::string &key, errorCode &error) const;
 
   void initSocket(const int PORT);
   void setNonBlocking(int fd);
+  void runPoll();
+  void runUring();
+  void handleUringEvent(const UringEvent &event);
   void acceptClient();
+  bool admitConnection(const int CLIENT_SOCKET, unsigned int addr);
+  void registerClient(const int CLIENT_SOCKET, unsigned int addr);
+  Client *attachClient(const int CLIENT_SOCKET, unsigned long id, unsigned int addr);
+  void queueBufferedClients();
   void handleClientData(Client &client);
-  void removeClient(size_t index);
+  void processClientInput(Client &client, const char *data, std::size_t length);
+  void runClientCommands(Client &client);
+  void serveReadyClients();
+  void recordLoopLatency(unsigned long startUs);
+  void handleHangup(Client &client);
+  void removeClient(size_t index, const std::string &quitReason);
+  void removeClientByFd(int fd, const std::string &quitReason);
+  void notifyNeighbors(Client &client, const std::string &line);
+  void fanOut(Channel &channel, const std::string &message, int excludeFd, bool operatorsOnly = false);
+  void fanOutOnce(const std::vector<std::pair<Channel *, std::string> > &targets, int excludeFd, unsigned long epoch,
+                  const std::vector<int> &directFds);
+  bool needsSlicing(Channel &channel) const;
+  BroadcastJob makeBroadcastJob(const std::string &message, int excludeFd, unsigned long epoch) const;
+  void queueBroadcast(Channel &channel, const BroadcastJob &job);
+  void runBroadcastJobs();
+  bool advanceBroadcast(Channel &channel, BroadcastJob &job, std::size_t &budget);
+  bool reachedElsewhere(const BroadcastJob &job, Client &member) const;
   void processCommand(Client &client, const std::string &command);
+  void disconnectClient(Client &client, const std::string &reason);
+  void scheduleTimer(TimerKind kind, const Client &client, unsigned long expires, const std::string &channel = "");
+  void processTimers();
+  void handleTimer(const Timer &timer);
+  bool admitFlood(Client &client, Channel &channel);
+  void liftModeration(const std::string &channelName);
 
   void sendError(Client &client, const std::string &code, const std::string &message);
   void sendError(Client &client, errorCode code, const std::string &context,
                  const std::string &channel = "", const std::string &command = "");
   void sendReply(Client &client, const std::string &message);
+  std::string formatReply(const std::string &message) const;
+  std::string namesReply(const Client &client, const Channel &channel) const;
   void sendRaw(Client &client, const std::string &message);
   void flushClientOutput(Client &client);
+  void flushDirtyClients();
+  void updatePollInterest(const Client &client);
+  void pauseReading(Client &client);
+  void resumeReading(Client &client);
+  void armClientRecv(Client &client);
+  long nextWakeupUs() const;
+  int pollEvents();
   const std::string &getServerName() const;
   std::vector<std::string> splitCommand(const std::string &command);
+  std::vector<std::string> splitList(const std::string &list, bool keepEmpty = false) const;
   std::string getClientChannels(const Client &client) const;
   Client *findClientByNick(const std::string &nick);
+  Client *findClientByFd(int fd);
 
   void handleTOPIC(Client &client, const IRCMessage &msg);
   void handleKICK(Client &client, const IRCMessage &msg);
   void handleJOIN(Client &client, const IRCMessage &msg);
   void handlePART(Client &client, const IRCMessage &msg);
   void handlePRIVMSG(Client &client, const IRCMessage &msg);
+  void handleNOTICE(Client &client, const IRCMessage &msg);
+  void relayMessage(Client &client, const IRCMessage &msg, const std::string &command);
   void handlePING(Client &client, const IRCMessage &msg);
+  void handlePONG(Client &client, const IRCMessage &msg);
   void handleWHOIS(Client &client, const IRCMessage &msg);
   void handleMODE(Client &client, const IRCMessage &msg);
   void handleLIST(Client &client, const IRCMessage &msg);
   void handleNAMES(Client &client, const IRCMessage &msg);
   void handlePASS(Client &client, const IRCMessage &msg);
   void handleCAP(Client &client, const IRCMessage &msg);
+  void sendCapList(Client &client, const std::string &subcommand, const std::vector<std::string> &names);
   void handleNICK(Client &client, const IRCMessage &msg);
   void handleUSER(Client &client, const IRCMessage &msg);
   void handleQUIT(Client &client, const IRCMessage &msg);
   void handleINVITE(Client &client, const IRCMessage &msg);
+  void handleSTATS(Client &client, const IRCMessage &msg);
+  void handleMONITOR(Client &client, const IRCMessage &msg);
+  void handleCHATHISTORY(Client &client, const IRCMessage &msg);
+  void sendHistoryTargets(Client &client, const std::vector<std::string> &args);
+  void handleSEARCH(Client &client, const IRCMessage &msg);
+  void notifyMonitors(const Client &subject, const std::string &nick, bool online);
+  void dropMonitors(Client &client);
+  void sendMonitorStatus(Client &client, const std::vector<std::string> &nicks);
+  void sendNickBatch(Client &client, const std::string &code, const std::vector<std::string> &items);
 
   void sendWelcome(Client &client);
   void sendISupport(Client &client);
   void sendMOTD(Client &client);
+  void sendMaskList(Client &client, const Channel &channel, char mode);
+  std::vector<std::string> getStatsReport() const;
 
   void broadcastToChannel(const std::string &channelName, const std::string &message, Client *exclude = NULL);
 
   Channel *getChannels(const std::string &name);
+  void joinChannel(Client &client, Channel &channel);
+  void leaveChannel(Client &client, Channel &channel);
+  void releaseChannel(Channel &channel);
+  void detachChannel(Channel &channel);
+  void reclaimChannels();
+  void trimPools();
+  void reindexChannel(const Channel &channel, std::size_t previousSize);
+  void pumpListQueries();
+  bool advanceListQuery(Client &client, ListQuery &query);
+  void queueHistoryReplay(Client &client, const HistoryReplay &replay);
+  bool isHistoryBacklogFull(const Client &client) const;
+  void pumpHistoryReplays();
+  std::string nextBatchRef();
+  void collectHistoryLog();
+  void collectSearchResults();
+  bool advanceHistoryReplay(Client &client, HistoryReplay &replay);
 
   void checkAndSendWelcome(Client &client);
 
+  bool pumpHandOff();
+  bool handOff();
+  bool quiesceUring();
+  void resumeUring();
+  void saveState(HotRestart &restart, unsigned long startedUs);
+  void restoreState(HotRestart &restart, unsigned long startedUs);
+
   bool isValidChannelName(const std::string &name) const;
 };
 
@@ -0,0 +1,60 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <string>
+#include <vector>
+
+const unsigned long TIMER_TICK_MS = 1000;
+const std::size_t TIMER_WHEEL_BITS = 6;
+const std::size_t TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+const std::size_t TIMER_WHEEL_LEVELS = 3;
+
+enum TimerKind {
+  TIMER_KEEPALIVE,
+  TIMER_PING_TIMEOUT,
+  TIMER_REGISTRATION,
+  TIMER_INVITE_EXPIRY,
+  TIMER_UNMODERATE
+};
+
+// Timers carry the fd together with the client id so that a timer armed for a
+// closed connection never fires on a newer client that reused the same fd.
+// Channel timers (TIMER_UNMODERATE) have no client and use fd -1.
+struct Timer {
+  TimerKind kind;
+  int fd;
+  unsigned long clientId;
+  unsigned long expires;
+  std::string channel;
+};
+
+// Hierarchical timing wheel (3 levels x 64 slots, 1 second ticks).
+// Scheduling and expiry are O(1); timers are rounded up to the tick so that
+// every timer due in the same second is handled by a single wakeup.
+class TimerWheel {
+
+public:
+  TimerWheel();
+  ~TimerWheel();
+
+  static unsigned long nowMs();
+  static unsigned long nowUs();
+
+  void schedule(const Timer &timer);
+  void advance(unsigned long now, std::vector<Timer> &expired);
+  int pollTimeout(unsigned long now) const;
+  std::size_t size() const;
+
+private:
+  TimerWheel(const TimerWheel &other);
+  TimerWheel &operator=(const TimerWheel &other);
+
+  void insert(const Timer &timer);
+  void cascade(std::size_t level);
+
+  unsigned long _current;
+  std::size_t _size;
+  std::vector<Timer> _slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+#endif
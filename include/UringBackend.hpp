@@ -0,0 +1,109 @@
+#ifndef URINGBACKEND_HPP
+#define URINGBACKEND_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+enum UringEventType {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_SEND,
+  URING_CANCEL,
+  URING_WAKEUP
+};
+
+// One completion handed back to the Server. For URING_RECV, data points into
+// a provided buffer that stays valid until the next call to wait().
+struct UringEvent {
+  UringEventType type;
+  int fd;
+  unsigned long tag;
+  int result;
+  const char *data;
+  bool more;
+};
+
+// Optional io_uring event loop backend built directly on the raw syscalls:
+// multishot accept, multishot recv into a provided buffer ring and sends that
+// are queued during the iteration and submitted with the next wait(). A
+// multishot poll on a wakeup fd lets other threads end a wait().
+class UringBackend {
+
+public:
+  UringBackend();
+  ~UringBackend();
+
+  bool init();
+  const std::string &getError() const;
+
+  void armAccept(int listenFd);
+  void armWakeup(int fd);
+  void armRecv(int fd, unsigned long tag);
+  bool submitSend(int fd, unsigned long tag, std::string &data);
+  void cancel(int fd);
+  void cancelRecv(int fd, unsigned long tag);
+  void closeClient(int fd, unsigned long tag, const std::string &data);
+  void disarmAccept();
+  int wait(long timeoutUs, std::vector<UringEvent> &events);
+
+  static unsigned long tagOf(unsigned long clientId);
+  unsigned long getEnterCalls() const;
+  unsigned long getCompletions() const;
+  bool hasPendingSends() const;
+
+private:
+  // A send of a client being closed carries the bytes queued after it in
+  // tail; they go out, and the fd is closed, once it completes.
+  struct PendingSend {
+    int fd;
+    std::size_t offset;
+    std::string data;
+    bool closing;
+    std::string tail;
+  };
+
+  UringBackend(const UringBackend &other);
+  UringBackend &operator=(const UringBackend &other);
+
+  void *getSqe();
+  void prepSend(unsigned long userData, const PendingSend &pending);
+  void finishClose(const PendingSend &pending);
+  int enter(unsigned minComplete, long timeoutUs);
+  void reap(std::vector<UringEvent> &events);
+  void recycleBuffers();
+  void release();
+
+  int _ring_fd;
+  std::string _error;
+
+  void *_sq_ring;
+  void *_cq_ring;
+  void *_sqes;
+  std::size_t _sq_ring_size;
+  std::size_t _cq_ring_size;
+  std::size_t _sqes_size;
+
+  unsigned *_sq_head;
+  unsigned *_sq_tail;
+  unsigned _sq_mask;
+  unsigned _sq_entries;
+  unsigned _sq_local_tail;
+  unsigned *_cq_head;
+  unsigned *_cq_tail;
+  unsigned _cq_mask;
+  void *_cqes;
+
+  void *_buf_ring;
+  char *_buffers;
+  unsigned short _buf_tail;
+  std::vector<unsigned short> _recycle;
+
+  int _listen_fd;
+  int _wakeup_fd;
+  std::map<unsigned long, PendingSend> _sends;
+  unsigned long _enter_calls;
+  unsigned long _completions;
+};
+
+#endif
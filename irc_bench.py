@@ -0,0 +1,379 @@
+#!/usr/bin/env python3
+"""
+IRC Server Bench - gerador de carga para ircserv
+
+Uso:
+    python3 irc_bench.py                          # servidor já rodando (6667, passw)
+    python3 irc_bench.py --spawn poll,uring       # sobe ./ircserv com cada backend e compara
+    python3 irc_bench.py --scenario joinflood     # N entradas num canal, com e sem +u
+    python3 irc_bench.py --scenario bans          # custo de JOIN sem bans e com --bans máscaras
+    python3 irc_bench.py --scenario massjoin      # --bots entrando em canais cheios, com e sem NAMES implícito
+
+O cenário privmsg reporta throughput (linhas entregues/s) e syscalls por
+mensagem, lidas do contador de syscalls exposto pelo comando STATS do servidor.
+O cenário joinflood mede quantas linhas e bytes os clientes recebem enquanto
+N usuários entram num canal, normal e em modo auditório (+u). O cenário bans
+mede JOINs/s num canal sem bans e com a lista +b cheia de máscaras que não
+casam com ninguém, o pior caso da verificação. O cenário massjoin mede os
+bytes que --bots clientes recebem ao entrar em 10 canais com N membros cada,
+primeiro como clientes clássicos e depois com draft/no-implicit-names.
+"""
+
+import argparse
+import os
+import re
+import select
+import socket
+import subprocess
+import sys
+import time
+
+
+class Color:
+    GREEN = '\033[92m'
+    RED = '\033[91m'
+    YELLOW = '\033[93m'
+    CYAN = '\033[96m'
+    END = '\033[0m'
+
+
+BACKEND_ENV = {
+    'poll': {'IRCSERV_BACKEND': 'poll'},
+    'uring': {'IRCSERV_BACKEND': 'uring'},
+    'poll-throughput': {'IRCSERV_BACKEND': 'poll', 'IRCSERV_FLUSH_MODE': 'throughput'},
+    'uring-throughput': {'IRCSERV_BACKEND': 'uring', 'IRCSERV_FLUSH_MODE': 'throughput'},
+}
+
+
+class BenchClient:
+    def __init__(self, host, port, password, nick):
+        self.nick = nick
+        self.sock = socket.create_connection((host, port))
+        self.sock.setblocking(False)
+        self.inbox = b""
+        self.received_bytes = 0
+        self.outbox = f"PASS {password}\r\nNICK {nick}\r\nUSER {nick} 0 * :{nick}\r\n".encode()
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    def queue(self, line):
+        self.outbox += line.encode() + b"\r\n"
+
+    def pump_write(self):
+        if not self.outbox:
+            return
+        try:
+            sent = self.sock.send(self.outbox)
+            self.outbox = self.outbox[sent:]
+        except BlockingIOError:
+            pass
+
+    def pump_read(self):
+        try:
+            data = self.sock.recv(65536)
+        except BlockingIOError:
+            return
+        self.received_bytes += len(data)
+        self.inbox += data
+
+    def count(self, token):
+        return self.inbox.count(token)
+
+    def close(self):
+        self.sock.close()
+
+
+class IRCBench:
+    def __init__(self, host='127.0.0.1', port=6667, password='passw'):
+        self.host = host
+        self.port = port
+        self.password = password
+
+    def connect(self, count, prefix):
+        return [BenchClient(self.host, self.port, self.password, f"{prefix}{i}") for i in range(count)]
+
+    def pump(self, clients, done, timeout=60.0):
+        """Move dados em todos os sockets até done() ou timeout"""
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            writers = [c for c in clients if c.outbox]
+            readable, writable, _ = select.select(clients, writers, [], 0.05)
+            for c in writable:
+                c.pump_write()
+            for c in readable:
+                c.pump_read()
+            if not writers and done():
+                return True
+        return False
+
+    def syscalls(self):
+        """Soma os contadores de syscalls reportados por STATS"""
+        sock = socket.create_connection((self.host, self.port))
+        sock.sendall(f"PASS {self.password}\r\nNICK statsbot\r\nUSER s 0 * :s\r\nSTATS\r\n".encode())
+        data = b""
+        sock.settimeout(5)
+        while b" 219 " not in data:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        sock.sendall(b"QUIT\r\n")
+        sock.close()
+        match = re.search(rb"syscalls poll (\d+) accept (\d+) recv (\d+) send (\d+) ring_enter (\d+)", data)
+        return sum(int(v) for v in match.groups()) if match else 0
+
+    def scenario_privmsg(self, clients=50, messages=200):
+        """N clientes num canal, cada um envia M PRIVMSGs; mede entrega total"""
+        users = self.connect(clients, "b")
+        for c in users:
+            c.queue("JOIN #bench")
+        self.pump(users, lambda: all(c.count(b"JOIN :#bench") >= 1 for c in users))
+        self.pump(users, lambda: users[0].count(b"JOIN :#bench") >= clients, 10)
+        for c in users:
+            c.inbox = b""
+
+        before = self.syscalls()
+        start = time.time()
+        for i in range(messages):
+            for c in users:
+                c.queue(f"PRIVMSG #bench :{c.nick} message {i}")
+        expected = (clients - 1) * messages
+        ok = self.pump(users, lambda: all(c.count(b"PRIVMSG #bench") >= expected for c in users))
+        elapsed = time.time() - start
+        after = self.syscalls()
+
+        sent = clients * messages
+        delivered = sum(c.count(b"PRIVMSG #bench") for c in users)
+        for c in users:
+            c.close()
+        return {
+            'ok': ok,
+            'sent': sent,
+            'delivered': delivered,
+            'elapsed': elapsed,
+            'throughput': delivered / elapsed if elapsed > 0 else 0,
+            'syscalls_per_msg': (after - before) / float(sent),
+        }
+
+    def scenario_joinflood(self, clients=50, auditorium=False):
+        """Um operador abre o canal (opcionalmente +u) e N clientes entram; mede o tráfego recebido"""
+        channel = "#flood-u" if auditorium else "#flood"
+        owner = self.connect(1, "op-u" if auditorium else "op")
+        owner[0].queue(f"JOIN {channel}")
+        if auditorium:
+            owner[0].queue(f"MODE {channel} +u")
+        self.pump(owner, lambda: owner[0].count(b" 366 ") >= 1, 10)
+        self.pump(owner, lambda: not auditorium or owner[0].count(b"MODE") >= 1, 10)
+        users = self.connect(clients, "ju" if auditorium else "j")
+        everyone = owner + users
+        self.pump(users, lambda: all(c.count(b" 001 ") >= 1 for c in users))
+        for c in everyone:
+            c.inbox = b""
+            c.received_bytes = 0
+
+        start = time.time()
+        for c in users:
+            c.queue(f"JOIN {channel}")
+        ok = self.pump(everyone, lambda: all(c.count(b" 366 ") >= 1 for c in users)
+                       and owner[0].count(b"JOIN") >= clients)
+        self.pump(everyone, lambda: False, 0.3)
+        elapsed = time.time() - start
+
+        lines = sum(c.inbox.count(b"\r\n") for c in everyone)
+        received = sum(c.received_bytes for c in everyone)
+        for c in everyone:
+            c.close()
+        return {
+            'ok': ok,
+            'lines': lines,
+            'bytes': received,
+            'elapsed': elapsed,
+        }
+
+    def scenario_bans(self, clients=50, rounds=200, bans=0):
+        """N clientes fazem JOIN/PART repetidos num canal com `bans` máscaras +b; mede JOINs/s"""
+        channel = f"#bans{bans}"
+        owner = self.connect(1, f"bo{bans}-")
+        owner[0].queue(f"JOIN {channel}")
+        # 70% ancoradas no nick, 20% no host e 10% sem âncora (testadas em todo JOIN)
+        for i in range(bans):
+            if i % 10 < 7:
+                owner[0].queue(f"MODE {channel} +b spam{i}*!*@*")
+            elif i % 10 < 9:
+                owner[0].queue(f"MODE {channel} +b *!*@host{i}.example")
+            else:
+                owner[0].queue(f"MODE {channel} +b *flood{i}*!*@*")
+        owner[0].queue(f"MODE {channel} b")
+        self.pump(owner, lambda: owner[0].count(b" 368 ") >= 1, 30)
+        listed = owner[0].count(b" 367 ")
+
+        users = self.connect(clients, f"bj{bans}-")
+        everyone = owner + users
+        self.pump(users, lambda: all(c.count(b" 001 ") >= 1 for c in users))
+        for c in users:
+            c.inbox = b""
+
+        start = time.time()
+        for c in users:
+            for _ in range(rounds):
+                c.queue(f"JOIN {channel}")
+                c.queue(f"PART {channel}")
+        expected = rounds
+        ok = self.pump(everyone, lambda: all(c.count(b" 366 ") >= expected for c in users))
+        elapsed = time.time() - start
+
+        joins = sum(c.count(b" 366 ") for c in users)
+        banned = sum(c.count(b" 474 ") for c in users)
+        for c in everyone:
+            c.close()
+        return {
+            'ok': ok and listed == bans and banned == 0,
+            'joins': joins,
+            'elapsed': elapsed,
+            'rate': joins / elapsed if elapsed > 0 else 0,
+        }
+
+    def scenario_massjoin(self, clients=50, bots=20, no_names=False):
+        """N membros ocupam 10 canais e `bots` clientes entram em todos; mede o tráfego recebido pelos bots"""
+        tag = "nn" if no_names else "mj"
+        channels = [f"#{tag}{i}" for i in range(10)]
+        members = self.connect(clients, f"{tag}m")
+        for c in members:
+            c.queue("JOIN " + ",".join(channels))
+        self.pump(members, lambda: all(c.count(b" 366 ") >= len(channels) for c in members))
+        joiners = self.connect(bots, f"{tag}b")
+        for c in joiners:
+            if no_names:
+                c.queue("CAP REQ :draft/no-implicit-names")
+        self.pump(joiners, lambda: all(c.count(b" 001 ") >= 1 and (not no_names or c.count(b" ACK ") >= 1)
+                                       for c in joiners))
+        everyone = members + joiners
+        for c in joiners:
+            c.inbox = b""
+            c.received_bytes = 0
+
+        start = time.time()
+        for c in joiners:
+            c.queue("JOIN " + ",".join(channels))
+        own = lambda c: c.count(f":{c.nick}!{c.nick}@localhost JOIN".encode())
+        ok = self.pump(everyone, lambda: all(own(c) >= len(channels) for c in joiners))
+        self.pump(everyone, lambda: False, 0.3)
+        elapsed = time.time() - start
+
+        names = sum(c.count(b" 353 ") for c in joiners)
+        received = sum(c.received_bytes for c in joiners)
+        for c in everyone:
+            c.close()
+        return {
+            'ok': ok and (names == 0) == no_names,
+            'names': names,
+            'bytes': received,
+            'elapsed': elapsed,
+        }
+
+    def run_massjoin(self, label, args):
+        ok = True
+        classic = None
+        for no_names in (False, True):
+            result = self.scenario_massjoin(args.clients, args.bots, no_names)
+            color = Color.GREEN if result['ok'] else Color.RED
+            mode = "sem NAMES" if no_names else "classico"
+            saved = ""
+            if classic is None:
+                classic = result['bytes']
+            elif classic > 0:
+                saved = f"  economia {100.0 * (classic - result['bytes']) / classic:5.1f}%"
+            print(f"{color}{label:18}{Color.END} {mode:9}  353 {result['names']:6d}  bytes {result['bytes']:10d}  "
+                  f"{result['elapsed']:6.2f}s{saved}")
+            ok = result['ok'] and ok
+        return ok
+
+    def run_bans(self, label, args):
+        ok = True
+        for bans in (0, args.bans):
+            result = self.scenario_bans(args.clients, args.rounds, bans)
+            color = Color.GREEN if result['ok'] else Color.RED
+            print(f"{color}{label:18}{Color.END} bans {bans:4d}  joins {result['joins']:7d}  "
+                  f"{result['rate']:9.0f} JOINs/s")
+            ok = result['ok'] and ok
+        return ok
+
+    def run_joinflood(self, label, args):
+        ok = True
+        for auditorium in (False, True):
+            result = self.scenario_joinflood(args.clients, auditorium)
+            color = Color.GREEN if result['ok'] else Color.RED
+            mode = "+u" if auditorium else "normal"
+            print(f"{color}{label:18}{Color.END} {mode:6}  linhas {result['lines']:8d}  bytes {result['bytes']:10d}  "
+                  f"{result['elapsed']:6.2f}s")
+            ok = result['ok'] and ok
+        return ok
+
+    def run(self, label, args):
+        if args.scenario == 'joinflood':
+            return self.run_joinflood(label, args)
+        if args.scenario == 'bans':
+            return self.run_bans(label, args)
+        if args.scenario == 'massjoin':
+            return self.run_massjoin(label, args)
+        result = self.scenario_privmsg(args.clients, args.messages)
+        color = Color.GREEN if result['ok'] else Color.RED
+        print(f"{color}{label:18}{Color.END} enviadas {result['sent']:7d}  entregues {result['delivered']:9d}  "
+              f"{result['throughput']:11.0f} linhas/s  {result['syscalls_per_msg']:6.3f} syscalls/msg")
+        return result['ok']
+
+
+def spawn_server(binary, port, password, env_overrides):
+    env = dict(os.environ)
+    env.update(env_overrides)
+    proc = subprocess.Popen([binary, str(port), password], env=env, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    for _ in range(50):
+        if proc.poll() is not None:
+            break
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            return proc
+        except ConnectionRefusedError:
+            time.sleep(0.05)
+    proc.kill()
+    raise RuntimeError("ircserv não subiu")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Gerador de carga para ircserv")
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=6667)
+    parser.add_argument('--password', default='passw')
+    parser.add_argument('--clients', type=int, default=50)
+    parser.add_argument('--messages', type=int, default=200)
+    parser.add_argument('--scenario', default='privmsg', choices=['privmsg', 'joinflood', 'bans', 'massjoin'])
+    parser.add_argument('--bans', type=int, default=500)
+    parser.add_argument('--rounds', type=int, default=200, help="ciclos JOIN/PART por cliente no cenário bans")
+    parser.add_argument('--bots', type=int, default=20, help="clientes entrando nos canais no cenário massjoin")
+    parser.add_argument('--spawn', default='', help="backends a comparar: " + ",".join(BACKEND_ENV))
+    parser.add_argument('--binary', default='./ircserv')
+    args = parser.parse_args()
+
+    print(f"{Color.CYAN}{'=' * 60}{Color.END}")
+    print(f"{Color.CYAN}IRC SERVER BENCH - {args.clients} clientes x {args.messages} mensagens{Color.END}")
+    print(f"{Color.CYAN}{'=' * 60}{Color.END}")
+
+    bench = IRCBench(args.host, args.port, args.password)
+    ok = True
+    if not args.spawn:
+        ok = bench.run(f"{args.host}:{args.port}", args)
+    else:
+        for backend in args.spawn.split(','):
+            proc = spawn_server(args.binary, args.port, args.password, BACKEND_ENV[backend])
+            try:
+                ok = bench.run(backend, args) and ok
+            finally:
+                proc.terminate()
+                proc.wait()
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == "__main__":
+    main()
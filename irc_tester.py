@@ -3,7 +3,10 @@
 IRC Server Tester - Específico para ircserv (porta 6667, senha passw)
 """
 
+import os
+import signal
 import socket
+import subprocess
 import time
 import sys
 import select
@@ -39,12 +42,12 @@ class IRCServTester:
         print(f"{Color.CYAN}   Porta: {self.port}, Senha: '{self.password}'{Color.END}")
         print(f"{Color.CYAN}{'='*60}{Color.END}\n")
     
-    def connect_client(self, nickname="testuser"):
+    def connect_client(self, nickname="testuser", port=None):
         """Conecta um cliente ao servidor"""
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.settimeout(5)
         try:
-            sock.connect((self.host, self.port))
+            sock.connect((self.host, port or self.port))
             return sock
         except ConnectionRefusedError:
             return None
@@ -584,6 +587,874 @@ class IRCServTester:
             self.print_test("Erro handling", TestResult.FAIL, f"Erro: {e}")
             return False
     
+    def expect(self, name, condition, response=""):
+        """Registra uma verificação e devolve se ela passou"""
+        if condition:
+            self.print_test(name, TestResult.PASS)
+        else:
+            self.print_test(name, TestResult.FAIL, f"Resposta: {response[:100]}")
+        return bool(condition)
+    
+    def try_join(self, sock, channel):
+        """Tenta entrar num canal; devolve (entrou, resposta)"""
+        self.send_command(sock, f"JOIN {channel}")
+        time.sleep(0.3)
+        response = self.receive_response(sock)
+        return " JOIN " in response and " 47" not in response, response
+    
+    def test_13_channel_masks(self):
+        """Testa as máscaras +b/+e/+I no JOIN"""
+        print(f"\n{Color.BLUE}[13] Testando máscaras de canal...{Color.END}")
+        
+        op = self.connect_client()
+        banned = self.connect_client()
+        guest = self.connect_client()
+        if not op or not banned or not guest:
+            return False
+        
+        try:
+            self.register_client(op, "maskop")
+            self.register_client(banned, "banned1")
+            self.register_client(guest, "maskguest1")
+            self.send_command(op, "JOIN #maskchan")
+            self.send_command(op, "MODE #maskchan +b bann*!*@*")
+            time.sleep(0.3)
+            self.receive_response(op)
+            
+            success = True
+            joined, response = self.try_join(banned, "#maskchan")
+            success &= self.expect("Ban com glob '*' barra o JOIN (474)", not joined and " 474 " in response, response)
+            
+            self.send_command(op, "MODE #maskchan +e BANNED1!*@*")
+            time.sleep(0.2)
+            joined, response = self.try_join(banned, "#maskchan")
+            success &= self.expect("Exceção +e libera o banido, sem diferenciar caixa", joined, response)
+            
+            self.send_command(op, "MODE #maskchan +i")
+            self.send_command(op, "MODE #maskchan +I maskguest?!*@localhost")
+            time.sleep(0.2)
+            joined, response = self.try_join(guest, "#maskchan")
+            success &= self.expect("Exceção +I com glob '?' libera o canal +i", joined, response)
+            
+            op.close()
+            banned.close()
+            guest.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Máscaras de canal", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_14_invites(self):
+        """Testa o consumo de convites em canal +i"""
+        print(f"\n{Color.BLUE}[14] Testando convites...{Color.END}")
+        
+        op = self.connect_client()
+        guest = self.connect_client()
+        if not op or not guest:
+            return False
+        
+        try:
+            self.register_client(op, "inviteop")
+            self.register_client(guest, "invguest")
+            self.send_command(op, "JOIN #invchan")
+            self.send_command(op, "MODE #invchan +i")
+            time.sleep(0.3)
+            self.receive_response(op)
+            
+            success = True
+            joined, response = self.try_join(guest, "#invchan")
+            success &= self.expect("Canal +i barra quem não foi convidado (473)", not joined and " 473 " in response, response)
+            
+            self.send_command(op, "INVITE invguest #invchan")
+            time.sleep(0.2)
+            response = self.receive_response(op)
+            success &= self.expect("INVITE confirma com 341", " 341 " in response, response)
+            joined, response = self.try_join(guest, "#invchan")
+            success &= self.expect("Convite libera um JOIN", joined, response)
+            
+            self.send_command(guest, "PART #invchan")
+            time.sleep(0.2)
+            self.receive_response(guest)
+            joined, response = self.try_join(guest, "#invchan")
+            success &= self.expect("Convite é consumido no JOIN", not joined and " 473 " in response, response)
+            
+            op.close()
+            guest.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Convites", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_15_monitor(self):
+        """Testa MONITOR e seus numéricos"""
+        print(f"\n{Color.BLUE}[15] Testando MONITOR...{Color.END}")
+        
+        watcher = self.connect_client()
+        online = self.connect_client()
+        if not watcher or not online:
+            return False
+        
+        try:
+            self.register_client(watcher, "monwatch")
+            self.register_client(online, "monpeer")
+            time.sleep(0.2)
+            self.receive_response(watcher)
+            
+            success = True
+            self.send_command(watcher, "MONITOR + monpeer,monghost")
+            time.sleep(0.3)
+            response = self.receive_response(watcher)
+            success &= self.expect("MONITOR +: online (730) e offline (731)",
+                                   " 730 " in response and "monpeer" in response
+                                   and " 731 " in response and "monghost" in response, response)
+            
+            self.send_command(watcher, "MONITOR L")
+            time.sleep(0.3)
+            response = self.receive_response(watcher)
+            success &= self.expect("MONITOR L: lista (732) e fim (733)", " 732 " in response and " 733 " in response, response)
+            
+            ghost = self.connect_client()
+            self.register_client(ghost, "monghost")
+            time.sleep(0.3)
+            response = self.receive_response(watcher)
+            success &= self.expect("Aviso 730 quando o monitorado entra", " 730 " in response and "monghost" in response, response)
+            
+            ghost.close()
+            time.sleep(0.3)
+            response = self.receive_response(watcher)
+            success &= self.expect("Aviso 731 quando o monitorado sai", " 731 " in response and "monghost" in response, response)
+            
+            # MONITOR=30 no ISUPPORT; duas entradas já estão na lista
+            names = ",".join(f"monfill{i}" for i in range(30))
+            self.send_command(watcher, f"MONITOR + {names}")
+            time.sleep(0.3)
+            response = self.receive_response(watcher)
+            success &= self.expect("Lista cheia responde 734", " 734 " in response, response)
+            
+            watcher.close()
+            online.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("MONITOR", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def privmsg_texts(self, response):
+        """Textos das PRIVMSG de uma resposta, na ordem"""
+        lines = [line.split(' ', 1)[1] if line.startswith('@') else line
+                 for line in response.split('\r\n')]
+        return [line.split(' :', 1)[1] for line in lines
+                if ' PRIVMSG ' in line and ' :' in line]
+    
+    def test_16_chathistory(self):
+        """Testa CHATHISTORY BEFORE/AFTER/BETWEEN nas bordas"""
+        print(f"\n{Color.BLUE}[16] Testando CHATHISTORY...{Color.END}")
+        
+        sock = self.connect_client()
+        if not sock:
+            return False
+        
+        try:
+            # message-tags traz o msgid de cada linha do histórico
+            self.send_command(sock, "CAP REQ :message-tags")
+            self.register_client(sock, "histuser")
+            self.send_command(sock, "CAP END")
+            self.send_command(sock, "JOIN #histchan")
+            time.sleep(0.2)
+            self.receive_response(sock)
+            
+            for i in range(10):
+                self.send_command(sock, f"PRIVMSG #histchan :linha{i}")
+            time.sleep(0.3)
+            self.receive_response(sock)
+            
+            self.send_command(sock, "CHATHISTORY LATEST #histchan * 10")
+            time.sleep(0.3)
+            response = self.receive_response(sock)
+            ids = [line.split('msgid=', 1)[1].split(';')[0].split(' ')[0]
+                   for line in response.split('\r\n') if ' PRIVMSG ' in line and 'msgid=' in line]
+            if not self.expect("CHATHISTORY LATEST com msgid", len(ids) == 10, response):
+                sock.close()
+                return False
+            
+            cases = [
+                ("BEFORE exclui a referência", f"BEFORE #histchan msgid={ids[5]} 2", ["linha3", "linha4"]),
+                ("AFTER exclui a referência", f"AFTER #histchan msgid={ids[5]} 2", ["linha6", "linha7"]),
+                ("BEFORE da primeira linha vem vazio", f"BEFORE #histchan msgid={ids[0]} 5", []),
+                ("BETWEEN exclui as duas pontas", f"BETWEEN #histchan msgid={ids[2]} msgid={ids[6]} 10",
+                 ["linha3", "linha4", "linha5"]),
+                ("BETWEEN invertido guarda as mais novas", f"BETWEEN #histchan msgid={ids[6]} msgid={ids[2]} 2",
+                 ["linha4", "linha5"]),
+            ]
+            success = True
+            for name, command, expected in cases:
+                self.send_command(sock, f"CHATHISTORY {command}")
+                time.sleep(0.3)
+                texts = self.privmsg_texts(self.receive_response(sock))
+                success &= self.expect(name, texts == expected, f"Esperado {expected}, veio {texts}")
+            
+            sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("CHATHISTORY", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_17_tag_limits(self):
+        """Testa os limites de tamanho das tags (IRCv3 message-tags)"""
+        print(f"\n{Color.BLUE}[17] Testando limites de tags...{Color.END}")
+        
+        sock = self.connect_client()
+        if not sock:
+            return False
+        
+        try:
+            self.register_client(sock, "taguser")
+            time.sleep(0.2)
+            self.receive_response(sock)
+            
+            # Tags do cliente: cada '+tag' conta com o separador, até 4094 bytes
+            cases = [
+                ("Tags de cliente com 4094 bytes", "@+a=" + "x" * 4090, True),
+                ("Tags de cliente com 4095 bytes (417)", "@+a=" + "x" * 4091, False),
+                # Seção inteira: '@', tags e espaço cabem em 8191 bytes
+                ("Seção de tags com 8191 bytes", "@a=" + "y" * 8187, True),
+                ("Seção de tags com 8192 bytes (417)", "@a=" + "y" * 8188, False),
+            ]
+            success = True
+            for name, tags, accepted in cases:
+                self.send_command(sock, f"{tags} PING limit")
+                time.sleep(0.2)
+                response = self.receive_response(sock)
+                if accepted:
+                    ok = "PONG" in response and " 417 " not in response
+                else:
+                    ok = " 417 " in response and "PONG" not in response
+                success &= self.expect(name, ok, response)
+            
+            sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Limites de tags", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_18_cap_req(self):
+        """Testa CAP REQ tudo-ou-nada"""
+        print(f"\n{Color.BLUE}[18] Testando CAP REQ...{Color.END}")
+        
+        sock = self.connect_client()
+        if not sock:
+            return False
+        
+        try:
+            self.send_command(sock, "CAP LS 302")
+            self.send_command(sock, "CAP REQ :batch inexistente")
+            self.send_command(sock, "CAP LIST")
+            time.sleep(0.3)
+            response = self.receive_response(sock)
+            listed = [line for line in response.split('\r\n') if ' LIST ' in line]
+            success = self.expect("CAP REQ com capability desconhecida dá NAK", " NAK " in response, response)
+            success &= self.expect("Nada do pedido recusado é ligado", bool(listed) and "batch" not in listed[0], response)
+            
+            self.send_command(sock, "CAP REQ :batch server-time")
+            time.sleep(0.2)
+            response = self.receive_response(sock)
+            success &= self.expect("CAP REQ válido dá ACK", " ACK " in response, response)
+            
+            self.register_client(sock, "capuser")
+            self.send_command(sock, "CAP END")
+            time.sleep(0.3)
+            response = self.receive_response(sock)
+            success &= self.expect("Boas-vindas só depois do CAP END", " 001 " in response, response)
+            
+            sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("CAP REQ", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_19_server_time(self):
+        """Testa server-time sem message-tags em mensagens ao vivo"""
+        print(f"\n{Color.BLUE}[19] Testando server-time...{Color.END}")
+        
+        sender = self.connect_client()
+        timed = self.connect_client()
+        if not sender or not timed:
+            return False
+        
+        try:
+            self.register_client(sender, "stsender")
+            self.send_command(timed, "CAP REQ :server-time")
+            self.register_client(timed, "sttimed")
+            self.send_command(timed, "CAP END")
+            self.send_command(sender, "JOIN #stchan")
+            time.sleep(0.2)
+            self.send_command(timed, "JOIN #stchan")
+            time.sleep(0.3)
+            self.receive_response(sender)
+            self.receive_response(timed)
+            
+            self.send_command(sender, "@+draft/extra=1 PRIVMSG #stchan :hora")
+            self.send_command(sender, "PRIVMSG sttimed :direta")
+            time.sleep(0.3)
+            lines = [line for line in self.receive_response(timed).split('\r\n') if ' PRIVMSG ' in line]
+            
+            success = self.expect("Mensagens chegam com @time e só ele",
+                                  len(lines) == 2 and all(line.startswith("@time=") and ';' not in line.split(' ', 1)[0]
+                                                          and "+draft" not in line for line in lines),
+                                  " | ".join(lines))
+            
+            sender.close()
+            timed.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("server-time", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def start_server(self, port, settings):
+        """Sobe um ircserv próprio com as variáveis de ambiente dadas; devolve o processo ou None"""
+        binary = os.path.join(os.path.dirname(os.path.abspath(__file__)), "ircserv")
+        if not os.access(binary, os.X_OK):
+            return None
+        env = dict(os.environ)
+        env.update(settings)
+        # Sessão própria: o processo que assume depois de um SIGUSR2 continua no grupo
+        process = subprocess.Popen([binary, str(port), self.password], env=env, stdout=subprocess.DEVNULL,
+                                   stderr=subprocess.DEVNULL, start_new_session=True)
+        for _ in range(50):
+            if process.poll() is not None:
+                break
+            try:
+                socket.create_connection((self.host, port)).close()
+                return process
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        self.stop_server(process)
+        return None
+    
+    def stop_server(self, process):
+        """Derruba o ircserv próprio e quem o tiver substituído"""
+        try:
+            os.killpg(process.pid, signal.SIGKILL)
+        except ProcessLookupError:
+            pass
+        process.wait()
+        # O processo que assumiu a porta não é filho do tester; espera o grupo sumir
+        for _ in range(50):
+            try:
+                os.killpg(process.pid, 0)
+            except ProcessLookupError:
+                break
+            time.sleep(0.05)
+    
+    def wait_for(self, sock, text, timeout):
+        """Lê até aparecer o texto ou a conexão fechar; devolve o que chegou"""
+        data = ""
+        deadline = time.time() + timeout
+        while text not in data and time.time() < deadline:
+            chunk = self.receive_response(sock, max(deadline - time.time(), 0.1))
+            if not chunk:
+                break
+            data += chunk
+        return data
+    
+    def test_20_timeouts(self):
+        """Testa o PING de keepalive, o ping timeout e o prazo de registro"""
+        print(f"\n{Color.BLUE}[20] Testando timeouts de cliente...{Color.END}")
+        
+        port = self.port + 30
+        server = self.start_server(port, {"IRCSERV_KEEPALIVE_SECONDS": "2", "IRCSERV_PING_TIMEOUT_SECONDS": "2",
+                                          "IRCSERV_REGISTRATION_TIMEOUT_SECONDS": "2"})
+        if server is None:
+            self.print_test("Timeouts", TestResult.WARNING, "./ircserv não encontrado")
+            return True
+        
+        try:
+            silent = self.connect_client(port=port)
+            client = self.connect_client(port=port)
+            self.register_client(client, "keepalive")
+            self.receive_response(client)
+            
+            success = True
+            response = self.wait_for(silent, "ERROR", 5)
+            success &= self.expect("Conexão sem registro cai com 'Registration timeout'",
+                                   "Registration timeout" in response, response)
+            
+            response = self.wait_for(client, "PING", 5)
+            success &= self.expect("Cliente calado recebe PING do servidor", "PING :irc.server" in response, response)
+            self.send_command(client, "PONG :irc.server")
+            response = self.wait_for(client, "ERROR", 3)
+            success &= self.expect("PONG mantém a conexão", "ERROR" not in response, response)
+            
+            response = self.wait_for(client, "ERROR", 8)
+            success &= self.expect("Sem PONG a conexão cai com 'Ping timeout'", "Ping timeout" in response, response)
+            
+            silent.close()
+            client.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Timeouts", TestResult.FAIL, f"Erro: {e}")
+            return False
+        finally:
+            self.stop_server(server)
+    
+    def test_21_join_lists(self):
+        """Testa JOIN com lista de canais e chaves e o limite de canais por usuário"""
+        print(f"\n{Color.BLUE}[21] Testando JOIN com listas...{Color.END}")
+        
+        op = self.connect_client()
+        keyed = self.connect_client()
+        wrong = self.connect_client()
+        many = self.connect_client()
+        if not op or not keyed or not wrong or not many:
+            return False
+        
+        try:
+            self.register_client(op, "jlistop")
+            self.register_client(keyed, "jlistkey")
+            self.register_client(wrong, "jlistbad")
+            self.register_client(many, "jlistmany")
+            self.send_command(op, "JOIN #jlk1,#jlk2")
+            self.send_command(op, "MODE #jlk1 +k um")
+            self.send_command(op, "MODE #jlk2 +k dois")
+            time.sleep(0.3)
+            self.receive_response(op)
+            
+            success = True
+            joined, response = self.try_join(keyed, "#jlk1,#jlk2 um,dois")
+            success &= self.expect("Cada canal da lista usa a sua chave",
+                                   "JOIN :#jlk1" in response and "JOIN :#jlk2" in response, response)
+            
+            joined, response = self.try_join(wrong, "#jlk1,#jlk2 um,errada")
+            success &= self.expect("Chave errada só barra o seu canal (475)",
+                                   "JOIN :#jlk1" in response and "JOIN :#jlk2" not in response
+                                   and " 475 jlistbad #jlk2 " in response, response)
+            
+            channels = ",".join(f"#jlm{i}" for i in range(12))
+            self.send_command(many, f"JOIN {channels}")
+            response = self.wait_for(many, "#jlm11", 3)
+            joins = [line for line in response.split('\r\n') if " JOIN :#jlm" in line]
+            refused = [line for line in response.split('\r\n') if " 405 " in line]
+            success &= self.expect("Limite de 10 canais vale para o lote inteiro (405 no excedente)",
+                                   len(joins) == 10 and len(refused) == 2 and "#jlm10" in refused[0]
+                                   and "#jlm11" in refused[1], response)
+            
+            for sock in (op, keyed, wrong, many):
+                sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("JOIN com listas", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def names_of(self, response):
+        """Junta os nicks de todas as linhas 353 de uma resposta"""
+        names = []
+        for line in response.split('\r\n'):
+            if " 353 " in line:
+                names += [name.lstrip('@+') for name in line.split(' :', 1)[1].split()]
+        return names
+    
+    def test_22_names_split(self):
+        """Testa a divisão do NAMES em linhas de 512 bytes e o cache após PART/KICK"""
+        print(f"\n{Color.BLUE}[22] Testando NAMES em canal cheio...{Color.END}")
+        
+        op = self.connect_client()
+        members = [self.connect_client() for _ in range(24)]
+        if not op or not all(members):
+            return False
+        
+        try:
+            self.register_client(op, "namesop")
+            self.send_command(op, "JOIN #nsplit")
+            time.sleep(0.2)
+            nicks = [f"nsplit_member_with_long_nick_{i:02d}" for i in range(len(members))]
+            for sock, nick in zip(members, nicks):
+                self.send_command(sock, f"PASS {self.password}")
+                self.send_command(sock, f"NICK {nick}")
+                self.send_command(sock, f"USER {nick} 0 * :{nick}")
+                self.send_command(sock, "JOIN #nsplit")
+            time.sleep(0.5)
+            for sock in members:
+                self.receive_response(sock)
+            self.receive_response(op)
+            
+            success = True
+            self.send_command(op, "NAMES #nsplit")
+            response = self.wait_for(op, " 366 ", 3)
+            lines = [line for line in response.split('\r\n') if " 353 " in line]
+            names = self.names_of(response)
+            success &= self.expect("NAMES sai em várias linhas de até 512 bytes",
+                                   len(lines) > 1 and all(len(line) + 2 <= 512 for line in lines), response)
+            success &= self.expect("Cada membro aparece uma vez",
+                                   sorted(names) == sorted(nicks + ["namesop"]), response)
+            
+            self.send_command(members[0], "PART #nsplit")
+            self.send_command(op, f"KICK #nsplit {nicks[1]}")
+            time.sleep(0.3)
+            self.receive_response(op)
+            self.send_command(op, "NAMES #nsplit")
+            names = self.names_of(self.wait_for(op, " 366 ", 3))
+            success &= self.expect("NAMES reflete PART e KICK",
+                                   nicks[0] not in names and nicks[1] not in names and nicks[2] in names
+                                   and len(names) == len(nicks) - 1, " ".join(names))
+            
+            op.close()
+            for sock in members:
+                sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("NAMES em canal cheio", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def listed(self, response):
+        """Canais das linhas 322 de uma resposta de LIST, na ordem"""
+        return [line.split()[3] for line in response.split('\r\n') if " 322 " in line]
+    
+    def test_23_list_filters(self):
+        """Testa o LIST em lotes e os filtros ELIST"""
+        print(f"\n{Color.BLUE}[23] Testando LIST em lotes e filtros...{Color.END}")
+        
+        creators = [self.connect_client() for _ in range(12)]
+        op = self.connect_client()
+        helpers = [self.connect_client() for _ in range(2)]
+        if not all(creators) or not op or not all(helpers):
+            return False
+        
+        try:
+            for index, sock in enumerate(creators):
+                self.send_command(sock, f"PASS {self.password}")
+                self.send_command(sock, f"NICK lstmk{index}")
+                self.send_command(sock, f"USER lstmk{index} 0 * :lstmk")
+                self.send_command(sock, "JOIN " + ",".join(f"#ls{index * 10 + i:03d}" for i in range(10)))
+            self.register_client(op, "lstop")
+            self.send_command(op, "JOIN #lsbig,#lstopic")
+            self.send_command(op, "TOPIC #lstopic :com tópico")
+            for index, sock in enumerate(helpers):
+                self.register_client(sock, f"lsthelp{index}")
+                self.send_command(sock, "JOIN #lsbig")
+            time.sleep(0.5)
+            for sock in creators + helpers:
+                self.receive_response(sock)
+            self.receive_response(op)
+            
+            success = True
+            self.send_command(op, "LIST #ls*")
+            response = self.wait_for(op, " 323 ", 5)
+            lines = [line for line in response.split('\r\n') if line]
+            channels = self.listed(response)
+            success &= self.expect("LIST com mais de um lote traz 321, cada canal uma vez e 323 no fim",
+                                   " 321 " in lines[0] and " 323 " in lines[-1] and len(channels) == 122
+                                   and len(set(channels)) == 122, response[-200:])
+            
+            checks = [
+                ("#ls*,>2", lambda found: found == ["#lsbig"], "Filtro >n"),
+                ("#ls*,<2", lambda found: "#ls000" in found and "#lsbig" not in found, "Filtro <n"),
+                ("#lsbig,C<1", lambda found: found == ["#lsbig"], "Filtro C<n (criado há menos de n minutos)"),
+                ("#lsbig,C>1", lambda found: found == [], "Filtro C>n"),
+                ("#ls*,T<1", lambda found: found == ["#lstopic"], "Filtro T<n (só canais com tópico)"),
+                ("#ls*,T>1", lambda found: found == [], "Filtro T>n"),
+                ("#LS1?9,#lsb*", lambda found: sorted(found) == ["#ls109", "#ls119", "#lsbig"], "Máscaras sem diferenciar caixa"),
+                ("#ls*,!#ls0*,!#ls1*", lambda found: sorted(found) == ["#lsbig", "#lstopic"], "Máscaras de exclusão"),
+            ]
+            for query, check, name in checks:
+                self.send_command(op, f"LIST {query}")
+                found = self.listed(self.wait_for(op, " 323 ", 3))
+                success &= self.expect(f"{name}: LIST {query}", check(found), " ".join(found))
+            
+            for sock in creators + helpers + [op]:
+                sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("LIST em lotes e filtros", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_24_auditorium(self):
+        """Testa a visibilidade de JOIN, PART, QUIT e NAMES em canal +u"""
+        print(f"\n{Color.BLUE}[24] Testando canal auditório (+u)...{Color.END}")
+        
+        op = self.connect_client()
+        first = self.connect_client()
+        second = self.connect_client()
+        third = self.connect_client()
+        if not op or not first or not second or not third:
+            return False
+        
+        try:
+            self.register_client(op, "audop")
+            self.register_client(first, "audone")
+            self.register_client(second, "audtwo")
+            self.register_client(third, "audthree")
+            self.send_command(op, "JOIN #audchan")
+            self.send_command(op, "MODE #audchan +u")
+            time.sleep(0.2)
+            self.receive_response(op)
+            self.try_join(first, "#audchan")
+            self.try_join(second, "#audchan")
+            self.try_join(third, "#audchan")
+            
+            success = True
+            response = self.receive_response(op)
+            success &= self.expect("Operador vê o JOIN dos membros comuns",
+                                   ":audtwo!" in response and ":audthree!" in response, response)
+            response = self.receive_response(first)
+            success &= self.expect("Membro comum não vê o JOIN dos outros", " JOIN " not in response, response)
+            
+            self.send_command(first, "NAMES #audchan")
+            names = self.names_of(self.wait_for(first, " 366 ", 3))
+            success &= self.expect("NAMES do membro comum mostra só operadores e ele mesmo",
+                                   sorted(names) == ["audone", "audop"], " ".join(names))
+            self.send_command(op, "NAMES #audchan")
+            names = self.names_of(self.wait_for(op, " 366 ", 3))
+            success &= self.expect("NAMES do operador mostra todos",
+                                   sorted(names) == ["audone", "audop", "audthree", "audtwo"], " ".join(names))
+            
+            self.send_command(second, "PART #audchan")
+            self.send_command(third, "QUIT :tchau")
+            time.sleep(0.3)
+            response = self.receive_response(op)
+            success &= self.expect("Operador vê PART e QUIT dos membros comuns",
+                                   ":audtwo!" in response and " PART " in response and ":audthree!" in response
+                                   and " QUIT " in response, response)
+            response = self.receive_response(first)
+            success &= self.expect("Membro comum não vê PART nem QUIT dos outros",
+                                   " PART " not in response and " QUIT " not in response, response)
+            
+            op.close()
+            first.close()
+            second.close()
+            third.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Canal auditório", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_25_flood_limit(self):
+        """Testa o +f com as ações d, m e n e a retirada automática do +m"""
+        print(f"\n{Color.BLUE}[25] Testando limite de mensagens (+f)...{Color.END}")
+        
+        port = self.port + 31
+        server = self.start_server(port, {"IRCSERV_FLOOD_MODERATE_SECONDS": "2"})
+        if server is None:
+            self.print_test("Limite de mensagens", TestResult.WARNING, "./ircserv não encontrado")
+            return True
+        
+        try:
+            op = self.connect_client(port=port)
+            talker = self.connect_client(port=port)
+            listener = self.connect_client(port=port)
+            self.register_client(op, "floodop")
+            self.register_client(talker, "flooder")
+            self.register_client(listener, "floodear")
+            for action in "dmn":
+                self.send_command(op, f"JOIN #flood{action}")
+                self.send_command(op, f"MODE #flood{action} +f 2:5:{action}")
+                time.sleep(0.2)
+                self.try_join(talker, f"#flood{action}")
+                self.try_join(listener, f"#flood{action}")
+            self.receive_response(op)
+            
+            success = True
+            for i in range(4):
+                self.send_command(talker, f"PRIVMSG #floodd :linha {i}")
+            time.sleep(0.3)
+            heard = self.privmsg_texts(self.receive_response(listener))
+            response = self.receive_response(talker)
+            success &= self.expect("Ação d: passa o limite e descarta o resto com 404",
+                                   heard == ["linha 0", "linha 1"] and response.count(" 404 ") == 2, response)
+            
+            for i in range(3):
+                self.send_command(talker, f"PRIVMSG #floodm :linha {i}")
+            time.sleep(0.3)
+            response = self.receive_response(listener)
+            success &= self.expect("Ação m: o estouro liga +m no canal", "MODE #floodm +m" in response, response)
+            response = self.wait_for(listener, "MODE #floodm -m", 5)
+            success &= self.expect("O +m automático cai sozinho", "MODE #floodm -m" in response, response)
+            
+            for i in range(3):
+                self.send_command(talker, f"PRIVMSG #floodn :linha {i}")
+            time.sleep(0.3)
+            response = self.receive_response(op)
+            success &= self.expect("Ação n: operadores recebem o aviso",
+                                   "NOTICE #floodn :Flood limit 2:5:n reached (last: flooder)" in response, response)
+            response = self.receive_response(listener)
+            success &= self.expect("Ação n: o aviso não chega a quem não é operador", " NOTICE " not in response, response)
+            
+            op.close()
+            talker.close()
+            listener.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Limite de mensagens", TestResult.FAIL, f"Erro: {e}")
+            return False
+        finally:
+            self.stop_server(server)
+    
+    def next_second(self):
+        """Espera o começo do próximo segundo, onde começa a janela de taxa"""
+        time.sleep(1.05 - time.time() % 1)
+    
+    def test_26_admission(self):
+        """Testa as recusas por IP e por taxa de conexões no accept"""
+        print(f"\n{Color.BLUE}[26] Testando controle de admissão...{Color.END}")
+        
+        port = self.port + 32
+        servers = []
+        try:
+            servers.append(self.start_server(port, {"IRCSERV_MAX_PER_IP": "2", "IRCSERV_MAX_CONN_RATE": "0"}))
+            servers.append(self.start_server(port + 1, {"IRCSERV_MAX_PER_IP": "0", "IRCSERV_MAX_CONN_RATE": "3"}))
+            if None in servers:
+                self.print_test("Controle de admissão", TestResult.WARNING, "./ircserv não encontrado")
+                return True
+            time.sleep(0.3)
+            
+            success = True
+            held = [self.connect_client(port=port) for _ in range(2)]
+            extra = self.connect_client(port=port)
+            response = self.wait_for(extra, "ERROR", 2)
+            success &= self.expect("Acima do limite por IP a conexão é recusada",
+                                   "ERROR :Closing Link: localhost (Too many connections from your host)" in response,
+                                   response)
+            held[0].close()
+            time.sleep(0.3)
+            again = self.connect_client(port=port)
+            response = self.register_client(again, "admitted")
+            success &= self.expect("Fechar uma conexão libera a vaga do IP", " 001 " in response, response)
+            
+            self.next_second()
+            burst = [self.connect_client(port=port + 1) for _ in range(4)]
+            responses = [self.wait_for(sock, "ERROR", 0.5) for sock in burst]
+            success &= self.expect("A quarta conexão no mesmo segundo é recusada",
+                                   all("ERROR" not in response for response in responses[:3])
+                                   and "ERROR :Closing Link: localhost (Connecting too fast)" in responses[3],
+                                   " | ".join(responses))
+            self.next_second()
+            late = self.connect_client(port=port + 1)
+            response = self.register_client(late, "ratelate")
+            success &= self.expect("No segundo seguinte a conexão volta a ser aceita", " 001 " in response, response)
+            
+            for sock in held + burst + [extra, again, late]:
+                sock.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Controle de admissão", TestResult.FAIL, f"Erro: {e}")
+            return False
+        finally:
+            for server in servers:
+                if server is not None:
+                    self.stop_server(server)
+    
+    def test_27_no_implicit_names(self):
+        """Testa o draft/no-implicit-names no JOIN"""
+        print(f"\n{Color.BLUE}[27] Testando draft/no-implicit-names...{Color.END}")
+        
+        classic = self.connect_client()
+        bot = self.connect_client()
+        if not classic or not bot:
+            return False
+        
+        try:
+            self.register_client(classic, "nimclassic")
+            self.send_command(bot, "CAP REQ :draft/no-implicit-names")
+            self.register_client(bot, "nimbot")
+            self.send_command(bot, "CAP END")
+            time.sleep(0.2)
+            self.receive_response(bot)
+            
+            success = True
+            joined, response = self.try_join(classic, "#nimchan")
+            success &= self.expect("Cliente clássico recebe 353/366 no JOIN",
+                                   joined and " 353 " in response and " 366 " in response, response)
+            self.send_command(classic, "TOPIC #nimchan :assunto")
+            time.sleep(0.2)
+            
+            joined, response = self.try_join(bot, "#nimchan")
+            success &= self.expect("Com o cap o JOIN vem sem 353/366, mas com o tópico",
+                                   joined and " 332 " in response and " 353 " not in response
+                                   and " 366 " not in response, response)
+            self.send_command(bot, "NAMES #nimchan")
+            names = self.names_of(self.wait_for(bot, " 366 ", 3))
+            success &= self.expect("NAMES explícito continua respondendo",
+                                   sorted(names) == ["nimbot", "nimclassic"], " ".join(names))
+            
+            classic.close()
+            bot.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("draft/no-implicit-names", TestResult.FAIL, f"Erro: {e}")
+            return False
+    
+    def test_28_hot_restart(self):
+        """Testa a troca de processo com SIGUSR2 sem derrubar clientes"""
+        print(f"\n{Color.BLUE}[28] Testando reinício a quente (SIGUSR2)...{Color.END}")
+        
+        port = self.port + 34
+        server = self.start_server(port, {})
+        if server is None:
+            self.print_test("Reinício a quente", TestResult.WARNING, "./ircserv não encontrado")
+            return True
+        
+        try:
+            speaker = self.connect_client(port=port)
+            listener = self.connect_client(port=port)
+            self.register_client(speaker, "hotspeak")
+            self.register_client(listener, "hotlisten")
+            self.send_command(speaker, "JOIN #hotchan")
+            self.send_command(speaker, "TOPIC #hotchan :antes da troca")
+            time.sleep(0.2)
+            self.try_join(listener, "#hotchan")
+            self.receive_response(speaker)
+            
+            success = True
+            server.send_signal(signal.SIGUSR2)
+            try:
+                server.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                pass
+            success &= self.expect("Processo antigo sai depois da entrega", server.poll() is not None)
+            
+            self.send_command(speaker, "PRIVMSG #hotchan :depois da troca")
+            time.sleep(0.3)
+            heard = self.privmsg_texts(self.receive_response(listener))
+            success &= self.expect("Clientes seguem conectados e no canal", heard == ["depois da troca"], " ".join(heard))
+            
+            self.send_command(listener, "NAMES #hotchan")
+            names = self.names_of(self.wait_for(listener, " 366 ", 3))
+            self.send_command(listener, "TOPIC #hotchan")
+            time.sleep(0.2)
+            response = self.receive_response(listener)
+            success &= self.expect("Membros e tópico do canal sobrevivem",
+                                   sorted(names) == ["hotlisten", "hotspeak"] and "antes da troca" in response,
+                                   " ".join(names) + " " + response)
+            
+            newcomer = self.connect_client(port=port)
+            response = self.register_client(newcomer, "hotnew") if newcomer else ""
+            success &= self.expect("Processo novo aceita conexões", " 001 " in response, response)
+            
+            speaker.close()
+            listener.close()
+            if newcomer:
+                newcomer.close()
+            return success
+            
+        except Exception as e:
+            self.print_test("Reinício a quente", TestResult.FAIL, f"Erro: {e}")
+            return False
+        finally:
+            self.stop_server(server)
+    
     def run_all_tests(self):
         """Executa todos os testes"""
         self.print_banner()
@@ -610,6 +1481,22 @@ class IRCServTester:
             (self.test_10_topic_command, "TOPIC"),
             (self.test_11_quit_command, "QUIT"),
             (self.test_12_error_handling, "Tratamento de erros"),
+            (self.test_13_channel_masks, "Máscaras de canal"),
+            (self.test_14_invites, "Convites"),
+            (self.test_15_monitor, "MONITOR"),
+            (self.test_16_chathistory, "CHATHISTORY"),
+            (self.test_17_tag_limits, "Limites de tags"),
+            (self.test_18_cap_req, "CAP REQ"),
+            (self.test_19_server_time, "server-time"),
+            (self.test_20_timeouts, "Timeouts de cliente"),
+            (self.test_21_join_lists, "JOIN com listas"),
+            (self.test_22_names_split, "NAMES em canal cheio"),
+            (self.test_23_list_filters, "LIST em lotes e filtros"),
+            (self.test_24_auditorium, "Canal auditório (+u)"),
+            (self.test_25_flood_limit, "Limite de mensagens (+f)"),
+            (self.test_26_admission, "Controle de admissão"),
+            (self.test_27_no_implicit_names, "draft/no-implicit-names"),
+            (self.test_28_hot_restart, "Reinício a quente (SIGUSR2)"),
         ]
         
         results = []
@@ -1,4 +1,26 @@
 #include "./include/Server.hpp"
+#include <cctype>
+#include <cerrno>
+
+namespace {
+// A numeric setting from the environment. Unset, it is the fallback; set to
+// anything but a plain decimal number, it is the fallback too, with a warning,
+// since a limit read as 0 would mean unlimited.
+unsigned long envNumber(const char *name, unsigned long fallback) {
+  const char *value = std::getenv(name);
+  if (value == NULL)
+    return fallback;
+
+  char *end = NULL;
+  errno = 0;
+  const unsigned long number = std::strtoul(value, &end, 10);
+  if (!std::isdigit(static_cast<unsigned char>(*value)) || *end != '\0' || errno == ERANGE) {
+    std::cerr << "Warning: ignoring invalid " << name << "=" << value << std::endl;
+    return fallback;
+  }
+  return number;
+}
+} // namespace
 
 int main(int argc, char **argv) {
   if (argc != 3) {
@@ -9,6 +31,48 @@ int main(int argc, char **argv) {
     std::string password = static_cast<std::string>(argv[2]);
     unsigned int port = atoi(argv[1]);
     Server server(port, password);
+
+    // IRCSERV_FLUSH_MODE=throughput holds replies for IRCSERV_FLUSH_WINDOW_US
+    // microseconds before flushing; the default flushes every loop iteration.
+    const char *flushMode = std::getenv("IRCSERV_FLUSH_MODE");
+    if (flushMode != NULL && std::string(flushMode) == "throughput")
+      server.setFlushPolicy(FLUSH_THROUGHPUT, envNumber("IRCSERV_FLUSH_WINDOW_US", DEFAULT_FLUSH_WINDOW_US));
+
+    // IRCSERV_BACKEND=uring selects the io_uring loop; run() falls back to
+    // poll() when the kernel does not support it.
+    const char *backend = std::getenv("IRCSERV_BACKEND");
+    if (backend != NULL && std::string(backend) == "uring")
+      server.setBackend(BACKEND_URING);
+
+    // Admission control: IRCSERV_MAX_CLIENTS caps connections overall,
+    // IRCSERV_MAX_PER_IP and IRCSERV_MAX_CONN_RATE (per second) per address.
+    server.setAdmissionLimits(envNumber("IRCSERV_MAX_CLIENTS", DEFAULT_MAX_CLIENTS),
+                              envNumber("IRCSERV_MAX_PER_IP", DEFAULT_MAX_PER_IP),
+                              envNumber("IRCSERV_MAX_CONN_RATE", DEFAULT_MAX_CONN_RATE));
+    // IRCSERV_KEEPALIVE_SECONDS of silence earn a client a PING, which it has
+    // IRCSERV_PING_TIMEOUT_SECONDS to answer; an unregistered connection is
+    // dropped after IRCSERV_REGISTRATION_TIMEOUT_SECONDS.
+    server.setClientTimeouts(envNumber("IRCSERV_KEEPALIVE_SECONDS", DEFAULT_KEEPALIVE_SECONDS) * 1000UL,
+                             envNumber("IRCSERV_PING_TIMEOUT_SECONDS", DEFAULT_PING_TIMEOUT_SECONDS) * 1000UL,
+                             envNumber("IRCSERV_REGISTRATION_TIMEOUT_SECONDS", DEFAULT_REGISTRATION_TIMEOUT_SECONDS) *
+                                 1000UL);
+    // IRCSERV_FLOOD_MODERATE_SECONDS: how long +f with the m action keeps +m.
+    server.setFloodModeration(envNumber("IRCSERV_FLOOD_MODERATE_SECONDS", DEFAULT_FLOOD_MODERATE_SECONDS) * 1000UL);
+    // IRCSERV_HISTORY_DIR keeps channel history on disk as well, within
+    // IRCSERV_HISTORY_MAX_MB megabytes (256 by default).
+    const char *historyDir = std::getenv("IRCSERV_HISTORY_DIR");
+    if (historyDir != NULL && *historyDir != '\0')
+      server.setHistoryLog(historyDir, envNumber("IRCSERV_HISTORY_MAX_MB", DEFAULT_HISTORY_MAX_MB) * 1024UL * 1024UL);
+
+    // SIGUSR2 restarts the server in place: the same command line is run
+    // again and takes over the listening socket, the clients and the
+    // channels. The new process finds its way back through HANDOFF_ENV.
+    server.setUpgradeCommand(std::vector<std::string>(argv, argv + argc));
+    const char *upgradeFd = std::getenv(HANDOFF_ENV);
+    if (upgradeFd != NULL) {
+      server.setUpgradeSocket(atoi(upgradeFd));
+      unsetenv(HANDOFF_ENV);
+    }
     server.run();
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
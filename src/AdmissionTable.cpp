@@ -0,0 +1,120 @@
+#include "../include/AdmissionTable.hpp"
+
+namespace {
+const std::size_t INITIAL_CAPACITY = 64;
+
+// Integer mix so that neighbouring addresses (a /24 of bots) land far apart
+// instead of forming one long probe run.
+std::size_t hashAddr(unsigned int addr) {
+  unsigned int h = addr;
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  return static_cast<std::size_t>(h);
+}
+} // namespace
+
+AdmissionTable::AdmissionTable() : _used(0), _max_per_ip(0), _max_per_second(0) {
+  Slot empty = {0, 0, 0, 0};
+  _slots.assign(INITIAL_CAPACITY, empty);
+}
+
+AdmissionTable::~AdmissionTable() {
+}
+
+// A limit of 0 disables that check.
+void AdmissionTable::setLimits(std::size_t maxPerIp, std::size_t maxPerSecond) {
+  _max_per_ip = maxPerIp;
+  _max_per_second = maxPerSecond;
+}
+
+std::size_t AdmissionTable::probe(unsigned int addr) const {
+  const std::size_t mask = _slots.size() - 1;
+  std::size_t i = hashAddr(addr) & mask;
+
+  while (_slots[i].addr != 0 && _slots[i].addr != addr)
+    i = (i + 1) & mask;
+  return i;
+}
+
+// Rebuilds the table, dropping addresses with no open socket whose rate
+// window is over.
+void AdmissionTable::rehash(std::size_t capacity, unsigned long nowSec) {
+  std::vector<Slot> old;
+  old.swap(_slots);
+
+  Slot empty = {0, 0, 0, 0};
+  _slots.assign(capacity, empty);
+  _used = 0;
+  for (std::size_t i = 0; i < old.size(); ++i) {
+    const Slot &slot = old[i];
+    if (slot.addr == 0 || (slot.active == 0 && slot.windowStart != nowSec))
+      continue;
+    _slots[probe(slot.addr)] = slot;
+    ++_used;
+  }
+}
+
+// The slot of addr, created (growing the table first if needed) when absent.
+std::size_t AdmissionTable::claim(unsigned int addr, unsigned long nowSec) {
+  std::size_t i = probe(addr);
+  if (_slots[i].addr == 0) {
+    if ((_used + 1) * 4 > _slots.size() * 3) {
+      rehash(_slots.size(), nowSec);
+      if ((_used + 1) * 2 > _slots.size())
+        rehash(_slots.size() * 2, nowSec);
+      i = probe(addr);
+    }
+    _slots[i].addr = addr;
+    _slots[i].active = 0;
+    _slots[i].windowCount = 0;
+    _slots[i].windowStart = static_cast<unsigned int>(nowSec);
+    ++_used;
+  }
+  return i;
+}
+
+AdmissionVerdict AdmissionTable::admit(unsigned int addr, unsigned long nowSec) {
+  if (addr == 0)
+    return ADMISSION_NO_ADDRESS;
+
+  Slot &slot = _slots[claim(addr, nowSec)];
+  if (slot.windowStart != static_cast<unsigned int>(nowSec)) {
+    slot.windowStart = static_cast<unsigned int>(nowSec);
+    slot.windowCount = 0;
+  }
+  if (_max_per_ip != 0 && slot.active >= _max_per_ip)
+    return ADMISSION_PER_IP;
+  if (_max_per_second != 0 && slot.windowCount >= _max_per_second)
+    return ADMISSION_RATE;
+
+  ++slot.active;
+  ++slot.windowCount;
+  return ADMISSION_OK;
+}
+
+// A connection accepted elsewhere (by the process this one took over from)
+// counts against its address without being checked or rate limited again.
+void AdmissionTable::adopt(unsigned int addr, unsigned long nowSec) {
+  if (addr != 0)
+    ++_slots[claim(addr, nowSec)].active;
+}
+
+void AdmissionTable::release(unsigned int addr) {
+  if (addr == 0)
+    return;
+
+  Slot &slot = _slots[probe(addr)];
+  if (slot.addr == addr && slot.active > 0)
+    --slot.active;
+}
+
+std::size_t AdmissionTable::size() const {
+  return _used;
+}
+
+std::size_t AdmissionTable::capacity() const {
+  return _slots.size();
+}
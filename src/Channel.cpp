@@ -1,15 +1,50 @@
 #include "../include/Channel.hpp"
 #include <algorithm>
+#include <set>
+#include <sstream>
+
+namespace {
+// Adds one nick to the last NAMES chunk, or opens a new one when it would push
+// the line past the budget. A nick longer than the budget gets its own line.
+void appendNamesChunk(std::vector<std::string> &chunks, const std::string &channelName, const std::string &entry,
+                      std::size_t budget) {
+  const std::string crlf = "\r\n";
+
+  if (!chunks.empty()) {
+    std::string &last = chunks.back();
+    if (last.size() + 1 + entry.size() <= budget) {
+      last.insert(last.size() - crlf.size(), " " + entry);
+      return;
+    }
+  }
+  chunks.push_back(" = " + channelName + " :" + entry + crlf);
+}
+} // namespace
 
 Channel::Channel() {
   _name = "";
   _topic = "";
   _key = "";
   _limit = 0;
+  _refs = 0;
+  _created_at = 0;
+  _topic_set_at = 0;
   _modeI = false;
   _modeT = false;
   _modeK = false;
   _modeL = false;
+  _modeU = false;
+  _modeM = false;
+  _modeF = false;
+  _flood_messages = 0;
+  _flood_seconds = 0;
+  _flood_action = 'd';
+  _flood_level = 0;
+  _flood_stamp = 0;
+  _flood_tripped = false;
+  _moderated_until = 0;
+  _names_budget = 0;
+  _names_valid = false;
 }
 
 Channel::Channel(const std::string &name) {
@@ -17,16 +52,83 @@ Channel::Channel(const std::string &name) {
   _topic = "";
   _key = "";
   _limit = 0;
+  _refs = 0;
+  _created_at = std::time(NULL);
+  _topic_set_at = 0;
   _modeI = false;
   _modeT = false;
   _modeK = false;
   _modeL = false;
+  _modeU = false;
+  _modeM = false;
+  _modeF = false;
+  _flood_messages = 0;
+  _flood_seconds = 0;
+  _flood_action = 'd';
+  _flood_level = 0;
+  _flood_stamp = 0;
+  _flood_tripped = false;
+  _moderated_until = 0;
+  _names_budget = 0;
+  _names_valid = false;
 }
 
 Channel::~Channel() {
   _members.clear();
+  _joined.clear();
+  _operators.clear();
+  _invites.clear();
+}
+
+// Reinitialises a pooled channel; vectors keep their capacity for reuse.
+void Channel::reset(const std::string &name) {
+  _name = name;
+  _topic.clear();
+  _key.clear();
+  _limit = 0;
+  _refs = 0;
+  _created_at = name.empty() ? 0 : std::time(NULL);
+  _topic_set_at = 0;
+  _modeI = false;
+  _modeT = false;
+  _modeK = false;
+  _modeL = false;
+  _modeU = false;
+  _modeM = false;
+  _modeF = false;
+  _flood_messages = 0;
+  _flood_seconds = 0;
+  _flood_action = 'd';
+  _flood_level = 0;
+  _flood_stamp = 0;
+  _flood_tripped = false;
+  _moderated_until = 0;
+  _members.clear();
+  _joined.clear();
   _operators.clear();
-  _invitedFds.clear();
+  _invites.clear();
+  _bans.clear();
+  _excepts.clear();
+  _invex.clear();
+  _names_chunks.clear();
+  _names_valid = false;
+}
+
+// Every member holds one reference, as does any code that keeps the channel
+// across a call that may remove members. The Server reclaims a channel once
+// the count drops to zero.
+void Channel::retain() {
+  ++_refs;
+}
+
+std::size_t Channel::release() {
+  if (_refs > 0)
+    --_refs;
+  return _refs;
+}
+
+std::size_t Channel::getRefs() const {
+  return _refs;
 }
 
 Channel::Channel(const Channel &other) {
@@ -39,23 +141,45 @@ Channel &Channel::operator=(const Channel &other) {
     this->_topic = other._topic;
     this->_key = other._key;
     this->_limit = other._limit;
+    this->_refs = other._refs;
+    this->_created_at = other._created_at;
+    this->_topic_set_at = other._topic_set_at;
     this->_modeI = other._modeI;
     this->_modeT = other._modeT;
     this->_modeK = other._modeK;
     this->_modeL = other._modeL;
+    this->_modeU = other._modeU;
+    this->_modeM = other._modeM;
+    this->_modeF = other._modeF;
+    this->_flood_messages = other._flood_messages;
+    this->_flood_seconds = other._flood_seconds;
+    this->_flood_action = other._flood_action;
+    this->_flood_level = other._flood_level;
+    this->_flood_stamp = other._flood_stamp;
+    this->_flood_tripped = other._flood_tripped;
+    this->_moderated_until = other._moderated_until;
     this->_members = other._members;
+    this->_joined = other._joined;
     this->_operators = other._operators;
-    this->_invitedFds = other._invitedFds;
+    this->_invites = other._invites;
+    this->_bans = other._bans;
+    this->_excepts = other._excepts;
+    this->_invex = other._invex;
+    this->_names_chunks = other._names_chunks;
+    this->_names_budget = other._names_budget;
+    this->_names_valid = other._names_valid;
   }
   return *this;
 }
 
 void Channel::setName(const std::string &name) {
   _name = name;
+  invalidateNames();
 }
 
 void Channel::setTopic(const std::string &topic) {
   _topic = topic;
+  _topic_set_at = std::time(NULL);
 }
 
 void Channel::setKey(const std::string &key) {
@@ -82,38 +206,82 @@ const std::string &Channel::getTopic() const {
   return _topic;
 }
 
+std::time_t Channel::getCreatedAt() const {
+  return _created_at;
+}
+
+std::time_t Channel::getTopicSetAt() const {
+  return _topic_set_at;
+}
+
+void Channel::setCreatedAt(std::time_t createdAt) {
+  _created_at = createdAt;
+}
+
+void Channel::setTopicSetAt(std::time_t topicSetAt) {
+  _topic_set_at = topicSetAt;
+}
+
 const std::string &Channel::getName() const {
   return _name;
 }
 
-const std::string Channel::getUserList() const {
-  std::string userList;
+// Returns the cached NAMES tails, rebuilding them when a part, nick or
+// operator change invalidated the cache or when the caller needs shorter
+// lines than the cache was cut for (a longer requesting nick).
+const std::vector<std::string> &Channel::getNamesChunks(std::size_t budget) const {
+  if (_names_valid && _names_budget <= budget)
+    return _names_chunks;
+
+  _names_chunks.clear();
+  _names_budget = budget;
+  _names_valid = true;
 
   for (std::map<int, Client *>::const_iterator it = _members.begin(); it != _members.end(); ++it) {
-    if (it->second != NULL) {
-      std::string prefix;
+    if (it->second == NULL)
+      continue;
+    if (_operators.count(it->first) != 0)
+      appendNamesEntry("@" + it->second->getNickname());
+    else
+      appendNamesEntry(it->second->getNickname());
+  }
+  return _names_chunks;
+}
 
-      if (isOperator(it->second->getFd()))
-        prefix = "@";
+void Channel::invalidateNames() {
+  _names_valid = false;
+}
 
-      if (it == _members.begin()) {
-        userList = prefix + it->second->getUsername();
-        continue;
-      }
+void Channel::appendNamesEntry(const std::string &entry) const {
+  appendNamesChunk(_names_chunks, _name, entry, _names_budget);
+}
 
-      userList += " " + prefix + it->second->getUsername();
-    }
-  }
+// What a regular member of an auditorium (+u) channel sees: the operators
+// and itself. Operators are few, so this is built per request, uncached.
+std::vector<std::string> Channel::getOperatorNamesChunks(std::size_t budget, int viewerFd) const {
+  std::vector<std::string> chunks;
 
-  return userList;
+  for (std::set<int>::const_iterator op = _operators.begin(); op != _operators.end(); ++op) {
+    std::map<int, Client *>::const_iterator it = _members.find(*op);
+    if (it != _members.end())
+      appendNamesChunk(chunks, _name, "@" + it->second->getNickname(), budget);
+  }
+  std::map<int, Client *>::const_iterator viewer = _members.find(viewerFd);
+  if (viewer != _members.end() && !isOperator(viewerFd))
+    appendNamesChunk(chunks, _name, viewer->second->getNickname(), budget);
+  return chunks;
 }
 
 const std::map<int, Client *> &Channel::getMembers() const {
   return _members;
 }
 
-const std::vector<int> &Channel::getInvitedFds() const {
-  return _invitedFds;
+std::size_t Channel::getInviteCount() const {
+  return _invites.size();
+}
+
+void Channel::getInvites(std::vector<std::pair<unsigned long, unsigned long> > &out) const {
+  _invites.collect(out);
 }
 
 bool Channel::isMember(int clientFd) const {
@@ -123,9 +291,15 @@ bool Channel::isMember(int clientFd) const {
 }
 
 bool Channel::isOperator(int clientFd) const {
-  std::vector<int>::const_iterator it = std::find(_operators.begin(), _operators.end(), clientFd);
+  return _operators.count(clientFd) != 0;
+}
 
-  return it != _operators.end() ? true : false;
+// True for a member that joined no later than seq, i.e. one that was in the
+// channel when a line stamped with seq was sent.
+bool Channel::joinedBy(int clientFd, unsigned long seq) const {
+  std::map<int, unsigned long>::const_iterator it = _joined.find(clientFd);
+
+  return it != _joined.end() && it->second <= seq;
 }
 
 bool Channel::hasKey() const {
@@ -140,38 +314,63 @@ bool Channel::isInviteOnly() const {
   return _modeI;
 }
 
-void Channel::addMember(Client *client) {
-  _members.insert(std::pair<int, Client *>(client->getFd(), client));
+// Joins are the common case on busy channels, so they patch the NAMES cache
+// in place; every other membership change just invalidates it.
+void Channel::addMember(Client *client, unsigned long joinSeq) {
+  if (!_members.insert(std::pair<int, Client *>(client->getFd(), client)).second)
+    return;
+  _joined[client->getFd()] = joinSeq;
+  if (_names_valid)
+    appendNamesEntry(client->getNickname());
 }
 
 void Channel::removeMember(int clientFd) {
   std::map<int, Client *>::iterator it = _members.find(clientFd);
   if (it != _members.end()) {
     _members.erase(it);
+    _joined.erase(clientFd);
     this->removeOperator(clientFd);
+    invalidateNames();
   }
 }
 
 void Channel::addOperator(int clientFd) {
-  _operators.push_back(clientFd);
+  _operators.insert(clientFd);
+  invalidateNames();
 }
 
 void Channel::removeOperator(int clientFd) {
-  std::vector<int>::iterator it = std::find(_operators.begin(), _operators.end(), clientFd);
-  if (it != _operators.end()) {
-    _operators.erase(it);
-  }
+  if (_operators.erase(clientFd) != 0)
+    invalidateNames();
 }
 
-void Channel::addBanned(int clientFd) {
-  _membersBanned.push_back(clientFd);
+// 'b' bans, 'e' ban exceptions, 'I' invite exceptions.
+MaskList &Channel::getMaskList(char mode) {
+  if (mode == 'e')
+    return _excepts;
+  if (mode == 'I')
+    return _invex;
+  return _bans;
 }
 
-void Channel::removeBanned(int clientFd) {
-  std::vector<int>::iterator it = std::find(_membersBanned.begin(), _membersBanned.end(), clientFd);
-  if (it != _membersBanned.end()) {
-    _membersBanned.erase(it);
-  }
+const MaskList &Channel::getMaskList(char mode) const {
+  if (mode == 'e')
+    return _excepts;
+  if (mode == 'I')
+    return _invex;
+  return _bans;
+}
+
+// hostmask is nick!user@host; it is folded once for both lists.
+bool Channel::isBanned(const std::string &hostmask) const {
+  if (_bans.size() == 0)
+    return false;
+  std::string folded = MaskList::fold(hostmask);
+  return _bans.matches(folded) && !_excepts.matches(folded);
+}
+
+bool Channel::isInviteExempt(const std::string &hostmask) const {
+  return _invex.matches(MaskList::fold(hostmask));
 }
 
 void Channel::setMode(char mode, bool setting) {
@@ -188,6 +387,15 @@ void Channel::setMode(char mode, bool setting) {
     case 'l':
       _modeL = setting;
       break;
+    case 'u':
+      _modeU = setting;
+      break;
+    case 'm':
+      _modeM = setting;
+      break;
+    case 'f':
+      _modeF = setting;
+      break;
     default:
       break;
   }
@@ -202,14 +410,100 @@ bool Channel::getMode(char mode) const {
     return _modeK;
   } else if (mode == 'l') {
     return _modeL;
+  } else if (mode == 'u') {
+    return _modeU;
+  } else if (mode == 'm') {
+    return _modeM;
+  } else if (mode == 'f') {
+    return _modeF;
   }
   return false;
 }
 
+// A new limit starts with a full bucket.
+void Channel::setFlood(unsigned messages, unsigned seconds, char action) {
+  _flood_messages = messages;
+  _flood_seconds = seconds;
+  _flood_action = action;
+  _flood_level = static_cast<unsigned long>(messages) * seconds * 1000UL;
+  _flood_stamp = 0;
+  _flood_tripped = false;
+}
+
+std::string Channel::getFloodParam() const {
+  std::stringstream ss;
+  ss << _flood_messages << ":" << _flood_seconds << ":" << _flood_action;
+  return ss.str();
+}
+
+char Channel::getFloodAction() const {
+  return _flood_action;
+}
+
+FloodVerdict Channel::consumeFloodToken(unsigned long nowMs) {
+  const unsigned long cost = static_cast<unsigned long>(_flood_seconds) * 1000UL;
+  const unsigned long capacity = cost * _flood_messages;
+
+  if (_flood_stamp != 0 && nowMs > _flood_stamp)
+    _flood_level = std::min(capacity, _flood_level + (nowMs - _flood_stamp) * _flood_messages);
+  _flood_stamp = nowMs;
+
+  if (_flood_level >= cost) {
+    _flood_level -= cost;
+    _flood_tripped = false;
+    return FLOOD_PASS;
+  }
+  if (_flood_tripped)
+    return FLOOD_LIMITED;
+  _flood_tripped = true;
+  return FLOOD_TRIPPED;
+}
+
+// Set while +m was raised by the flood throttle; a manual +m/-m clears it so
+// the expiry timer never lifts a moderation an operator asked for.
+void Channel::setModeratedUntil(unsigned long untilMs) {
+  _moderated_until = untilMs;
+}
+
+unsigned long Channel::getModeratedUntil() const {
+  return _moderated_until;
+}
+
 void Channel::broadcast(const std::string &message, int excludeFd) {
   for (std::map<int, Client *>::iterator it = _members.begin(); it != _members.end(); it++) {
     if (it->first != excludeFd) {
-      it->second->queueOutput(message);
+      it->second->queueTagged(message);
+    }
+  }
+}
+
+// Like broadcast(), but skips members already stamped with epoch by another
+// target of the same message.
+void Channel::broadcastOnce(const std::string &message, int excludeFd, unsigned long epoch) {
+  for (std::map<int, Client *>::iterator it = _members.begin(); it != _members.end(); it++) {
+    if (it->first != excludeFd && it->second->markDelivered(epoch)) {
+      it->second->queueTagged(message);
+    }
+  }
+}
+
+// Auditorium (+u) channels only show regular members' joins, parts and
+// quits to the operators.
+void Channel::broadcastToOperators(const std::string &message, int excludeFd) {
+  for (std::set<int>::const_iterator op = _operators.begin(); op != _operators.end(); ++op) {
+    std::map<int, Client *>::iterator it = _members.find(*op);
+    if (it != _members.end() && it->first != excludeFd)
+      it->second->queueTagged(message);
+  }
+}
+
+void Channel::broadcastToOperatorsOnce(const std::string &message, int excludeFd, unsigned long epoch,
+                                       std::vector<int> &reached) {
+  for (std::set<int>::const_iterator op = _operators.begin(); op != _operators.end(); ++op) {
+    std::map<int, Client *>::iterator it = _members.find(*op);
+    if (it != _members.end() && it->first != excludeFd && it->second->markDelivered(epoch)) {
+      it->second->queueTagged(message);
+      reached.push_back(it->first);
     }
   }
 }
@@ -233,14 +527,20 @@ bool Channel::canSetTopic(int clientFd) const {
   return isOperator(clientFd);
 }
 
-void Channel::inviteMember(int clientFd) {
-  if (std::find(_invitedFds.begin(), _invitedFds.end(), clientFd) == _invitedFds.end()) {
-    _invitedFds.push_back(clientFd);
-  }
+// Invites are keyed by client id, so a new connection that reuses an fd
+// never inherits one.
+void Channel::inviteMember(unsigned long clientId, unsigned long expiresMs, unsigned long nowMs) {
+  _invites.add(clientId, expiresMs, nowMs);
+}
+
+bool Channel::consumeInvite(unsigned long clientId, unsigned long nowMs) {
+  return _invites.consume(clientId, nowMs);
 }
 
-bool Channel::isInvitedFd(int clientFd) const {
-  std::vector<int>::const_iterator it = std::find(_invitedFds.begin(), _invitedFds.end(), clientFd);
+void Channel::pruneInvites(unsigned long nowMs) {
+  _invites.prune(nowMs);
+}
 
-  return it != _invitedFds.end() ? true : false;
+bool Channel::isInvited(unsigned long clientId, unsigned long nowMs) const {
+  return _invites.contains(clientId, nowMs);
 }
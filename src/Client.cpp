@@ -1,24 +1,74 @@
 #include "../include/Client.hpp"
+#include <algorithm>
 
 namespace {
 // Client buffer processing constants
 const size_t CARRIAGE_RETURN_OFFSET = 1;
+// Pooled clients keep buffer capacity up to this size across reuse
+const size_t RETAINED_BUFFER_CAPACITY = 4096;
+
+void recycleString(std::string &value) {
+  if (value.capacity() > RETAINED_BUFFER_CAPACITY)
+    std::string().swap(value);
+  else
+    value.clear();
+}
 } // namespace ClientInternal
 
-Client::Client() {
+Client::Client()
+    : _is_authenticated(false), _has_password(false), _has_nick(false), _has_user(false), _fd(-1), _id(0),
+      _last_activity(0), _ping_sent_at(0), _buffer_start(0), _flush_queue(NULL), _flush_pending(false),
+      _queued_writes(0), _delivery_epoch(0), _ready_queued(false), _closing(false), _recv_armed(false), _addr(0),
+      _caps(0), _cap_version(0), _negotiating(false) {
 }
 
-Client::Client(const int FD)
-    : _is_authenticated(false), _has_password(false), _has_nick(false), _has_user(false), _fd(FD) {
+Client::Client(const int FD, const unsigned long ID)
+    : _is_authenticated(false), _has_password(false), _has_nick(false), _has_user(false), _fd(FD), _id(ID),
+      _last_activity(0), _ping_sent_at(0), _buffer_start(0), _flush_queue(NULL), _flush_pending(false),
+      _queued_writes(0), _delivery_epoch(0), _ready_queued(false), _closing(false), _recv_armed(false), _addr(0),
+      _caps(0), _cap_version(0), _negotiating(false) {
 }
 
 Client::~Client() {
 }
 
+// Reinitialises a pooled client for a new connection (or, with FD -1, parks it
+// on the free list) while keeping modestly sized buffers allocated.
+void Client::reset(const int FD, const unsigned long ID) {
+  _is_authenticated = false;
+  _has_password = false;
+  _has_nick = false;
+  _has_user = false;
+  _fd = FD;
+  _id = ID;
+  _last_activity = 0;
+  _ping_sent_at = 0;
+  _flush_queue = NULL;
+  _flush_pending = false;
+  _queued_writes = 0;
+  recycleString(_buffer);
+  _buffer_start = 0;
+  recycleString(_out_buffer);
+  _nickname.clear();
+  _username.clear();
+  _realname.clear();
+  _channels.clear();
+  _delivery_epoch = 0;
+  _ready_queued = false;
+  _closing = false;
+  _recv_armed = false;
+  _addr = 0;
+  _monitored.clear();
+  _caps = 0;
+  _cap_version = 0;
+  _negotiating = false;
+}
+
 Client Client::operator=(Client const &other) {
   if (this != &other) {
     _fd = other._fd;
     _buffer = other._buffer;
+    _buffer_start = other._buffer_start;
   }
   return *this;
 }
@@ -40,19 +90,46 @@ bool Client::hasUser() const {
 }
 
 bool Client::hasCompleteMessage() const {
-  return _buffer.find('\n') != std::string::npos;
+  return _buffer.find('\n', _buffer_start) != std::string::npos;
 }
 
 int Client::getFd() const {
   return _fd;
 }
 
+unsigned long Client::getId() const {
+  return _id;
+}
+
+unsigned long Client::getLastActivity() const {
+  return _last_activity;
+}
+
+unsigned long Client::getPingSentAt() const {
+  return _ping_sent_at;
+}
+
+void Client::setLastActivity(unsigned long now) {
+  _last_activity = now;
+}
+
+void Client::setPingSentAt(unsigned long now) {
+  _ping_sent_at = now;
+}
+
+// Lines already extracted are only dropped here, once per read, rather than
+// by moving the rest of the buffer after every line.
 void Client::appendToBuffer(const std::string &data) {
+  if (_buffer_start > 0) {
+    _buffer.erase(0, _buffer_start);
+    _buffer_start = 0;
+  }
   _buffer.append(data);
 }
 
 void Client::clearBuffer() {
   _buffer.clear();
+  _buffer_start = 0;
 }
 
 void Client::setNickname(const std::string &nickname) {
@@ -80,12 +157,64 @@ void Client::checkAuthentication() {
   _is_authenticated = (_has_password && _has_nick && _has_user);
 }
 
-const std::string &Client::getBuffer() const {
-  return _buffer;
+// Input received but not yet extracted as commands.
+std::string Client::getBuffer() const {
+  return _buffer.substr(_buffer_start);
 }
 
+// The first write after a flush registers the client in the server's dirty
+// list; later writes only append, so a burst costs a single send().
 void Client::queueOutput(const std::string &data) {
   _out_buffer.append(data);
+  markQueued();
+}
+
+// A line that may start with an IRCv3 tag section ("@... "). Clients that
+// did not negotiate message-tags get it without, appended straight from the
+// shared string instead of a stripped copy; server-time clients keep its
+// time tag alone.
+void Client::queueTagged(const std::string &line) {
+  if (line.empty() || line[0] != '@' || (_caps & CAP_MESSAGE_TAGS) != 0) {
+    queueOutput(line);
+    return;
+  }
+  const std::size_t space = line.find(' ');
+  if (space == std::string::npos)
+    return;
+  if ((_caps & CAP_SERVER_TIME) != 0) {
+    std::size_t tag = 1;
+    while (tag < space && line.compare(tag, 5, "time=") != 0) {
+      tag = line.find(';', tag);
+      tag = tag < space ? tag + 1 : space;
+    }
+    if (tag < space) {
+      _out_buffer += '@';
+      _out_buffer.append(line, tag, std::min(line.find(';', tag), space) - tag);
+      _out_buffer += ' ';
+    }
+  }
+  _out_buffer.append(line, space + 1, std::string::npos);
+  markQueued();
+}
+
+void Client::markQueued() {
+  ++_queued_writes;
+  if (!_flush_pending && _flush_queue != NULL) {
+    _flush_pending = true;
+    _flush_queue->push_back(_fd);
+  }
+}
+
+void Client::setFlushQueue(std::vector<int> *queue) {
+  _flush_queue = queue;
+}
+
+std::size_t Client::markFlushed() {
+  std::size_t writes = _queued_writes;
+
+  _queued_writes = 0;
+  _flush_pending = false;
+  return writes;
 }
 
 bool Client::hasPendingOutput() const {
@@ -113,15 +242,144 @@ const std::string &Client::getRealname() const {
 }
 
 std::string Client::extractCommand() {
-  size_t pos = _buffer.find('\n');
+  size_t pos = _buffer.find('\n', _buffer_start);
   if (pos == std::string::npos)
     return "";
 
-  std::string command = _buffer.substr(0, pos);
-  _buffer = _buffer.substr(pos + CARRIAGE_RETURN_OFFSET);
+  std::string command = _buffer.substr(_buffer_start, pos - _buffer_start);
+  _buffer_start = pos + CARRIAGE_RETURN_OFFSET;
+  if (_buffer_start == _buffer.size())
+    clearBuffer();
 
   if (!command.empty() && command[command.size() - CARRIAGE_RETURN_OFFSET] == '\r')
     command.resize(command.size() - CARRIAGE_RETURN_OFFSET);
 
   return command;
 }
+
+// Names of the channels this client belongs to, kept in join order so that
+// quitting or WHOIS only touch the client's own channels.
+void Client::addChannel(const std::string &name) {
+  _channels.push_back(name);
+}
+
+void Client::removeChannel(const std::string &name) {
+  std::vector<std::string>::iterator it = std::find(_channels.begin(), _channels.end(), name);
+  if (it != _channels.end())
+    _channels.erase(it);
+}
+
+const std::vector<std::string> &Client::getChannels() const {
+  return _channels;
+}
+
+// Fan-out dedup: returns false when this client was already served the
+// message identified by epoch, so one line reaches it only once.
+bool Client::markDelivered(unsigned long epoch) {
+  if (_delivery_epoch == epoch)
+    return false;
+  _delivery_epoch = epoch;
+  return true;
+}
+
+// Set while the client sits in the server's ready queue with complete lines
+// left over from its per-iteration command budget.
+void Client::setReadyQueued(bool queued) {
+  _ready_queued = queued;
+}
+
+bool Client::isReadyQueued() const {
+  return _ready_queued;
+}
+
+// Set once the peer has closed its side (or the connection failed) while
+// lines it sent are still waiting to run.
+void Client::setClosing(bool closing) {
+  _closing = closing;
+}
+
+bool Client::isClosing() const {
+  return _closing;
+}
+
+// The server reads nothing more from a client with a backlog in the ready
+// queue or on its way out, so its input buffer cannot grow meanwhile.
+bool Client::isReadPaused() const {
+  return _ready_queued || _closing;
+}
+
+// io_uring only: whether a recv for this client may still complete.
+void Client::setRecvArmed(bool armed) {
+  _recv_armed = armed;
+}
+
+bool Client::isRecvArmed() const {
+  return _recv_armed;
+}
+
+// Peer IPv4 address in network byte order, as counted by the admission table.
+void Client::setAddress(unsigned int addr) {
+  _addr = addr;
+}
+
+unsigned int Client::getAddress() const {
+  return _addr;
+}
+
+// Nicks on this client's MONITOR list; the server keeps the reverse index.
+bool Client::addMonitor(const std::string &nick) {
+  if (std::find(_monitored.begin(), _monitored.end(), nick) != _monitored.end())
+    return false;
+  _monitored.push_back(nick);
+  return true;
+}
+
+bool Client::removeMonitor(const std::string &nick) {
+  std::vector<std::string>::iterator it = std::find(_monitored.begin(), _monitored.end(), nick);
+  if (it == _monitored.end())
+    return false;
+  _monitored.erase(it);
+  return true;
+}
+
+const std::vector<std::string> &Client::getMonitored() const {
+  return _monitored;
+}
+
+void Client::clearMonitored() {
+  _monitored.clear();
+}
+
+void Client::setCap(unsigned int cap, bool enabled) {
+  if (enabled)
+    _caps |= cap;
+  else
+    _caps &= ~cap;
+}
+
+bool Client::hasCap(unsigned int cap) const {
+  return (_caps & cap) != 0;
+}
+
+unsigned int Client::getCaps() const {
+  return _caps;
+}
+
+// Version from "CAP LS <version>"; 302 and later get multi-line replies and
+// cap-notify implicitly.
+void Client::setCapVersion(unsigned int version) {
+  _cap_version = version;
+}
+
+unsigned int Client::getCapVersion() const {
+  return _cap_version;
+}
+
+// Set by CAP LS or REQ before registration; the welcome waits for CAP END.
+void Client::setNegotiating(bool negotiating) {
+  _negotiating = negotiating;
+}
+
+bool Client::isNegotiating() const {
+  return _negotiating;
+}
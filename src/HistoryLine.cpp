@@ -0,0 +1,87 @@
+#include "../include/HistoryLine.hpp"
+#include <cstdio>
+
+namespace {
+// Message ids are the sequence number in hex.
+std::string formatMsgid(unsigned long seq) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%lx", seq);
+  return buffer;
+}
+} // namespace
+
+HistoryLine::HistoryLine(unsigned long seq, const std::string &msgid, unsigned long timeMs, const std::string &line)
+    : _refs(0), _seq(seq), _msgid(msgid), _time(timeMs), _line(line) {
+}
+
+HistoryLine::~HistoryLine() {
+}
+
+HistoryLine *HistoryLine::create(unsigned long seq, unsigned long timeMs, const std::string &line) {
+  return new HistoryLine(seq, formatMsgid(seq), timeMs, line);
+}
+
+void HistoryLine::retain() {
+  ++_refs;
+}
+
+void HistoryLine::release() {
+  if (--_refs == 0)
+    delete this;
+}
+
+unsigned long HistoryLine::getSeq() const {
+  return _seq;
+}
+
+const std::string &HistoryLine::getMsgid() const {
+  return _msgid;
+}
+
+unsigned long HistoryLine::getTime() const {
+  return _time;
+}
+
+const std::string &HistoryLine::getLine() const {
+  return _line;
+}
+
+// What the line costs against the history memory caps.
+std::size_t HistoryLine::getBytes() const {
+  return sizeof(HistoryLine) + _msgid.size() + _line.size();
+}
+
+HistoryRef::HistoryRef() : _line(NULL) {
+}
+
+HistoryRef::HistoryRef(HistoryLine *line) : _line(line) {
+  if (_line != NULL)
+    _line->retain();
+}
+
+HistoryRef::HistoryRef(const HistoryRef &other) : _line(other._line) {
+  if (_line != NULL)
+    _line->retain();
+}
+
+HistoryRef::~HistoryRef() {
+  if (_line != NULL)
+    _line->release();
+}
+
+HistoryRef &HistoryRef::operator=(const HistoryRef &other) {
+  if (other._line != NULL)
+    other._line->retain();
+  if (_line != NULL)
+    _line->release();
+  _line = other._line;
+  return *this;
+}
+
+const HistoryLine *HistoryRef::operator->() const {
+  return _line;
+}
+
+const HistoryLine *HistoryRef::get() const {
+  return _line;
+}
@@ -0,0 +1,778 @@
+#include "../include/HistoryLog.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+const unsigned int RECORD_MAGIC = 0x48435249; // "IRCH"
+const std::size_t RECORD_ALIGN = 8;
+const std::size_t COPY_CHUNK = 65536;
+
+// On-disk record: this header, the channel name, the line, then zero padding
+// to RECORD_ALIGN so every header in a mapped segment is aligned.
+struct RecordHeader {
+  unsigned int magic;
+  unsigned int checksum;
+  unsigned long seq;
+  unsigned long timeMs;
+  unsigned int channelLength;
+  unsigned int lineLength;
+};
+
+std::size_t recordSize(std::size_t channelLength, std::size_t lineLength) {
+  std::size_t size = sizeof(RecordHeader) + channelLength + lineLength;
+  return (size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+// FNV-1a over the header fields after the checksum and the payload; catches
+// records torn by a crash in the middle of a write.
+unsigned int checksum(const RecordHeader &header, const char *payload, std::size_t length) {
+  unsigned int hash = 2166136261U;
+  const char *fields = reinterpret_cast<const char *>(&header.seq);
+  const std::size_t fieldLength = sizeof(RecordHeader) - offsetof(RecordHeader, seq);
+  for (std::size_t i = 0; i < fieldLength; ++i)
+    hash = (hash ^ static_cast<unsigned char>(fields[i])) * 16777619U;
+  for (std::size_t i = 0; i < length; ++i)
+    hash = (hash ^ static_cast<unsigned char>(payload[i])) * 16777619U;
+  return hash;
+}
+
+bool writeAll(int fd, const char *data, std::size_t length) {
+  while (length > 0) {
+    ssize_t written = ::write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    length -= static_cast<std::size_t>(written);
+  }
+  return true;
+}
+
+bool copyFile(const std::string &path, std::size_t length, int outFd, std::vector<char> &buffer) {
+  int inFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (inFd < 0)
+    return false;
+  bool ok = true;
+  while (ok && length > 0) {
+    ssize_t got = ::read(inFd, &buffer[0], std::min(length, buffer.size()));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      ok = false;
+    else {
+      ok = writeAll(outFd, &buffer[0], static_cast<std::size_t>(got));
+      length -= static_cast<std::size_t>(got);
+    }
+  }
+  ::close(inFd);
+  return ok;
+}
+
+void deadlineAfter(unsigned long ms, struct timespec &until) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  const unsigned long nanos = static_cast<unsigned long>(now.tv_usec) * 1000UL + (ms % 1000UL) * 1000000UL;
+  until.tv_sec = now.tv_sec + static_cast<time_t>(ms / 1000UL + nanos / 1000000000UL);
+  until.tv_nsec = static_cast<long>(nanos % 1000000000UL);
+}
+
+struct SegmentLess {
+  bool operator()(const HistoryLogEntry &entry, unsigned int segment) const {
+    return entry.segment < segment;
+  }
+  bool operator()(unsigned int segment, const HistoryLogEntry &entry) const {
+    return segment < entry.segment;
+  }
+};
+} // namespace
+
+HistoryLog::HistoryLog()
+    : _max_bytes(0), _visitor(NULL), _open(false), _last_seq(0), _last_time(0), _stopping(false),
+      _recovered_seq(0), _recovered_time(0), _seed_offset(0), _active_fd(-1) {
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_wake, NULL);
+  std::memset(&_stats, 0, sizeof(_stats));
+}
+
+HistoryLog::~HistoryLog() {
+  close();
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_lock);
+}
+
+std::string HistoryLog::segmentPath(unsigned int id) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "/history-%08x.log", id);
+  return _directory + name;
+}
+
+// Only starts the writer, which indexes what is already on disk before it
+// opens a fresh segment, so a large log never holds up the event loop. Lines
+// appended meanwhile wait in _pending; queries see the disk part once
+// collect() has picked up the recovered index.
+bool HistoryLog::open(const std::string &directory, unsigned long maxBytes, HistoryLogVisitor *visitor) {
+  _directory = directory;
+  _max_bytes = maxBytes;
+  _visitor = visitor;
+  if (mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST) {
+    _error = "history: cannot create " + directory + ": " + std::strerror(errno);
+    return false;
+  }
+  if (_visitor != NULL)
+    _visitor->begin();
+
+  // The writer must not take SIGINT/SIGTERM away from the event loop.
+  sigset_t all;
+  sigset_t previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  int result = pthread_create(&_writer, NULL, &HistoryLog::writerMain, this);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (result != 0) {
+    _error = std::string("history: cannot start writer: ") + std::strerror(result);
+    dropSeeds();
+    return false;
+  }
+  _open = true;
+  return true;
+}
+
+// Lets the writer commit whatever is still queued, then stops it. Everything
+// else is forgotten, so the same directory can be opened again, by this
+// process or by another one.
+void HistoryLog::close() {
+  if (!_open)
+    return;
+
+  pthread_mutex_lock(&_lock);
+  _stopping = true;
+  pthread_mutex_unlock(&_lock);
+  pthread_cond_signal(&_wake);
+  pthread_join(_writer, NULL);
+
+  if (_active_fd >= 0)
+    ::close(_active_fd);
+  _active_fd = -1;
+  for (std::map<unsigned int, Mapping>::iterator it = _mappings.begin(); it != _mappings.end(); ++it)
+    munmap(const_cast<char *>(it->second.base), it->second.length);
+  _mappings.clear();
+  _index.clear();
+  _recovered.clear();
+  _recovered_seq = 0;
+  _recovered_time = 0;
+  _unplaced.clear();
+  _pending.clear();
+  _notices.clear();
+  _segments.clear();
+  _stopping = false;
+  std::memset(&_stats, 0, sizeof(_stats));
+  _open = false;
+}
+
+bool HistoryLog::isOpen() const {
+  return _open;
+}
+
+const std::string &HistoryLog::getError() const {
+  return _error;
+}
+
+// Writer thread. Gives up between segments when the log is being closed.
+bool HistoryLog::recover() {
+  DIR *dir = opendir(_directory.c_str());
+  if (dir == NULL) {
+    _error = "history: cannot read " + _directory + ": " + std::strerror(errno);
+    return false;
+  }
+
+  std::vector<unsigned int> ids;
+  for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    unsigned int id = 0;
+    char tail[8] = "";
+    // A leftover .tmp is a merge that never got renamed into place.
+    if (std::sscanf(name.c_str(), "history-%8x.log%7s", &id, tail) == 2 && std::string(tail) == ".tmp")
+      unlink((_directory + "/" + name).c_str());
+    else if (std::sscanf(name.c_str(), "history-%8x.log", &id) == 1 &&
+             name == segmentPath(id).substr(_directory.size() + 1))
+      ids.push_back(id);
+  }
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+
+  for (std::size_t i = 0; i < ids.size(); ++i) {
+    if (isStopping())
+      return false;
+    const std::string path = segmentPath(ids[i]);
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+      _error = "history: cannot open " + path + ": " + std::strerror(errno);
+      if (fd >= 0)
+        ::close(fd);
+      return false;
+    }
+
+    std::size_t size = static_cast<std::size_t>(info.st_size);
+    std::size_t valid = 0;
+    if (size > 0) {
+      void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        _error = "history: cannot map " + path + ": " + std::strerror(errno);
+        ::close(fd);
+        return false;
+      }
+      valid = scanSegment(ids[i], static_cast<const char *>(data), size);
+      if (_visitor != NULL && valid > 0) {
+        Seed seed;
+        seed.mapping.base = static_cast<const char *>(data);
+        seed.mapping.length = size;
+        seed.end = valid;
+        _seeds.push_back(seed);
+      } else {
+        munmap(data, size);
+      }
+    }
+    // Whatever follows the last intact record was torn by a crash. If it
+    // cannot be cut off it is only ignored: appends go to a new segment and
+    // merges copy intact bytes alone.
+    if (valid < size && ftruncate(fd, static_cast<off_t>(valid)) < 0)
+      _error = "history: cannot truncate " + path + ": " + std::strerror(errno);
+    ::close(fd);
+
+    if (valid == 0) {
+      unlink(path.c_str());
+      continue;
+    }
+    Segment segment;
+    segment.id = ids[i];
+    segment.bytes = valid;
+    _segments.push_back(segment);
+  }
+  return true;
+}
+
+// Indexes the intact records of a segment; returns where they end.
+std::size_t HistoryLog::scanSegment(unsigned int id, const char *data, std::size_t size) {
+  std::size_t offset = 0;
+
+  while (size - offset >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    std::memcpy(&header, data + offset, sizeof(header));
+    const std::size_t payload = static_cast<std::size_t>(header.channelLength) + header.lineLength;
+    if (header.magic != RECORD_MAGIC || payload > size - offset - sizeof(header) ||
+        header.checksum != checksum(header, data + offset + sizeof(header), payload))
+      break;
+
+    HistoryLogEntry entry;
+    entry.seq = header.seq;
+    entry.timeMs = header.timeMs;
+    entry.segment = id;
+    entry.offset = static_cast<unsigned int>(offset);
+    const std::string channel(data + offset + sizeof(header), header.channelLength);
+    if (header.lineLength == 0)
+      _recovered.erase(channel);
+    else
+      _recovered[channel].push_back(entry);
+    _recovered_seq = std::max(_recovered_seq, entry.seq);
+    _recovered_time = std::max(_recovered_time, entry.timeMs);
+    offset += std::min(recordSize(header.channelLength, header.lineLength), size - offset);
+  }
+  return offset;
+}
+
+void HistoryLog::index(const std::string &channel, const HistoryLogEntry &entry) {
+  _index[channel].push_back(entry);
+  _last_seq = std::max(_last_seq, entry.seq);
+  _last_time = std::max(_last_time, entry.timeMs);
+}
+
+// Loop side of a write: a copy of the record goes to the writer and the keys
+// wait in _unplaced until the writer reports the offset.
+void HistoryLog::append(const std::string &channel, unsigned long seq, unsigned long timeMs,
+                        const std::string &line) {
+  if (!_open)
+    return;
+
+  pthread_mutex_lock(&_lock);
+  if (_pending.size() >= HISTORY_PENDING_LIMIT && !line.empty()) {
+    ++_stats.dropped;
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  const bool wasIdle = _pending.empty();
+  _pending.push_back(Record());
+  Record &record = _pending.back();
+  record.channel = channel;
+  record.seq = seq;
+  record.timeMs = timeMs;
+  record.line = line;
+  pthread_mutex_unlock(&_lock);
+  if (wasIdle)
+    pthread_cond_signal(&_wake);
+
+  Placed placed;
+  placed.channel = channel;
+  placed.seq = seq;
+  placed.timeMs = timeMs;
+  placed.fence = line.empty();
+  _unplaced.push_back(placed);
+}
+
+// Cuts the channel off from everything it has on disk. The fence record
+// keeps it that way across restarts, and since records are placed in the
+// order they were queued, lines still on their way to the disk are cut off
+// when the fence itself is placed. A fence is never dropped for being over
+// the pending limit.
+void HistoryLog::fence(const std::string &channel, unsigned long seq, unsigned long timeMs) {
+  if (!_open)
+    return;
+  _index.erase(channel);
+  append(channel, seq, timeMs, std::string());
+}
+
+// False once the writer has reported that the disk copy could not be read
+// back; the log is closed then and getError() says why.
+bool HistoryLog::collect() {
+  if (!_open)
+    return true;
+
+  std::deque<Notice> notices;
+  pthread_mutex_lock(&_lock);
+  notices.swap(_notices);
+  pthread_mutex_unlock(&_lock);
+
+  bool recovered = true;
+  for (std::size_t i = 0; i < notices.size(); ++i) {
+    if (notices[i].kind == NOTICE_RECOVERED && notices[i].count == 0)
+      recovered = false;
+    else
+      applyNotice(notices[i]);
+  }
+  if (!recovered)
+    close();
+  return recovered;
+}
+
+void HistoryLog::applyNotice(Notice &notice) {
+  typedef std::map<std::string, std::deque<HistoryLogEntry> >::iterator IndexIterator;
+
+  if (notice.kind == NOTICE_RECOVERED) {
+    // Nothing has been written yet, so every entry so far came from disk.
+    _index.swap(_recovered);
+    _recovered.clear();
+    _last_seq = std::max(_last_seq, _recovered_seq);
+    _last_time = std::max(_last_time, _recovered_time);
+  } else if (notice.kind == NOTICE_WRITTEN) {
+    for (std::size_t i = 0; i < notice.offsets.size() && !_unplaced.empty(); ++i) {
+      const Placed &placed = _unplaced.front();
+      HistoryLogEntry entry;
+      entry.seq = placed.seq;
+      entry.timeMs = placed.timeMs;
+      entry.segment = notice.segment;
+      entry.offset = notice.offsets[i];
+      if (placed.fence)
+        _index.erase(placed.channel);
+      else
+        index(placed.channel, entry);
+      _unplaced.pop_front();
+    }
+  } else if (notice.kind == NOTICE_FAILED) {
+    for (std::size_t i = 0; i < notice.count && !_unplaced.empty(); ++i)
+      _unplaced.pop_front();
+  } else if (notice.kind == NOTICE_DROPPED) {
+    // The oldest segment holds the oldest entries of every channel.
+    unmapSegment(notice.segment);
+    for (IndexIterator it = _index.begin(); it != _index.end();) {
+      std::deque<HistoryLogEntry> &entries = it->second;
+      while (!entries.empty() && entries.front().segment == notice.segment)
+        entries.pop_front();
+      if (entries.empty())
+        _index.erase(it++);
+      else
+        ++it;
+    }
+  } else {
+    // The merged segment was appended to its predecessor: its entries move
+    // there, shifted by the predecessor's old size.
+    unmapSegment(notice.segment);
+    unmapSegment(notice.merged);
+    for (IndexIterator it = _index.begin(); it != _index.end(); ++it) {
+      std::deque<HistoryLogEntry> &entries = it->second;
+      std::deque<HistoryLogEntry>::iterator first =
+          std::lower_bound(entries.begin(), entries.end(), notice.merged, SegmentLess());
+      for (; first != entries.end() && first->segment == notice.merged; ++first) {
+        first->segment = notice.segment;
+        first->offset += notice.shift;
+      }
+    }
+  }
+}
+
+const std::deque<HistoryLogEntry> *HistoryLog::find(const std::string &channel) const {
+  std::map<std::string, std::deque<HistoryLogEntry> >::const_iterator it = _index.find(channel);
+  return it == _index.end() ? NULL : &it->second;
+}
+
+// Whether the channel has lines on disk or on their way there.
+bool HistoryLog::holds(const std::string &channel) const {
+  if (_index.find(channel) != _index.end())
+    return true;
+  for (std::size_t i = 0; i < _unplaced.size(); ++i)
+    if (_unplaced[i].channel == channel && !_unplaced[i].fence)
+      return true;
+  return false;
+}
+
+// Segments are mapped on first read. A mapping covers at least a full
+// segment, so the active one rarely needs remapping as it grows.
+const HistoryLog::Mapping *HistoryLog::mapSegment(unsigned int id) const {
+  std::map<unsigned int, Mapping>::iterator it = _mappings.find(id);
+  if (it != _mappings.end())
+    return &it->second;
+
+  int fd = ::open(segmentPath(id).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    ::close(fd);
+    return NULL;
+  }
+  std::size_t length = std::max(static_cast<std::size_t>(info.st_size), HISTORY_SEGMENT_BYTES);
+  void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  Mapping mapping;
+  mapping.base = static_cast<const char *>(data);
+  mapping.length = length;
+  return &(_mappings[id] = mapping);
+}
+
+void HistoryLog::unmapSegment(unsigned int id) const {
+  std::map<unsigned int, Mapping>::iterator it = _mappings.find(id);
+  if (it == _mappings.end())
+    return;
+  munmap(const_cast<char *>(it->second.base), it->second.length);
+  _mappings.erase(it);
+}
+
+// Rebuilds a stored line straight from the mapped segment. Only offsets the
+// writer has reported are ever read, so the bytes are already in the file; a
+// record past the end of the mapping means the segment outgrew it since it
+// was mapped.
+HistoryLine *HistoryLog::load(const HistoryLogEntry &entry) const {
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (attempt > 0)
+      unmapSegment(entry.segment);
+    const Mapping *mapping = mapSegment(entry.segment);
+    if (mapping == NULL)
+      return NULL;
+    if (entry.offset + sizeof(RecordHeader) > mapping->length)
+      continue;
+
+    RecordHeader header;
+    std::memcpy(&header, mapping->base + entry.offset, sizeof(header));
+    if (entry.offset + sizeof(header) + header.channelLength + header.lineLength > mapping->length)
+      continue;
+    if (header.magic != RECORD_MAGIC || header.seq != entry.seq)
+      return NULL;
+    const char *payload = mapping->base + entry.offset + sizeof(header);
+    return HistoryLine::create(header.seq, header.timeMs,
+                               std::string(payload + header.channelLength, header.lineLength));
+  }
+  return NULL;
+}
+
+unsigned long HistoryLog::getLastSeq() const {
+  return _last_seq;
+}
+
+unsigned long HistoryLog::getLastTime() const {
+  return _last_time;
+}
+
+HistoryLogStats HistoryLog::getStats() const {
+  pthread_mutex_t *lock = const_cast<pthread_mutex_t *>(&_lock);
+  pthread_mutex_lock(lock);
+  HistoryLogStats stats = _stats;
+  stats.pending = _pending.size();
+  pthread_mutex_unlock(lock);
+  return stats;
+}
+
+void *HistoryLog::writerMain(void *arg) {
+  static_cast<HistoryLog *>(arg)->writerLoop();
+  return NULL;
+}
+
+// The disk copy is read back first. After that, whatever piled up while the
+// previous batch was being written and synced goes out as the next batch.
+// Housekeeping runs between batches.
+void HistoryLog::writerLoop() {
+  Notice recovered;
+  recovered.kind = NOTICE_RECOVERED;
+  recovered.segment = 0;
+  recovered.merged = 0;
+  recovered.shift = 0;
+  recovered.count = recover() && openActive() ? 1 : 0;
+  if (recovered.count == 0) {
+    // Nothing is written to a log that was not read back whole; the loop
+    // closes it when it sees the notice.
+    dropSeeds();
+    if (!isStopping())
+      publish(recovered);
+    pthread_mutex_lock(&_lock);
+    while (!_stopping)
+      pthread_cond_wait(&_wake, &_lock);
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  publish(recovered);
+  if (_seeds.empty())
+    dropSeeds();
+
+  std::vector<Record> batch;
+  bool seeding = !_seeds.empty();
+
+  for (;;) {
+    pthread_mutex_lock(&_lock);
+    while (_pending.empty() && !_stopping && !seeding) {
+      if (_seeds.empty()) {
+        pthread_cond_wait(&_wake, &_lock);
+        continue;
+      }
+      // The visitor had no room: offer the rest again a little later.
+      struct timespec until;
+      deadlineAfter(HISTORY_SEED_RETRY_MS, until);
+      seeding = pthread_cond_timedwait(&_wake, &_lock, &until) == ETIMEDOUT;
+    }
+    const bool stopping = _stopping;
+    batch.swap(_pending);
+    pthread_mutex_unlock(&_lock);
+
+    if (batch.empty() && stopping)
+      break;
+    if (!batch.empty()) {
+      commit(batch);
+      batch.clear();
+      expireSegments();
+      mergeSegments();
+    }
+    seeding = !stopping && seed();
+  }
+  dropSeeds();
+}
+
+// Hands the visitor the next slice of recovered records. The records were
+// checked when the segment was scanned, so they are only walked here. True
+// while there is more and the visitor is keeping up.
+bool HistoryLog::seed() {
+  for (std::size_t fed = 0; fed < HISTORY_SEED_RECORDS && !_seeds.empty();) {
+    const Seed &current = _seeds.front();
+    if (_seed_offset >= current.end) {
+      munmap(const_cast<char *>(current.mapping.base), current.mapping.length);
+      _seeds.pop_front();
+      _seed_offset = 0;
+      if (_seeds.empty())
+        dropSeeds();
+      continue;
+    }
+    RecordHeader header;
+    std::memcpy(&header, current.mapping.base + _seed_offset, sizeof(header));
+    const char *payload = current.mapping.base + _seed_offset + sizeof(header);
+    if (!_visitor->visit(std::string(payload, header.channelLength), header.seq, header.timeMs,
+                         std::string(payload + header.channelLength, header.lineLength)))
+      return false;
+    _seed_offset += recordSize(header.channelLength, header.lineLength);
+    ++fed;
+  }
+  return !_seeds.empty();
+}
+
+// Done with the visitor, whether or not it has seen every record.
+void HistoryLog::dropSeeds() {
+  for (std::size_t i = 0; i < _seeds.size(); ++i)
+    munmap(const_cast<char *>(_seeds[i].mapping.base), _seeds[i].mapping.length);
+  _seeds.clear();
+  _seed_offset = 0;
+  if (_visitor != NULL)
+    _visitor->finish();
+  _visitor = NULL;
+}
+
+bool HistoryLog::isStopping() {
+  pthread_mutex_lock(&_lock);
+  const bool stopping = _stopping;
+  pthread_mutex_unlock(&_lock);
+  return stopping;
+}
+
+bool HistoryLog::openActive() {
+  const unsigned int id = _segments.empty() ? 1 : _segments.back().id + 1;
+  int fd = ::open(segmentPath(id).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    _error = "history: cannot create segment: " + std::string(std::strerror(errno));
+    return false;
+  }
+  _active_fd = fd;
+  Segment segment;
+  segment.id = id;
+  segment.bytes = 0;
+  _segments.push_back(segment);
+  return true;
+}
+
+void HistoryLog::commit(std::vector<Record> &batch) {
+  if (_active_fd >= 0 && _segments.back().bytes >= HISTORY_SEGMENT_BYTES) {
+    ::close(_active_fd);
+    _active_fd = -1;
+  }
+  if (_active_fd < 0)
+    openActive();
+
+  Notice notice;
+  notice.kind = NOTICE_WRITTEN;
+  notice.segment = _segments.back().id;
+  notice.merged = 0;
+  notice.shift = 0;
+  notice.count = batch.size();
+  notice.offsets.reserve(batch.size());
+
+  const std::size_t base = _segments.back().bytes;
+  _scratch.clear();
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    const Record &record = batch[i];
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.seq = record.seq;
+    header.timeMs = record.timeMs;
+    header.channelLength = static_cast<unsigned int>(record.channel.size());
+    header.lineLength = static_cast<unsigned int>(record.line.size());
+    std::string payload = record.channel + record.line;
+    header.checksum = checksum(header, payload.data(), payload.size());
+
+    notice.offsets.push_back(static_cast<unsigned int>(base + _scratch.size()));
+    _scratch.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    _scratch += payload;
+    _scratch.append(recordSize(record.channel.size(), record.line.size()) - sizeof(header) - payload.size(), '\0');
+  }
+
+  if (_active_fd < 0 || !writeAll(_active_fd, _scratch.data(), _scratch.size()) || fdatasync(_active_fd) < 0) {
+    // Cut back to the last good record so recovery never sees a gap.
+    if (_active_fd >= 0 && ftruncate(_active_fd, static_cast<off_t>(base)) < 0) {
+      ::close(_active_fd);
+      _active_fd = -1;
+    }
+    notice.kind = NOTICE_FAILED;
+    notice.offsets.clear();
+    publish(notice);
+    return;
+  }
+  _segments.back().bytes += _scratch.size();
+  publish(notice);
+}
+
+// Oldest sealed segments go first once the log is over its budget; the
+// active segment always stays.
+void HistoryLog::expireSegments() {
+  unsigned long total = 0;
+  for (std::size_t i = 0; i < _segments.size(); ++i)
+    total += _segments[i].bytes;
+
+  while (_segments.size() > 1 && total > _max_bytes) {
+    const Segment oldest = _segments.front();
+    unlink(segmentPath(oldest.id).c_str());
+    _segments.erase(_segments.begin());
+    total -= oldest.bytes;
+
+    Notice notice;
+    notice.kind = NOTICE_DROPPED;
+    notice.segment = oldest.id;
+    notice.merged = 0;
+    notice.shift = 0;
+    notice.count = 0;
+    publish(notice);
+  }
+}
+
+// Folds the first pair of neighbouring sealed segments that fit in one into
+// the older of the two, one pair per batch. Small segments come from
+// restarts, each of which starts a new one.
+bool HistoryLog::mergeSegments() {
+  std::size_t pair = 0;
+  while (pair + 2 < _segments.size() && _segments[pair].bytes + _segments[pair + 1].bytes > HISTORY_SEGMENT_BYTES)
+    ++pair;
+  if (pair + 2 >= _segments.size())
+    return false;
+
+  const Segment into = _segments[pair];
+  const Segment from = _segments[pair + 1];
+  const std::string target = segmentPath(into.id);
+  const std::string temporary = target + ".tmp";
+
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return false;
+  std::vector<char> buffer(COPY_CHUNK);
+  bool ok = copyFile(target, into.bytes, fd, buffer) && copyFile(segmentPath(from.id), from.bytes, fd, buffer) &&
+            fdatasync(fd) == 0;
+  ::close(fd);
+  if (!ok || rename(temporary.c_str(), target.c_str()) < 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  unlink(segmentPath(from.id).c_str());
+  _segments[pair].bytes += from.bytes;
+  _segments.erase(_segments.begin() + static_cast<long>(pair) + 1);
+
+  Notice notice;
+  notice.kind = NOTICE_MERGED;
+  notice.segment = into.id;
+  notice.merged = from.id;
+  notice.shift = static_cast<unsigned int>(into.bytes);
+  notice.count = 0;
+  publish(notice);
+  return true;
+}
+
+void HistoryLog::publish(Notice &notice) {
+  unsigned long total = 0;
+  for (std::size_t i = 0; i < _segments.size(); ++i)
+    total += _segments[i].bytes;
+
+  pthread_mutex_lock(&_lock);
+  if (notice.kind == NOTICE_WRITTEN) {
+    ++_stats.commits;
+    _stats.written += notice.offsets.size();
+  } else if (notice.kind == NOTICE_FAILED) {
+    _stats.failed += notice.count;
+  } else if (notice.kind == NOTICE_DROPPED) {
+    ++_stats.expired;
+  } else if (notice.kind == NOTICE_MERGED) {
+    ++_stats.merges;
+  }
+  _stats.segments = _segments.size();
+  _stats.diskBytes = total;
+  _notices.push_back(Notice());
+  _notices.back().kind = notice.kind;
+  _notices.back().segment = notice.segment;
+  _notices.back().merged = notice.merged;
+  _notices.back().shift = notice.shift;
+  _notices.back().count = notice.count;
+  _notices.back().offsets.swap(notice.offsets);
+  pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,446 @@
+#include "../include/HistoryStore.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sys/time.h>
+
+namespace {
+const std::size_t COMPACT_SLACK = 64;
+
+struct EntrySeqLess {
+  bool operator()(const HistoryLogEntry &entry, unsigned long seq) const {
+    return entry.seq < seq;
+  }
+};
+
+// One channel's history as a single sequence: the disk entries older than
+// the ring, then the ring, which always holds the newest stretch. Both parts
+// are sorted by seq and by time, so positions are found by binary search.
+class ChannelView {
+public:
+  ChannelView(const std::deque<HistoryRef> *ring, const std::deque<HistoryLogEntry> *disk, const HistoryLog &log)
+      : _ring(ring), _disk(disk), _log(log), _disk_count(0) {
+    if (_disk == NULL)
+      return;
+    _disk_count = _disk->size();
+    if (_ring != NULL && !_ring->empty())
+      _disk_count = std::lower_bound(_disk->begin(), _disk->end(), _ring->front()->getSeq(), EntrySeqLess()) -
+                    _disk->begin();
+  }
+
+  std::size_t size() const {
+    return _disk_count + (_ring == NULL ? 0 : _ring->size());
+  }
+
+  unsigned long seqAt(std::size_t i) const {
+    return i < _disk_count ? (*_disk)[i].seq : (*_ring)[i - _disk_count]->getSeq();
+  }
+
+  unsigned long timeAt(std::size_t i) const {
+    return i < _disk_count ? (*_disk)[i].timeMs : (*_ring)[i - _disk_count]->getTime();
+  }
+
+  // Index of the first line not older than the point.
+  std::size_t endBefore(const HistoryPoint &point) const {
+    return search(point, false);
+  }
+
+  // Index of the first line newer than the point.
+  std::size_t firstAfter(const HistoryPoint &point) const {
+    return search(point, true);
+  }
+
+  // Disk lines are read back from the mapped segment; one that can no longer
+  // be read (its segment just expired) is left out.
+  void copy(std::size_t begin, std::size_t end, std::vector<HistoryRef> &out) const {
+    for (std::size_t i = begin; i < end; ++i) {
+      if (i >= _disk_count) {
+        out.push_back((*_ring)[i - _disk_count]);
+        continue;
+      }
+      HistoryRef loaded(_log.load((*_disk)[i]));
+      if (loaded.get() != NULL)
+        out.push_back(loaded);
+    }
+  }
+
+private:
+  std::size_t search(const HistoryPoint &point, bool inclusive) const {
+    const unsigned long key = point.byMsgid ? point.seq : point.timeMs;
+    std::size_t low = 0;
+    std::size_t high = size();
+    while (low < high) {
+      const std::size_t middle = low + (high - low) / 2;
+      const unsigned long value = point.byMsgid ? seqAt(middle) : timeAt(middle);
+      if (value < key || (inclusive && value == key))
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    return low;
+  }
+
+  const std::deque<HistoryRef> *_ring;
+  const std::deque<HistoryLogEntry> *_disk;
+  const HistoryLog &_log;
+  std::size_t _disk_count;
+};
+
+// Accepts YYYY-MM-DDThh:mm:ss with optional .sss milliseconds, in UTC.
+bool parseTimestamp(const std::string &text, unsigned long &timeMs) {
+  struct tm fields;
+  std::memset(&fields, 0, sizeof(fields));
+  int consumed = 0;
+  if (std::sscanf(text.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &fields.tm_year, &fields.tm_mon, &fields.tm_mday,
+                  &fields.tm_hour, &fields.tm_min, &fields.tm_sec, &consumed) != 6)
+    return false;
+
+  std::string rest = text.substr(static_cast<std::size_t>(consumed));
+  unsigned long millis = 0;
+  if (!rest.empty() && rest[0] == '.') {
+    std::size_t digits = rest.find_first_not_of("0123456789", 1);
+    if (digits == std::string::npos)
+      digits = rest.size();
+    std::string fraction = rest.substr(1, digits - 1);
+    if (fraction.empty())
+      return false;
+    fraction = (fraction + "00").substr(0, 3);
+    millis = std::strtoul(fraction.c_str(), NULL, 10);
+    rest = rest.substr(digits);
+  }
+  if (!rest.empty() && rest != "Z")
+    return false;
+
+  fields.tm_year -= 1900;
+  fields.tm_mon -= 1;
+  std::time_t seconds = timegm(&fields);
+  if (seconds < 0)
+    return false;
+  timeMs = static_cast<unsigned long>(seconds) * 1000UL + millis;
+  return true;
+}
+
+struct SnapshotLess {
+  bool operator()(const std::pair<std::string, HistoryRef> &left,
+                  const std::pair<std::string, HistoryRef> &right) const {
+    return left.second->getSeq() < right.second->getSeq();
+  }
+};
+
+struct OrderLess {
+  template <typename Entry> bool operator()(const Entry &left, const Entry &right) const {
+    return left.seq < right.seq;
+  }
+};
+} // namespace
+
+HistoryStore::HistoryStore()
+    : _next_seq(wallClockMs() * 1000UL), _last_time(0), _lines(0), _bytes(0), _evicted(0) {
+}
+
+HistoryStore::~HistoryStore() {
+}
+
+// Starts loading the disk history in the background and keeps writing to
+// it. Sequence numbers and times carry on from the newest line on disk once
+// collectLog() has picked it up.
+bool HistoryStore::openLog(const std::string &directory, unsigned long maxBytes, HistoryLogVisitor *visitor) {
+  return _log.open(directory, maxBytes, visitor);
+}
+
+void HistoryStore::closeLog() {
+  _log.close();
+}
+
+const std::string &HistoryStore::getLogError() const {
+  return _log.getError();
+}
+
+// Picks up what the writer has made durable since the last call. False once
+// the log gave up because its disk copy could not be read back.
+bool HistoryStore::collectLog() {
+  if (!_log.collect())
+    return false;
+  _next_seq = std::max(_next_seq, _log.getLastSeq() + 1);
+  _last_time = std::max(_last_time, _log.getLastTime());
+  return true;
+}
+
+bool HistoryStore::getLogStats(HistoryLogStats &stats) const {
+  if (!_log.isOpen())
+    return false;
+  stats = _log.getStats();
+  return true;
+}
+
+unsigned long HistoryStore::wallClockMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return static_cast<unsigned long>(now.tv_sec) * 1000UL + static_cast<unsigned long>(now.tv_usec) / 1000UL;
+}
+
+// IRCv3 server-time format: 2024-01-31T12:34:56.789Z.
+std::string HistoryStore::formatTime(unsigned long timeMs) {
+  std::time_t seconds = static_cast<std::time_t>(timeMs / 1000UL);
+  struct tm fields;
+  gmtime_r(&seconds, &fields);
+
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &fields);
+  char buffer[48];
+  std::snprintf(buffer, sizeof(buffer), "%s.%03luZ", date, timeMs % 1000UL);
+  return buffer;
+}
+
+// "msgid=<id>" or "timestamp=<server-time>".
+bool HistoryStore::parsePoint(const std::string &token, HistoryPoint &point) {
+  point.byMsgid = false;
+  point.seq = 0;
+  point.timeMs = 0;
+
+  if (token.compare(0, 6, "msgid=") == 0) {
+    std::string id = token.substr(6);
+    if (id.empty() || id.size() > 16 || id.find_first_not_of("0123456789abcdef") != std::string::npos)
+      return false;
+    point.byMsgid = true;
+    point.seq = std::strtoul(id.c_str(), NULL, 16);
+    return true;
+  }
+  if (token.compare(0, 10, "timestamp=") == 0)
+    return parseTimestamp(token.substr(10), point.timeMs);
+  return false;
+}
+
+const HistoryLine *HistoryStore::append(const std::string &channel, const std::string &line, unsigned long timeMs) {
+  if (timeMs < _last_time)
+    timeMs = _last_time;
+  _last_time = timeMs;
+
+  const unsigned long seq = _next_seq++;
+  _log.append(channel, seq, timeMs, line);
+  return keep(channel, HistoryRef(HistoryLine::create(seq, timeMs, line)));
+}
+
+// A line handed over by the process this one replaced, with its id and time
+// unchanged. It is already on disk if it was ever going to be.
+void HistoryStore::restore(const std::string &channel, unsigned long seq, unsigned long timeMs,
+                           const std::string &line) {
+  _next_seq = std::max(_next_seq, seq + 1);
+  _last_time = std::max(_last_time, timeMs);
+  keep(channel, HistoryRef(HistoryLine::create(seq, timeMs, line)));
+}
+
+// Drops the ring and fences the log. The ring's entries in _order go stale
+// and are skipped like those of lines that left through the channel's cap.
+void HistoryStore::fence(const std::string &channel) {
+  HistoryMap::iterator it = _channels.find(channel);
+  const bool inMemory = it != _channels.end() && !it->second.lines.empty();
+  if (!inMemory && !_log.holds(channel))
+    return;
+  if (inMemory) {
+    ChannelHistory &history = it->second;
+    _bytes -= history.bytes;
+    _lines -= history.lines.size();
+    history.bytes = 0;
+    history.lines.clear();
+  }
+  _last_time = std::max(_last_time, wallClockMs());
+  _log.fence(channel, _next_seq++, _last_time);
+}
+
+// Every line still in memory with its channel, oldest first.
+void HistoryStore::snapshot(std::vector<std::pair<std::string, HistoryRef> > &out) const {
+  for (HistoryMap::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
+    for (std::size_t i = 0; i < it->second.lines.size(); ++i)
+      out.push_back(std::make_pair(it->first, it->second.lines[i]));
+  }
+  std::sort(out.begin(), out.end(), SnapshotLess());
+}
+
+const HistoryLine *HistoryStore::keep(const std::string &channel, const HistoryRef &stored) {
+  const unsigned long seq = stored->getSeq();
+  HistoryMap::iterator it = _channels.find(channel);
+  if (it == _channels.end()) {
+    ChannelHistory empty;
+    empty.bytes = 0;
+    empty.pending = 0;
+    it = _channels.insert(std::make_pair(channel, empty)).first;
+  }
+
+  ChannelHistory &history = it->second;
+  history.lines.push_back(stored);
+  history.bytes += stored->getBytes();
+  ++history.pending;
+  _bytes += stored->getBytes();
+  ++_lines;
+
+  OrderEntry entry;
+  entry.channel = it;
+  entry.seq = seq;
+  _order.push_back(entry);
+
+  // The newest line always stays, even if it alone is over the byte cap.
+  while (history.lines.size() > 1 &&
+         (history.lines.size() > HISTORY_CHANNEL_LINES || history.bytes > HISTORY_CHANNEL_BYTES))
+    dropOldest(history);
+  while (_bytes > HISTORY_TOTAL_BYTES && _order.size() > 1)
+    evictGlobal();
+  if (_order.size() > 2 * _lines + COMPACT_SLACK)
+    compactOrder();
+
+  return stored.get();
+}
+
+void HistoryStore::dropOldest(ChannelHistory &history) {
+  const std::size_t bytes = history.lines.front()->getBytes();
+  history.bytes -= bytes;
+  _bytes -= bytes;
+  --_lines;
+  ++_evicted;
+  history.lines.pop_front();
+}
+
+void HistoryStore::releaseOrder(HistoryMap::iterator channel) {
+  if (--channel->second.pending == 0 && channel->second.lines.empty())
+    _channels.erase(channel);
+}
+
+void HistoryStore::evictGlobal() {
+  OrderEntry oldest = _order.front();
+  _order.pop_front();
+
+  ChannelHistory &history = oldest.channel->second;
+  if (!history.lines.empty() && history.lines.front()->getSeq() == oldest.seq)
+    dropOldest(history);
+  releaseOrder(oldest.channel);
+}
+
+// Rebuilds the arrival order from the live lines alone.
+void HistoryStore::compactOrder() {
+  std::vector<OrderEntry> live;
+  live.reserve(_lines);
+
+  for (HistoryMap::iterator it = _channels.begin(); it != _channels.end();) {
+    ChannelHistory &history = it->second;
+    history.pending = history.lines.size();
+    if (history.lines.empty()) {
+      _channels.erase(it++);
+      continue;
+    }
+    for (std::size_t i = 0; i < history.lines.size(); ++i) {
+      OrderEntry entry;
+      entry.channel = it;
+      entry.seq = history.lines[i]->getSeq();
+      live.push_back(entry);
+    }
+    ++it;
+  }
+  std::sort(live.begin(), live.end(), OrderLess());
+  _order.assign(live.begin(), live.end());
+}
+
+const std::deque<HistoryRef> *HistoryStore::findRing(const std::string &channel) const {
+  HistoryMap::const_iterator it = _channels.find(channel);
+  return it == _channels.end() ? NULL : &it->second.lines;
+}
+
+// The newest lines, optionally only those after a point. Like every query
+// the result is oldest first.
+void HistoryStore::latest(const std::string &channel, const HistoryPoint *after, std::size_t limit,
+                          std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+
+  const std::size_t end = view.size();
+  std::size_t begin = after == NULL ? 0 : view.firstAfter(*after);
+  if (end - begin > limit)
+    begin = end - limit;
+  view.copy(begin, end, out);
+}
+
+void HistoryStore::before(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+                          std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+
+  const std::size_t end = view.endBefore(point);
+  view.copy(end > limit ? end - limit : 0, end, out);
+}
+
+void HistoryStore::after(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+                         std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+
+  const std::size_t begin = view.firstAfter(point);
+  view.copy(begin, std::min(view.size(), begin + limit), out);
+}
+
+// Up to limit lines centred on the point; a msgid point is included.
+void HistoryStore::around(const std::string &channel, const HistoryPoint &point, std::size_t limit,
+                          std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+
+  const std::size_t pivot = view.endBefore(point);
+  const std::size_t half = limit / 2;
+  std::size_t begin = pivot > half ? pivot - half : 0;
+  const std::size_t end = std::min(view.size(), begin + limit);
+  begin = end > limit ? end - limit : 0;
+  view.copy(begin, end, out);
+}
+
+// Lines strictly between the two points. Counting starts at `from`, so when
+// it is the later point the limit keeps the newest lines of the span.
+void HistoryStore::between(const std::string &channel, const HistoryPoint &from, const HistoryPoint &to,
+                           std::size_t limit, std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+
+  if (view.endBefore(from) <= view.endBefore(to)) {
+    const std::size_t begin = view.firstAfter(from);
+    const std::size_t end = std::max(begin, view.endBefore(to));
+    view.copy(begin, std::min(end, begin + limit), out);
+  } else {
+    const std::size_t begin = view.firstAfter(to);
+    const std::size_t end = std::max(begin, view.endBefore(from));
+    view.copy(end - begin > limit ? end - limit : begin, end, out);
+  }
+}
+
+bool HistoryStore::lastTime(const std::string &channel, unsigned long &timeMs) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+  if (view.size() == 0)
+    return false;
+  timeMs = view.timeAt(view.size() - 1);
+  return true;
+}
+
+// The line with exactly this sequence number, if it is still stored.
+bool HistoryStore::lookup(const std::string &channel, unsigned long seq, std::vector<HistoryRef> &out) const {
+  const ChannelView view(findRing(channel), _log.find(channel), _log);
+  HistoryPoint point;
+  point.byMsgid = true;
+  point.seq = seq;
+  point.timeMs = 0;
+
+  const std::size_t found = view.endBefore(point);
+  if (found >= view.size() || view.seqAt(found) != seq)
+    return false;
+  const std::size_t before = out.size();
+  view.copy(found, found + 1, out);
+  return out.size() > before;
+}
+
+std::size_t HistoryStore::channelCount() const {
+  return _channels.size();
+}
+
+std::size_t HistoryStore::lineCount() const {
+  return _lines;
+}
+
+std::size_t HistoryStore::byteCount() const {
+  return _bytes;
+}
+
+unsigned long HistoryStore::evictedCount() const {
+  return _evicted;
+}
@@ -0,0 +1,344 @@
+#include "../include/HotRestart.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+const unsigned int HANDOFF_MAGIC = 0x49524355; // "IRCU"
+// Bumped whenever the order or meaning of the state changes, so a binary
+// that cannot read it refuses instead of resuming garbage.
+const unsigned int HANDOFF_VERSION = 1;
+// The new process finds its end of the socket here.
+const int HANDOFF_CHILD_FD = 3;
+const char *const HANDOFF_CHILD_FD_TEXT = "3";
+// More state than this is taken for a corrupt header.
+const unsigned long HANDOFF_MAX_BYTES = 1UL << 32;
+const char ACK = 'A';
+
+struct Header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned long bytes;
+  unsigned long fds;
+};
+
+bool sendAll(int fd, const char *data, std::size_t length) {
+  while (length > 0) {
+    ssize_t sent = ::send(fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += sent;
+    length -= static_cast<std::size_t>(sent);
+  }
+  return true;
+}
+
+bool recvAll(int fd, char *data, std::size_t length) {
+  while (length > 0) {
+    ssize_t got = ::recv(fd, data, length, 0);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    data += got;
+    length -= static_cast<std::size_t>(got);
+  }
+  return true;
+}
+} // namespace
+
+HotRestart::HotRestart() : _socket(-1), _child(-1), _read(0), _intact(true) {
+}
+
+// Descriptors received but never taken belong to nobody else and are closed;
+// the sending side's descriptors stay with the server that put them.
+HotRestart::~HotRestart() {
+  if (_socket >= 0)
+    close(_socket);
+  for (std::size_t i = 0; i < _taken.size(); ++i) {
+    if (!_taken[i])
+      close(_fds[i]);
+  }
+}
+
+// Starts command with the other end of a fresh socket pair as descriptor
+// HANDOFF_CHILD_FD and nothing else open beyond the standard streams, so the
+// new process only gets the sockets that are passed to it explicitly.
+bool HotRestart::spawn(const std::vector<std::string> &command) {
+  if (command.empty())
+    return fail("no command to start");
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+    return fail(std::string("cannot create socket pair: ") + std::strerror(errno));
+
+  std::vector<char *> argv;
+  for (std::size_t i = 0; i < command.size(); ++i)
+    argv.push_back(const_cast<char *>(command[i].c_str()));
+  argv.push_back(NULL);
+  long limit = sysconf(_SC_OPEN_MAX);
+  if (limit < 0)
+    limit = 1024;
+
+  // Set here rather than in the child, where only async-signal-safe calls
+  // are allowed: the other threads may hold the allocator's locks.
+  setenv(HANDOFF_ENV, HANDOFF_CHILD_FD_TEXT, 1);
+  pid_t child = fork();
+  if (child == 0) {
+    if (pair[1] == HANDOFF_CHILD_FD)
+      fcntl(pair[1], F_SETFD, 0);
+    else
+      dup2(pair[1], HANDOFF_CHILD_FD);
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, HANDOFF_CHILD_FD + 1, ~0U, 0) != 0)
+#endif
+      for (int fd = HANDOFF_CHILD_FD + 1; fd < limit; ++fd)
+        close(fd);
+    execvp(argv[0], &argv[0]);
+    _exit(127);
+  }
+  unsetenv(HANDOFF_ENV);
+  close(pair[1]);
+  if (child < 0) {
+    close(pair[0]);
+    return fail(std::string("cannot fork: ") + std::strerror(errno));
+  }
+  _socket = pair[0];
+  _child = child;
+  return setTimeouts();
+}
+
+bool HotRestart::attach(int socket) {
+  _socket = socket;
+  fcntl(_socket, F_SETFD, FD_CLOEXEC);
+  return setTimeouts();
+}
+
+bool HotRestart::send() {
+  Header header;
+  header.magic = HANDOFF_MAGIC;
+  header.version = HANDOFF_VERSION;
+  header.bytes = _data.size();
+  header.fds = _fds.size();
+  if (!sendAll(_socket, reinterpret_cast<const char *>(&header), sizeof(header)))
+    return fail("cannot send state header");
+
+  for (std::size_t first = 0; first < _fds.size(); first += HANDOFF_FDS_PER_MESSAGE) {
+    const std::size_t count = std::min(HANDOFF_FDS_PER_MESSAGE, _fds.size() - first);
+    char marker = 'F';
+    struct iovec iov;
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+
+    struct msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = &control[0];
+    message.msg_controllen = control.size();
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(rights), &_fds[first], count * sizeof(int));
+
+    ssize_t sent = 0;
+    do
+      sent = sendmsg(_socket, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    if (sent != 1)
+      return fail("cannot pass descriptors");
+  }
+
+  if (!sendAll(_socket, _data.data(), _data.size()))
+    return fail("cannot send state");
+  return true;
+}
+
+bool HotRestart::receive() {
+  Header header;
+  if (!recvAll(_socket, reinterpret_cast<char *>(&header), sizeof(header)))
+    return fail("no state received");
+  if (header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION)
+    return fail("state written by an incompatible version");
+  if (header.bytes > HANDOFF_MAX_BYTES)
+    return fail("state header is corrupt");
+
+  while (_fds.size() < header.fds) {
+    const std::size_t count = std::min(HANDOFF_FDS_PER_MESSAGE, static_cast<std::size_t>(header.fds - _fds.size()));
+    char marker = 0;
+    struct iovec iov;
+    iov.iov_base = &marker;
+    iov.iov_len = 1;
+    std::vector<char> control(CMSG_SPACE(count * sizeof(int)), 0);
+
+    struct msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = &control[0];
+    message.msg_controllen = control.size();
+
+    ssize_t got = 0;
+    do
+      got = recvmsg(_socket, &message, MSG_CMSG_CLOEXEC);
+    while (got < 0 && errno == EINTR);
+
+    const std::size_t before = _fds.size();
+    if (got == 1) {
+      for (struct cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != NULL;
+           rights = CMSG_NXTHDR(&message, rights)) {
+        if (rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS)
+          continue;
+        const std::size_t received = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int *data = reinterpret_cast<const int *>(CMSG_DATA(rights));
+        _fds.insert(_fds.end(), data, data + received);
+      }
+    }
+    _taken.resize(_fds.size(), false);
+    if (got != 1 || (message.msg_flags & MSG_CTRUNC) != 0 || _fds.size() == before)
+      return fail("cannot receive descriptors");
+  }
+
+  _data.resize(header.bytes);
+  if (!_data.empty() && !recvAll(_socket, &_data[0], _data.size()))
+    return fail("state cut short");
+  return true;
+}
+
+bool HotRestart::acknowledge() {
+  if (!sendAll(_socket, &ACK, 1))
+    return fail("cannot acknowledge the hand-off");
+  return true;
+}
+
+bool HotRestart::awaitAcknowledgement() {
+  char answer = 0;
+  errno = 0;
+  if (!recvAll(_socket, &answer, 1) || answer != ACK)
+    return fail(errno == EAGAIN || errno == EWOULDBLOCK ? "new process did not answer in time"
+                                                        : "new process exited before taking over");
+  return true;
+}
+
+// The old process gives up: a new process that may still be starting, or
+// that answered too late, must not serve next to it.
+void HotRestart::abandon() {
+  if (_socket >= 0)
+    close(_socket);
+  _socket = -1;
+  if (_child <= 0)
+    return;
+  kill(_child, SIGKILL);
+  while (waitpid(_child, NULL, 0) < 0 && errno == EINTR) {
+  }
+  _child = 0;
+}
+
+const std::string &HotRestart::getError() const {
+  return _error;
+}
+
+void HotRestart::putNumber(unsigned long value) {
+  _data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void HotRestart::putString(const std::string &text) {
+  putNumber(text.size());
+  _data += text;
+}
+
+void HotRestart::putStrings(const std::vector<std::string> &texts) {
+  putNumber(texts.size());
+  for (std::size_t i = 0; i < texts.size(); ++i)
+    putString(texts[i]);
+}
+
+void HotRestart::putFd(int fd) {
+  putNumber(_fds.size());
+  _fds.push_back(fd);
+}
+
+// Reads past the end, or of a descriptor that never arrived, yield zero
+// values and mark the state as damaged, which callers check with isIntact().
+unsigned long HotRestart::takeNumber() {
+  unsigned long value = 0;
+  if (_data.size() - _read < sizeof(value)) {
+    _intact = false;
+    _read = _data.size();
+    return 0;
+  }
+  std::memcpy(&value, _data.data() + _read, sizeof(value));
+  _read += sizeof(value);
+  return value;
+}
+
+std::string HotRestart::takeString() {
+  const unsigned long length = takeNumber();
+  if (length > _data.size() - _read) {
+    _intact = false;
+    _read = _data.size();
+    return std::string();
+  }
+  std::string text(_data, _read, length);
+  _read += length;
+  return text;
+}
+
+void HotRestart::takeStrings(std::vector<std::string> &texts) {
+  for (unsigned long count = takeNumber(); count > 0 && _intact; --count)
+    texts.push_back(takeString());
+}
+
+int HotRestart::takeFd() {
+  const unsigned long index = takeNumber();
+  if (index >= _fds.size() || _taken[index]) {
+    _intact = false;
+    return -1;
+  }
+  _taken[index] = true;
+  return _fds[index];
+}
+
+bool HotRestart::isIntact() const {
+  return _intact;
+}
+
+bool HotRestart::atEnd() const {
+  return _read == _data.size();
+}
+
+std::size_t HotRestart::getBytes() const {
+  return _data.size();
+}
+
+std::size_t HotRestart::getFdCount() const {
+  return _fds.size();
+}
+
+bool HotRestart::fail(const std::string &what) {
+  _error = "upgrade: " + what;
+  return false;
+}
+
+bool HotRestart::setTimeouts() {
+  struct timeval timeout;
+  timeout.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000;
+  if (setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+      setsockopt(_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+    return fail(std::string("cannot set socket timeouts: ") + std::strerror(errno));
+  return true;
+}
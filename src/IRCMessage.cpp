@@ -1,9 +1,26 @@
 #include "../include/IRCMessage.hpp"
 
-IRCMessage::IRCMessage() : _valid(false), _hasTrailing(false) {
+namespace {
+// Bytes taken by the '+' tags of a raw tag section, separators included.
+std::size_t clientTagsLength(const std::string &tags) {
+  std::size_t length = 0;
+  std::size_t start = 0;
+  while (start < tags.size()) {
+    std::size_t end = tags.find(';', start);
+    if (end == std::string::npos)
+      end = tags.size();
+    if (tags[start] == '+')
+      length += end - start + 1;
+    start = end + 1;
+  }
+  return length;
+}
+} // namespace
+
+IRCMessage::IRCMessage() : _valid(false), _tooLong(false), _hasTrailing(false) {
 }
 
-IRCMessage::IRCMessage(const std::string &raw) : _valid(false), _hasTrailing(false) {
+IRCMessage::IRCMessage(const std::string &raw) : _valid(false), _tooLong(false), _hasTrailing(false) {
   parse(raw);
 }
 
@@ -11,9 +28,14 @@ bool IRCMessage::isValid() const {
     return _valid;
 }
 
+// Rejected for its length alone, which the client is told about.
+bool IRCMessage::isTooLong() const {
+  return _tooLong;
+}
+
 IRCMessage::IRCMessage(const IRCMessage &other)
-    : _valid(other._valid), _hasTrailing(other._hasTrailing), _prefix(other._prefix), _command(other._command), _trailing(other._trailing),
-      _params(other._params) {
+    : _valid(other._valid), _tooLong(other._tooLong), _hasTrailing(other._hasTrailing), _tags(other._tags),
+      _prefix(other._prefix), _command(other._command), _trailing(other._trailing), _params(other._params) {
 }
 
 IRCMessage::~IRCMessage() {
@@ -22,7 +44,9 @@ IRCMessage::~IRCMessage() {
 IRCMessage &IRCMessage::operator=(const IRCMessage &other) {
   if (this != &other) {
     _valid = other._valid;
+    _tooLong = other._tooLong;
     _hasTrailing = other._hasTrailing;
+    _tags = other._tags;
     _prefix = other._prefix;
     _command = other._command;
     _trailing = other._trailing;
@@ -32,21 +56,47 @@ IRCMessage &IRCMessage::operator=(const IRCMessage &other) {
 }
 
 bool IRCMessage::parse(const std::string &raw) {
+  _tags.clear();
   _prefix.clear();
   _command.clear();
   _params.clear();
   _trailing.clear();
   _valid = false;
+  _tooLong = false;
   _hasTrailing = false;
 
-  if (raw.empty() || raw.length() > IRC_MAX_MESSAGE_LENGTH)
+  // The tag section is kept as one raw string; getTag() and
+  // appendClientTags() walk it in place instead of splitting it up front.
+  size_t start = 0;
+  if (!raw.empty() && raw[0] == '@') {
+    start = raw.find(' ');
+    if (start == std::string::npos)
+      return false;
+    if (start + IRC_PARAM_OFFSET > IRC_MAX_TAGS_LENGTH) {
+      _tooLong = true;
+      return false;
+    }
+    _tags.assign(raw, IRC_PARAM_OFFSET, start - IRC_PARAM_OFFSET);
+    if (clientTagsLength(_tags) > IRC_MAX_CLIENT_TAGS_LENGTH) {
+      _tooLong = true;
+      return false;
+    }
+    while (start < raw.length() && raw[start] == ' ')
+      start++;
+  }
+
+  if (raw.length() == start)
+    return false;
+  if (raw.length() - start > IRC_MAX_MESSAGE_LENGTH) {
+    _tooLong = true;
     return false;
+  }
 
   // RFC: NULL bytes are not allowed TOPIC: 2.3.1 Message format
   if (raw.find('\0') != std::string::npos)
     return false;
 
-  std::string line = raw;
+  std::string line(raw, start, std::string::npos);
   if (!line.empty() && line[line.size() - IRC_PARAM_OFFSET] == '\r')
     line.erase(line.size() - IRC_PARAM_OFFSET);
 
@@ -124,6 +174,48 @@ bool IRCMessage::parse(const std::string &raw) {
   return true;
 }
 
+// Raw tag section without the '@', values still escaped.
+const std::string &IRCMessage::getTags() const {
+  return _tags;
+}
+
+// Looks the key up in the raw section and unescapes its value; a tag given
+// without '=' has an empty value.
+bool IRCMessage::getTag(const std::string &key, std::string &value) const {
+  std::size_t start = 0;
+  while (start < _tags.size()) {
+    std::size_t end = _tags.find(';', start);
+    if (end == std::string::npos)
+      end = _tags.size();
+    std::size_t equals = _tags.find('=', start);
+    const std::size_t keyEnd = equals < end ? equals : end;
+    if (_tags.compare(start, keyEnd - start, key) == 0) {
+      value.clear();
+      unescapeTagValue(value, _tags, keyEnd + 1, end);
+      return true;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+// Copies the client-only ('+') tags, still escaped, onto a tag section
+// being built for relaying, so they cross the server without being decoded.
+void IRCMessage::appendClientTags(std::string &out) const {
+  std::size_t start = 0;
+  while (start < _tags.size()) {
+    std::size_t end = _tags.find(';', start);
+    if (end == std::string::npos)
+      end = _tags.size();
+    if (_tags[start] == '+' && end > start + 1) {
+      if (!out.empty() && out[out.size() - 1] != '@')
+        out += ';';
+      out.append(_tags, start, end - start);
+    }
+    start = end + 1;
+  }
+}
+
 const std::vector<std::string> &IRCMessage::getParams() const {
   return _params;
 }
@@ -159,6 +251,46 @@ std::string IRCMessage::getSourceNick() const {
   return _prefix.substr(0, end);
 }
 
+// Tag values escape ';', ' ', '\', CR and LF as \:, \s, \\, \r and \n.
+void IRCMessage::escapeTagValue(std::string &out, const std::string &value) {
+  for (std::size_t i = 0; i < value.size(); ++i) {
+    switch (value[i]) {
+    case ';':
+      out += "\\:";
+      break;
+    case ' ':
+      out += "\\s";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    default:
+      out += value[i];
+    }
+  }
+}
+
+// Appends text[begin, end) with the escapes above undone; a lone trailing
+// backslash is dropped and an unknown escape stands for the character itself.
+void IRCMessage::unescapeTagValue(std::string &out, const std::string &text, std::size_t begin, std::size_t end) {
+  for (std::size_t i = begin; i < end; ++i) {
+    if (text[i] != '\\') {
+      out += text[i];
+      continue;
+    }
+    if (++i >= end)
+      break;
+    const char escaped = text[i];
+    out += escaped == ':' ? ';' : escaped == 's' ? ' ' : escaped == 'r' ? '\r' : escaped == 'n' ? '\n' : escaped;
+  }
+}
+
 std::string IRCMessage::formatReply(const std::string &prefix, const std::string &code, const std::string &target,
                                     const std::string &message) {
   return ":" + prefix + " " + code + " " + target + " " + message + "\r\n";
@@ -0,0 +1,160 @@
+#include "../include/InviteSet.hpp"
+
+namespace {
+const std::size_t INITIAL_CAPACITY = 8;
+const std::size_t NOT_FOUND = static_cast<std::size_t>(-1);
+
+std::size_t hashId(unsigned long clientId) {
+  return static_cast<std::size_t>(clientId * 11400714819323198485UL >> 32);
+}
+} // namespace
+
+InviteSet::InviteSet() : _used(0) {
+}
+
+InviteSet::~InviteSet() {
+}
+
+std::size_t InviteSet::find(unsigned long clientId) const {
+  if (_slots.empty())
+    return NOT_FOUND;
+
+  const std::size_t mask = _slots.size() - 1;
+  for (std::size_t i = hashId(clientId) & mask;; i = (i + 1) & mask) {
+    if (_slots[i].clientId == clientId)
+      return i;
+    if (_slots[i].clientId == 0)
+      return NOT_FOUND;
+  }
+}
+
+// Backward-shift deletion: later members of the probe run move up into the
+// hole so lookups never need tombstones.
+void InviteSet::erase(std::size_t index) {
+  const std::size_t mask = _slots.size() - 1;
+  std::size_t hole = index;
+
+  for (std::size_t i = (hole + 1) & mask; _slots[i].clientId != 0; i = (i + 1) & mask) {
+    std::size_t home = hashId(_slots[i].clientId) & mask;
+    // Move the entry unless its home lies cyclically in (hole, i].
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      _slots[hole] = _slots[i];
+      hole = i;
+    }
+  }
+  _slots[hole].clientId = 0;
+  _slots[hole].expires = 0;
+  --_used;
+}
+
+void InviteSet::resize(std::size_t capacity) {
+  std::vector<Slot> old;
+  old.swap(_slots);
+
+  Slot empty = {0, 0};
+  _slots.assign(capacity, empty);
+  _used = 0;
+  const std::size_t mask = capacity - 1;
+  for (std::size_t i = 0; i < old.size(); ++i) {
+    if (old[i].clientId == 0)
+      continue;
+    std::size_t j = hashId(old[i].clientId) & mask;
+    while (_slots[j].clientId != 0)
+      j = (j + 1) & mask;
+    _slots[j] = old[i];
+    ++_used;
+  }
+}
+
+void InviteSet::evictSoonest() {
+  std::size_t soonest = NOT_FOUND;
+  for (std::size_t i = 0; i < _slots.size(); ++i) {
+    if (_slots[i].clientId != 0 && (soonest == NOT_FOUND || _slots[i].expires < _slots[soonest].expires))
+      soonest = i;
+  }
+  if (soonest != NOT_FOUND)
+    erase(soonest);
+}
+
+// Re-inviting refreshes the expiry. A full set first drops what has already
+// expired, then the invite closest to expiring.
+void InviteSet::add(unsigned long clientId, unsigned long expiresMs, unsigned long nowMs) {
+  std::size_t index = find(clientId);
+  if (index != NOT_FOUND) {
+    _slots[index].expires = expiresMs;
+    return;
+  }
+
+  if (_used >= INVITE_SET_LIMIT) {
+    prune(nowMs);
+    if (_used >= INVITE_SET_LIMIT)
+      evictSoonest();
+  }
+  if (_slots.empty())
+    resize(INITIAL_CAPACITY);
+  else if ((_used + 1) * 4 > _slots.size() * 3)
+    resize(_slots.size() * 2);
+
+  const std::size_t mask = _slots.size() - 1;
+  std::size_t i = hashId(clientId) & mask;
+  while (_slots[i].clientId != 0)
+    i = (i + 1) & mask;
+  _slots[i].clientId = clientId;
+  _slots[i].expires = expiresMs;
+  ++_used;
+}
+
+bool InviteSet::contains(unsigned long clientId, unsigned long nowMs) const {
+  std::size_t index = find(clientId);
+  return index != NOT_FOUND && _slots[index].expires > nowMs;
+}
+
+// An invite is good for one JOIN.
+bool InviteSet::consume(unsigned long clientId, unsigned long nowMs) {
+  std::size_t index = find(clientId);
+  if (index == NOT_FOUND)
+    return false;
+
+  bool valid = _slots[index].expires > nowMs;
+  erase(index);
+  return valid;
+}
+
+void InviteSet::remove(unsigned long clientId) {
+  std::size_t index = find(clientId);
+  if (index != NOT_FOUND)
+    erase(index);
+}
+
+void InviteSet::prune(unsigned long nowMs) {
+  for (std::size_t i = 0; i < _slots.size();) {
+    // erase() may shift a later entry into slot i, so only advance when
+    // slot i was kept.
+    if (_slots[i].clientId != 0 && _slots[i].expires <= nowMs)
+      erase(i);
+    else
+      ++i;
+  }
+}
+
+// Keeps the table allocated: a pooled channel that saw invites once will
+// likely see them again.
+void InviteSet::clear() {
+  for (std::size_t i = 0; i < _slots.size(); ++i) {
+    _slots[i].clientId = 0;
+    _slots[i].expires = 0;
+  }
+  _used = 0;
+}
+
+std::size_t InviteSet::size() const {
+  return _used;
+}
+
+// Every pending invite as (client id, expiry), in table order.
+void InviteSet::collect(std::vector<std::pair<unsigned long, unsigned long> > &out) const {
+  for (std::size_t i = 0; i < _slots.size(); ++i) {
+    if (_slots[i].clientId != 0)
+      out.push_back(std::make_pair(_slots[i].clientId, _slots[i].expires));
+  }
+}
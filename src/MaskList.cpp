@@ -0,0 +1,213 @@
+#include "../include/MaskList.hpp"
+#include <cctype>
+
+namespace {
+// Characters of a literal anchor used as bucket key. Short enough that
+// lookups stay a handful of map probes, long enough to split a few hundred
+// nick bans into small buckets.
+const std::size_t BUCKET_KEY = 3;
+
+// Compares one '*'-free piece (which may hold '?') at a fixed offset.
+bool matchAt(const std::string &piece, const std::string &text, std::size_t offset) {
+  for (std::size_t i = 0; i < piece.size(); ++i) {
+    if (piece[i] != '?' && piece[i] != text[offset + i])
+      return false;
+  }
+  return true;
+}
+
+// Literal run at the start (or end) of a piece, before any '?'.
+std::string literalHead(const std::string &piece) {
+  return piece.substr(0, piece.find('?'));
+}
+
+std::string literalTail(const std::string &piece) {
+  std::size_t mark = piece.rfind('?');
+  return mark == std::string::npos ? piece : piece.substr(mark + 1);
+}
+} // namespace
+
+MaskList::MaskList() {
+}
+
+MaskList::~MaskList() {
+}
+
+// Completes a partial mask the way clients expect: "nick" bans nick!*@*,
+// "user@host" bans *!user@host and "nick!user" bans nick!user@*.
+std::string MaskList::normalize(const std::string &mask) {
+  std::size_t bang = mask.find('!');
+  std::size_t at = mask.find('@');
+
+  if (bang == std::string::npos && at == std::string::npos)
+    return mask + "!*@*";
+  if (bang == std::string::npos)
+    return "*!" + mask;
+  if (at == std::string::npos)
+    return mask + "@*";
+  return mask;
+}
+
+// CASEMAPPING=ascii
+std::string MaskList::fold(const std::string &text) {
+  std::string folded(text);
+  for (std::size_t i = 0; i < folded.size(); ++i)
+    folded[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(folded[i])));
+  return folded;
+}
+
+MaskList::CompiledMask MaskList::compile(const std::string &foldedMask) {
+  CompiledMask compiled;
+  std::vector<std::string> parts;
+  std::size_t start = 0;
+
+  while (true) {
+    std::size_t star = foldedMask.find('*', start);
+    parts.push_back(foldedMask.substr(start, star == std::string::npos ? std::string::npos : star - start));
+    if (star == std::string::npos)
+      break;
+    start = star + 1;
+  }
+
+  compiled.hasStar = parts.size() > 1;
+  compiled.prefix = parts.front();
+  if (compiled.hasStar) {
+    compiled.suffix = parts.back();
+    for (std::size_t i = 1; i + 1 < parts.size(); ++i) {
+      if (!parts[i].empty()) {
+        compiled.pieces.push_back(parts[i]);
+        compiled.pieceHeads.push_back(literalHead(parts[i]));
+      }
+    }
+  }
+  return compiled;
+}
+
+// Prefix and suffix are pinned to the ends; each middle piece then takes its
+// leftmost fit, which is enough for globs whose only repetition is '*'.
+bool MaskList::matchCompiled(const CompiledMask &compiled, const std::string &text) {
+  if (!compiled.hasStar)
+    return text.size() == compiled.prefix.size() && matchAt(compiled.prefix, text, 0);
+
+  if (text.size() < compiled.prefix.size() + compiled.suffix.size())
+    return false;
+  if (!matchAt(compiled.prefix, text, 0) ||
+      !matchAt(compiled.suffix, text, text.size() - compiled.suffix.size()))
+    return false;
+
+  std::size_t pos = compiled.prefix.size();
+  std::size_t end = text.size() - compiled.suffix.size();
+  for (std::size_t i = 0; i < compiled.pieces.size(); ++i) {
+    const std::string &piece = compiled.pieces[i];
+    const std::string &head = compiled.pieceHeads[i];
+    // Candidate offsets come from a plain find() of the piece's literal
+    // head; only those are checked against the whole piece.
+    while (true) {
+      std::size_t hit = head.empty() ? pos : text.find(head, pos);
+      if (hit == std::string::npos || hit + piece.size() > end)
+        return false;
+      if (matchAt(piece, text, hit)) {
+        pos = hit + piece.size();
+        break;
+      }
+      pos = hit + 1;
+    }
+  }
+  return true;
+}
+
+void MaskList::index(std::size_t position) {
+  const CompiledMask &compiled = _compiled[position];
+  std::string head = literalHead(compiled.prefix);
+  std::string tail = compiled.hasStar ? literalTail(compiled.suffix) : "";
+
+  if (!head.empty())
+    _by_prefix[head.substr(0, BUCKET_KEY)].push_back(position);
+  else if (!tail.empty())
+    _by_suffix[tail.substr(tail.size() > BUCKET_KEY ? tail.size() - BUCKET_KEY : 0)].push_back(position);
+  else
+    _unanchored.push_back(position);
+}
+
+void MaskList::rebuildIndex() {
+  _by_prefix.clear();
+  _by_suffix.clear();
+  _unanchored.clear();
+  for (std::size_t i = 0; i < _compiled.size(); ++i)
+    index(i);
+}
+
+bool MaskList::add(const std::string &mask, const std::string &setBy, std::time_t setAt) {
+  std::string folded = fold(mask);
+  for (std::size_t i = 0; i < _entries.size(); ++i) {
+    if (fold(_entries[i].mask) == folded)
+      return false;
+  }
+
+  MaskEntry entry;
+  entry.mask = mask;
+  entry.setBy = setBy;
+  entry.setAt = setAt;
+  _entries.push_back(entry);
+  _compiled.push_back(compile(folded));
+  index(_compiled.size() - 1);
+  return true;
+}
+
+// Removal is rare next to lookups, so the buckets are simply rebuilt.
+bool MaskList::remove(const std::string &mask) {
+  std::string folded = fold(mask);
+  for (std::size_t i = 0; i < _entries.size(); ++i) {
+    if (fold(_entries[i].mask) == folded) {
+      _entries.erase(_entries.begin() + i);
+      _compiled.erase(_compiled.begin() + i);
+      rebuildIndex();
+      return true;
+    }
+  }
+  return false;
+}
+
+void MaskList::clear() {
+  _entries.clear();
+  _compiled.clear();
+  _by_prefix.clear();
+  _by_suffix.clear();
+  _unanchored.clear();
+}
+
+bool MaskList::matches(const std::string &foldedHostmask) const {
+  if (_entries.empty())
+    return false;
+
+  const std::string &text = foldedHostmask;
+  for (std::size_t length = 1; length <= BUCKET_KEY && length <= text.size(); ++length) {
+    std::map<std::string, std::vector<std::size_t> >::const_iterator it = _by_prefix.find(text.substr(0, length));
+    if (it != _by_prefix.end()) {
+      for (std::size_t i = 0; i < it->second.size(); ++i) {
+        if (matchCompiled(_compiled[it->second[i]], text))
+          return true;
+      }
+    }
+    it = _by_suffix.find(text.substr(text.size() - length));
+    if (it != _by_suffix.end()) {
+      for (std::size_t i = 0; i < it->second.size(); ++i) {
+        if (matchCompiled(_compiled[it->second[i]], text))
+          return true;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < _unanchored.size(); ++i) {
+    if (matchCompiled(_compiled[_unanchored[i]], text))
+      return true;
+  }
+  return false;
+}
+
+std::size_t MaskList::size() const {
+  return _entries.size();
+}
+
+const std::vector<MaskEntry> &MaskList::getEntries() const {
+  return _entries;
+}
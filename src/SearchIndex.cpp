@@ -0,0 +1,662 @@
+#include "../include/SearchIndex.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+// Longer words are indexed (and searched) by their first TOKEN_MAX bytes.
+const std::size_t TOKEN_MIN = 2;
+const std::size_t TOKEN_MAX = 32;
+// New lines the worker may fall behind by before they are left out.
+const std::size_t INCOMING_LIMIT = 65536;
+
+bool isWordByte(unsigned char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+std::string lowerAscii(const std::string &nick) {
+  std::string folded(nick);
+  for (std::size_t i = 0; i < folded.size(); ++i)
+    if (folded[i] >= 'A' && folded[i] <= 'Z')
+      folded[i] = static_cast<char>(folded[i] - 'A' + 'a');
+  return folded;
+}
+
+void putVarint(std::string &out, unsigned long value) {
+  while (value >= 0x80) {
+    out += static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+unsigned long getVarint(const std::string &in, std::size_t &pos) {
+  unsigned long value = 0;
+  unsigned int shift = 0;
+  while (pos < in.size()) {
+    const unsigned char byte = static_cast<unsigned char>(in[pos++]);
+    value |= static_cast<unsigned long>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      break;
+    shift += 7;
+  }
+  return value;
+}
+
+// Splits ":nick!user@host PRIVMSG #chan :text\r\n" into sender and text.
+void splitLine(const std::string &line, std::string &nick, std::string &text) {
+  nick.clear();
+  text.clear();
+  if (line.empty() || line[0] != ':')
+    return;
+  const std::size_t nickEnd = line.find_first_of("! ", 1);
+  if (nickEnd == std::string::npos)
+    return;
+  nick = line.substr(1, nickEnd - 1);
+  const std::size_t textStart = line.find(" :", nickEnd);
+  if (textStart == std::string::npos)
+    return;
+  std::size_t textEnd = line.size();
+  while (textEnd > textStart + 2 && (line[textEnd - 1] == '\n' || line[textEnd - 1] == '\r'))
+    --textEnd;
+  text = line.substr(textStart + 2, textEnd - textStart - 2);
+}
+
+// New id of an interned name for compact(); the first document that uses
+// an old id gives it the next dense one.
+unsigned int renumber(std::vector<unsigned int> &newIds, const std::vector<std::string> &oldNames,
+                      std::vector<std::string> &names, unsigned int id) {
+  if (newIds[id] == 0) {
+    names.push_back(oldNames[id - 1]);
+    newIds[id] = static_cast<unsigned int>(names.size());
+  }
+  return newIds[id];
+}
+
+// Points the lookup at the new ids, dropping names no document uses any more.
+void remapIds(std::map<std::string, unsigned int> &ids, const std::vector<unsigned int> &newIds) {
+  std::map<std::string, unsigned int>::iterator it = ids.begin();
+  while (it != ids.end()) {
+    if (newIds[it->second] == 0) {
+      ids.erase(it++);
+      continue;
+    }
+    it->second = newIds[it->second];
+    ++it;
+  }
+}
+
+struct BlockFirstLess {
+  template <typename B> bool operator()(unsigned long doc, const B &block) const {
+    return doc < block.first;
+  }
+};
+} // namespace
+
+SearchIndex::SearchIndex()
+    : _first_doc(0), _compacted_floor(0), _posting_bytes(0), _notify_fd(-1), _running(false), _stopping(false),
+      _seeding(false), _outstanding(0) {
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_wake, NULL);
+  std::memset(&_stats, 0, sizeof(_stats));
+}
+
+SearchIndex::~SearchIndex() {
+  stop();
+  pthread_cond_destroy(&_wake);
+  pthread_mutex_destroy(&_lock);
+}
+
+// Lower-cased words of at least TOKEN_MIN bytes, each listed once. Bytes
+// above 0x7f count as word bytes, so UTF-8 words stay whole.
+void SearchIndex::tokenize(const std::string &text, std::vector<std::string> &tokens) {
+  tokens.clear();
+  std::size_t i = 0;
+  while (i < text.size()) {
+    while (i < text.size() && !isWordByte(static_cast<unsigned char>(text[i])))
+      ++i;
+    const std::size_t start = i;
+    while (i < text.size() && isWordByte(static_cast<unsigned char>(text[i])))
+      ++i;
+    if (i - start < TOKEN_MIN)
+      continue;
+    tokens.push_back(lowerAscii(text.substr(start, std::min(i - start, TOKEN_MAX))));
+  }
+  std::sort(tokens.begin(), tokens.end());
+  tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+}
+
+// Runs before the history log starts feeding the index what it found on
+// disk.
+bool SearchIndex::start() {
+  if (_running)
+    return true;
+  _stats.docs = _docs.size();
+  _stats.tokens = _postings.size();
+  _stats.postingBytes = _posting_bytes;
+  _notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_notify_fd < 0)
+    return false;
+
+  sigset_t all;
+  sigset_t previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  int result = pthread_create(&_worker, NULL, &SearchIndex::workerMain, this);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (result != 0) {
+    close(_notify_fd);
+    _notify_fd = -1;
+    return false;
+  }
+  _running = true;
+  return true;
+}
+
+void SearchIndex::stop() {
+  if (!_running)
+    return;
+  pthread_mutex_lock(&_lock);
+  _stopping = true;
+  pthread_mutex_unlock(&_lock);
+  pthread_cond_signal(&_wake);
+  pthread_join(_worker, NULL);
+  _running = false;
+  close(_notify_fd);
+  _notify_fd = -1;
+}
+
+// From begin() to finish() the history log feeds the index what it has on
+// disk. Documents are numbered in arrival order, so new lines wait in
+// _deferred until the older ones are all in.
+void SearchIndex::begin() {
+  pthread_mutex_lock(&_lock);
+  _seeding = true;
+  pthread_mutex_unlock(&_lock);
+}
+
+// Called by the history log's writer. Unlike add() it never drops a line:
+// while the worker is behind it refuses it, and the log offers it again.
+bool SearchIndex::visit(const std::string &channel, unsigned long seq, unsigned long timeMs,
+                        const std::string &line) {
+  if (!_running)
+    return true;
+  Incoming incoming;
+  incoming.channel = channel;
+  incoming.seq = seq;
+  incoming.timeMs = timeMs;
+  incoming.line = line;
+
+  pthread_mutex_lock(&_lock);
+  if (_incoming.size() >= INCOMING_LIMIT) {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+  const bool idle = _incoming.empty() && _queries.empty();
+  _incoming.push_back(incoming);
+  _stats.pending = _incoming.size();
+  pthread_mutex_unlock(&_lock);
+  if (idle)
+    pthread_cond_signal(&_wake);
+  return true;
+}
+
+void SearchIndex::finish() {
+  pthread_mutex_lock(&_lock);
+  _seeding = false;
+  const bool idle = _incoming.empty() && _queries.empty();
+  _incoming.insert(_incoming.end(), _deferred.begin(), _deferred.end());
+  _deferred.clear();
+  _stats.pending = _incoming.size();
+  pthread_mutex_unlock(&_lock);
+  if (idle)
+    pthread_cond_signal(&_wake);
+}
+
+void SearchIndex::add(const std::string &channel, unsigned long seq, unsigned long timeMs,
+                      const std::string &line) {
+  if (!_running)
+    return;
+  Incoming incoming;
+  incoming.channel = channel;
+  incoming.seq = seq;
+  incoming.timeMs = timeMs;
+  incoming.line = line;
+
+  pthread_mutex_lock(&_lock);
+  if (_seeding) {
+    if (_deferred.size() < INCOMING_LIMIT)
+      _deferred.push_back(incoming);
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  const bool idle = _incoming.empty() && _queries.empty();
+  if (_incoming.size() < INCOMING_LIMIT)
+    _incoming.push_back(incoming);
+  _stats.pending = _incoming.size();
+  pthread_mutex_unlock(&_lock);
+  if (idle)
+    pthread_cond_signal(&_wake);
+}
+
+// Everything indexed for the channel so far stays under its old id, which
+// no query can name any more; the next line starts a new one. Queued like a
+// line so it lands between the same documents as the history's fence.
+void SearchIndex::forget(const std::string &channel) {
+  add(channel, 0, 0, std::string());
+}
+
+// Without a worker the query is answered empty on the next collect().
+void SearchIndex::submit(const SearchQuery &query) {
+  pthread_mutex_lock(&_lock);
+  ++_outstanding;
+  if (_running) {
+    const bool idle = _incoming.empty() && _queries.empty();
+    _queries.push_back(query);
+    pthread_mutex_unlock(&_lock);
+    if (idle)
+      pthread_cond_signal(&_wake);
+    return;
+  }
+  SearchResult result;
+  result.id = query.id;
+  result.fd = query.fd;
+  result.clientId = query.clientId;
+  result.truncated = false;
+  _results.push_back(result);
+  pthread_mutex_unlock(&_lock);
+}
+
+void SearchIndex::collect(std::vector<SearchResult> &results) {
+  results.clear();
+  pthread_mutex_lock(&_lock);
+  results.swap(_results);
+  _outstanding -= results.size();
+  pthread_mutex_unlock(&_lock);
+}
+
+// Readable while answers wait for collect(); -1 without a worker, whose
+// empty answers are there at once.
+int SearchIndex::getNotifyFd() const {
+  return _notify_fd;
+}
+
+// Called by the loop when the fd woke it; the answers themselves are picked
+// up by collect().
+void SearchIndex::clearNotify() {
+  uint64_t count;
+  if (_notify_fd >= 0) {
+    const ssize_t got = read(_notify_fd, &count, sizeof(count));
+    (void)got;
+  }
+}
+
+// Loop thread only; the loop is the one submitting and collecting.
+bool SearchIndex::hasOutstanding() const {
+  return _outstanding > 0;
+}
+
+SearchStats SearchIndex::getStats() const {
+  pthread_mutex_lock(&_lock);
+  SearchStats stats = _stats;
+  pthread_mutex_unlock(&_lock);
+  return stats;
+}
+
+void *SearchIndex::workerMain(void *arg) {
+  static_cast<SearchIndex *>(arg)->workerLoop();
+  return NULL;
+}
+
+// New lines are indexed before the queries of the same round are answered,
+// so a query always sees every line relayed before it was sent.
+void SearchIndex::workerLoop() {
+  std::vector<Incoming> incoming;
+  std::vector<SearchQuery> queries;
+  std::vector<SearchResult> answers;
+
+  for (;;) {
+    pthread_mutex_lock(&_lock);
+    while (_incoming.empty() && _queries.empty() && !_stopping)
+      pthread_cond_wait(&_wake, &_lock);
+    if (_stopping) {
+      pthread_mutex_unlock(&_lock);
+      break;
+    }
+    incoming.swap(_incoming);
+    queries.swap(_queries);
+    _stats.pending = 0;
+    pthread_mutex_unlock(&_lock);
+
+    for (std::size_t i = 0; i < incoming.size(); ++i)
+      index(incoming[i]);
+    incoming.clear();
+
+    unsigned long truncated = 0;
+    answers.resize(queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+      run(queries[i], answers[i]);
+      if (answers[i].truncated)
+        ++truncated;
+    }
+
+    pthread_mutex_lock(&_lock);
+    _results.insert(_results.end(), answers.begin(), answers.end());
+    _stats.docs = _docs.size();
+    _stats.tokens = _postings.size();
+    _stats.postingBytes = _posting_bytes;
+    _stats.queries += queries.size();
+    _stats.truncated += truncated;
+    pthread_mutex_unlock(&_lock);
+    // Only a saturated counter refuses the write, and it is readable anyway.
+    if (!queries.empty()) {
+      const uint64_t one = 1;
+      const ssize_t written = write(_notify_fd, &one, sizeof(one));
+      (void)written;
+    }
+    answers.clear();
+    queries.clear();
+  }
+}
+
+// An empty line is a fence (see forget()).
+void SearchIndex::index(const Incoming &incoming) {
+  if (incoming.line.empty()) {
+    _channel_ids.erase(incoming.channel);
+    return;
+  }
+  std::string nick;
+  std::string text;
+  splitLine(incoming.line, nick, text);
+  tokenize(text, _scratch_tokens);
+
+  Document document;
+  document.seq = incoming.seq;
+  document.timeMs = incoming.timeMs;
+  document.channel = intern(_channel_ids, _channel_names, incoming.channel);
+  document.nick = intern(_nick_ids, _nick_names, lowerAscii(nick));
+  const unsigned long doc = _first_doc + _docs.size();
+  _docs.push_back(document);
+
+  for (std::size_t i = 0; i < _scratch_tokens.size(); ++i) {
+    std::map<std::string, PostingList>::iterator found = _postings.find(_scratch_tokens[i]);
+    if (found == _postings.end()) {
+      PostingList empty;
+      empty.last = 0;
+      empty.count = 0;
+      empty.lastBlockCount = 0;
+      found = _postings.insert(std::make_pair(_scratch_tokens[i], empty)).first;
+    }
+    PostingList &list = found->second;
+    const std::size_t before = list.bytes.size();
+    if (list.blocks.empty() || list.lastBlockCount >= SEARCH_BLOCK) {
+      Block block;
+      block.first = doc;
+      block.offset = list.bytes.size();
+      list.blocks.push_back(block);
+      list.lastBlockCount = 1;
+      _posting_bytes += sizeof(Block);
+    } else {
+      putVarint(list.bytes, doc - list.last);
+      ++list.lastBlockCount;
+    }
+    list.last = doc;
+    ++list.count;
+    _posting_bytes += list.bytes.size() - before;
+  }
+
+  if (_docs.size() > SEARCH_MAX_DOCS)
+    forgetOldest();
+}
+
+// Forgotten documents stay in the posting lists until enough of them pile up
+// for compact() to be worth a pass over every list.
+void SearchIndex::forgetOldest() {
+  _docs.pop_front();
+  ++_first_doc;
+  if (_first_doc - _compacted_floor > SEARCH_MAX_DOCS / 2)
+    compact();
+}
+
+void SearchIndex::compact() {
+  std::vector<unsigned long> decoded;
+  std::vector<unsigned long> kept;
+  _posting_bytes = 0;
+
+  std::map<std::string, PostingList>::iterator it = _postings.begin();
+  while (it != _postings.end()) {
+    PostingList &list = it->second;
+    kept.clear();
+    for (std::size_t b = 0; b < list.blocks.size(); ++b) {
+      decodeBlock(list, b, decoded);
+      for (std::size_t i = 0; i < decoded.size(); ++i)
+        if (decoded[i] >= _first_doc)
+          kept.push_back(decoded[i]);
+    }
+    if (kept.empty()) {
+      _postings.erase(it++);
+      continue;
+    }
+
+    PostingList rebuilt;
+    rebuilt.count = kept.size();
+    rebuilt.last = kept.back();
+    rebuilt.lastBlockCount = 0;
+    for (std::size_t i = 0; i < kept.size(); ++i) {
+      if (i % SEARCH_BLOCK == 0) {
+        Block block;
+        block.first = kept[i];
+        block.offset = rebuilt.bytes.size();
+        rebuilt.blocks.push_back(block);
+        rebuilt.lastBlockCount = 0;
+      } else
+        putVarint(rebuilt.bytes, kept[i] - kept[i - 1]);
+      ++rebuilt.lastBlockCount;
+    }
+    list.bytes.swap(rebuilt.bytes);
+    list.blocks.swap(rebuilt.blocks);
+    list.count = rebuilt.count;
+    list.last = rebuilt.last;
+    list.lastBlockCount = rebuilt.lastBlockCount;
+    _posting_bytes += list.bytes.size() + list.blocks.size() * sizeof(Block);
+    ++it;
+  }
+  compactNames();
+  _compacted_floor = _first_doc;
+  pthread_mutex_lock(&_lock);
+  ++_stats.compactions;
+  pthread_mutex_unlock(&_lock);
+}
+
+// Channel and nick names are interned once and never released on their
+// own: every nick seen and every fenced channel recreated adds one. Here
+// the tables are rebuilt from the surviving documents. A fenced channel's
+// old id keeps its documents and its name but, missing from _channel_ids
+// already, still cannot be named by a query.
+void SearchIndex::compactNames() {
+  std::vector<unsigned int> channelIds(_channel_names.size() + 1, 0);
+  std::vector<unsigned int> nickIds(_nick_names.size() + 1, 0);
+  std::vector<std::string> channelNames;
+  std::vector<std::string> nickNames;
+
+  for (std::deque<Document>::iterator it = _docs.begin(); it != _docs.end(); ++it) {
+    it->channel = renumber(channelIds, _channel_names, channelNames, it->channel);
+    it->nick = renumber(nickIds, _nick_names, nickNames, it->nick);
+  }
+  remapIds(_channel_ids, channelIds);
+  remapIds(_nick_ids, nickIds);
+  _channel_names.swap(channelNames);
+  _nick_names.swap(nickNames);
+}
+
+// Walks the rarest token's list from its newest block backwards and probes
+// the others, so the newest matches come first and the query can stop as
+// soon as it has enough of them. Every decoded posting is charged to the
+// budget; once it runs out the query answers with what it has.
+void SearchIndex::run(const SearchQuery &query, SearchResult &result) {
+  result.id = query.id;
+  result.fd = query.fd;
+  result.clientId = query.clientId;
+  result.hits.clear();
+  result.truncated = false;
+
+  std::vector<bool> channels(_channel_names.size() + 1, false);
+  bool anyChannel = false;
+  for (std::size_t i = 0; i < query.channels.size(); ++i) {
+    std::map<std::string, unsigned int>::const_iterator found = _channel_ids.find(query.channels[i]);
+    if (found != _channel_ids.end()) {
+      channels[found->second] = true;
+      anyChannel = true;
+    }
+  }
+  unsigned int nick = 0;
+  if (!query.nick.empty()) {
+    std::map<std::string, unsigned int>::const_iterator found = _nick_ids.find(lowerAscii(query.nick));
+    if (found == _nick_ids.end())
+      return;
+    nick = found->second;
+  }
+  if (!anyChannel || query.limit == 0)
+    return;
+
+  std::vector<unsigned long> matches;
+  std::size_t budget = SEARCH_DECODE_BUDGET;
+
+  if (query.tokens.empty()) {
+    for (std::size_t i = _docs.size(); i-- > 0;) {
+      if (budget == 0) {
+        result.truncated = true;
+        break;
+      }
+      --budget;
+      if (query.afterMs != 0 && _docs[i].timeMs <= query.afterMs)
+        break;
+      if (accepts(_docs[i], channels, nick, query)) {
+        matches.push_back(i);
+        if (matches.size() >= query.limit)
+          break;
+      }
+    }
+  } else {
+    std::vector<const PostingList *> lists;
+    for (std::size_t i = 0; i < query.tokens.size(); ++i) {
+      std::map<std::string, PostingList>::const_iterator found = _postings.find(query.tokens[i]);
+      if (found == _postings.end())
+        return;
+      lists.push_back(&found->second);
+    }
+    std::size_t rarest = 0;
+    for (std::size_t i = 1; i < lists.size(); ++i)
+      if (lists[i]->count < lists[rarest]->count)
+        rarest = i;
+
+    std::vector<Cursor> cursors;
+    for (std::size_t i = 0; i < lists.size(); ++i) {
+      if (i == rarest)
+        continue;
+      Cursor cursor;
+      cursor.list = lists[i];
+      cursor.block = lists[i]->blocks.size();
+      cursors.push_back(cursor);
+    }
+
+    const PostingList &primary = *lists[rarest];
+    std::vector<unsigned long> decoded;
+    bool done = false;
+    for (std::size_t b = primary.blocks.size(); !done && b-- > 0;) {
+      if (budget == 0) {
+        result.truncated = true;
+        break;
+      }
+      const std::size_t cost = decodeBlock(primary, b, decoded);
+      budget -= std::min(budget, cost);
+      for (std::size_t j = decoded.size(); !done && j-- > 0;) {
+        const unsigned long doc = decoded[j];
+        if (doc < _first_doc) {
+          done = true;
+          break;
+        }
+        const Document &document = _docs[doc - _first_doc];
+        if (query.afterMs != 0 && document.timeMs <= query.afterMs) {
+          done = true;
+          break;
+        }
+        if (!accepts(document, channels, nick, query))
+          continue;
+        bool all = true;
+        for (std::size_t c = 0; all && c < cursors.size(); ++c)
+          all = contains(cursors[c], doc, budget);
+        if (!all)
+          continue;
+        matches.push_back(doc - _first_doc);
+        if (matches.size() >= query.limit)
+          done = true;
+      }
+    }
+  }
+
+  for (std::size_t i = matches.size(); i-- > 0;) {
+    const Document &document = _docs[matches[i]];
+    SearchHit hit;
+    hit.channel = _channel_names[document.channel - 1];
+    hit.seq = document.seq;
+    result.hits.push_back(hit);
+  }
+}
+
+bool SearchIndex::accepts(const Document &document, const std::vector<bool> &channels, unsigned int nick,
+                          const SearchQuery &query) const {
+  if (!channels[document.channel])
+    return false;
+  if (nick != 0 && document.nick != nick)
+    return false;
+  if (query.beforeMs != 0 && document.timeMs >= query.beforeMs)
+    return false;
+  return query.afterMs == 0 || document.timeMs > query.afterMs;
+}
+
+std::size_t SearchIndex::decodeBlock(const PostingList &list, std::size_t block,
+                                     std::vector<unsigned long> &out) const {
+  out.clear();
+  unsigned long doc = list.blocks[block].first;
+  out.push_back(doc);
+  std::size_t pos = list.blocks[block].offset;
+  const std::size_t end = block + 1 < list.blocks.size() ? list.blocks[block + 1].offset : list.bytes.size();
+  while (pos < end) {
+    doc += getVarint(list.bytes, pos);
+    out.push_back(doc);
+  }
+  return out.size();
+}
+
+// The block that could hold the document is found from the skip entries;
+// probes come in descending order, so the last decoded block is usually the
+// right one again.
+bool SearchIndex::contains(Cursor &cursor, unsigned long doc, std::size_t &budget) const {
+  const std::vector<Block> &blocks = cursor.list->blocks;
+  std::vector<Block>::const_iterator next = std::upper_bound(blocks.begin(), blocks.end(), doc, BlockFirstLess());
+  if (next == blocks.begin())
+    return false;
+  const std::size_t block = static_cast<std::size_t>(next - blocks.begin()) - 1;
+  if (block != cursor.block) {
+    const std::size_t cost = decodeBlock(*cursor.list, block, cursor.decoded);
+    budget -= std::min(budget, cost);
+    cursor.block = block;
+  }
+  return std::binary_search(cursor.decoded.begin(), cursor.decoded.end(), doc);
+}
+
+// Ids start at 1; names[id - 1] maps back.
+unsigned int SearchIndex::intern(std::map<std::string, unsigned int> &ids, std::vector<std::string> &names,
+                                 const std::string &name) {
+  std::map<std::string, unsigned int>::iterator found = ids.find(name);
+  if (found != ids.end())
+    return found->second;
+  names.push_back(name);
+  const unsigned int id = static_cast<unsigned int>(names.size());
+  ids.insert(std::make_pair(name, id));
+  return id;
+}
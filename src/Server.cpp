@@ -1,7 +1,11 @@
 #include "../include/Server.hpp"
 #include "../include/Channel.hpp"
+#include "../include/HistoryStore.hpp"
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <csignal>
+#include <ctime>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -10,25 +14,217 @@ namespace {
 const int ERROR_CODE = -1;
 const int POLL_TIMEOUT = -1;
 const int SERVER_FD_INDEX = 0;
-const int FIRST_CLIENT_INDEX = 1;
+const int SEARCH_FD_INDEX = 1;
+const int FIRST_CLIENT_INDEX = 2;
 const size_t BUFFER_SIZE = 512;
 const int SOCK_OPT = 1;
 const int ONE_BYTE = 1;
 const int MAX_CHANNELS_PER_USER = 10;
+const std::size_t MAX_TARGETS = 20;
+const std::size_t MAX_LIST_ENTRIES = 500;
+const std::size_t MONITOR_LIMIT = 30;
+const std::size_t COMMAND_BUDGET = 32;
+const std::size_t BROADCAST_JOB_THRESHOLD = 1024;
+const std::size_t BROADCAST_SLICE = 2048;
+const std::size_t LIST_BATCH_ENTRIES = 100;
+const std::size_t LIST_SCAN_BUDGET = 2000;
+const std::size_t LIST_OUTPUT_HIGH_WATER = 16384;
+const std::size_t HISTORY_REPLAY_LIMIT = 100;
+const std::size_t HISTORY_REPLAY_SLICE = 25;
+// CHATHISTORY and SEARCH replies one client may have queued or still being
+// searched for; past it a request is refused with RATE_LIMITED.
+const std::size_t HISTORY_CLIENT_BACKLOG = 4;
+// Most matches one SEARCH returns.
+const std::size_t SEARCH_REPLAY_LIMIT = 100;
+// CAP LS 302 and later: capability names per reply line before continuing
+// on another one.
+const std::size_t CAP_LINE_BUDGET = 400;
+const unsigned long INVITE_EXPIRY_MS = 900000;
+const unsigned long FLOOD_MAX_MESSAGES = 1000;
+const unsigned long FLOOD_MAX_SECONDS = 3600;
+// Hot restart: how long LIST, CHATHISTORY and SEARCH replies in progress get
+// to finish once SIGUSR2 arrives, how long the io_uring backend waits for its
+// sends to drain, and how often the loop looks again in the meantime.
+const unsigned long HANDOFF_DRAIN_MS = 2000;
+const unsigned long HANDOFF_QUIESCE_MS = 1000;
+const long HANDOFF_POLL_US = 10000;
+// Client flags in the hand-off state.
+const unsigned long STATE_PASSWORD = 1 << 0;
+const unsigned long STATE_NICK = 1 << 1;
+const unsigned long STATE_USER = 1 << 2;
+const unsigned long STATE_WELCOMED = 1 << 3;
+const unsigned long STATE_NEGOTIATING = 1 << 4;
+// Channel modes and mask lists carried over, in the order they are written.
+const char *const STATE_MODES = "itklumf";
+const char *const STATE_MASK_LISTS = "beI";
 
 volatile sig_atomic_t g_shutdown_requested = 0;
+volatile sig_atomic_t g_upgrade_requested = 0;
+
+struct CapabilityName {
+  const char *name;
+  unsigned int bit;
+};
+
+// Everything CAP LS offers; REQ only accepts names from this table.
+const CapabilityName SUPPORTED_CAPS[] = {
+    {"batch", CAP_BATCH},
+    {"cap-notify", CAP_CAP_NOTIFY},
+    {"draft/chathistory", CAP_CHATHISTORY},
+    {"draft/no-implicit-names", CAP_NO_IMPLICIT_NAMES},
+    {"message-tags", CAP_MESSAGE_TAGS},
+    {"server-time", CAP_SERVER_TIME},
+    {"soju.im/search", CAP_SEARCH},
+};
+const std::size_t SUPPORTED_CAP_COUNT = sizeof(SUPPORTED_CAPS) / sizeof(SUPPORTED_CAPS[0]);
+
+unsigned int findCapability(const std::string &name) {
+  for (std::size_t i = 0; i < SUPPORTED_CAP_COUNT; ++i) {
+    if (name == SUPPORTED_CAPS[i].name)
+      return SUPPORTED_CAPS[i].bit;
+  }
+  return 0;
+}
+
+bool parseCount(const std::string &text, long &value) {
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  value = std::atol(text.c_str());
+  return true;
+}
+
+// "key=value;key=value" with values escaped as in message tags (\: for ';',
+// \s for ' ', \\ for '\'). Keys must be present and not repeated.
+bool parseSearchAttributes(const std::string &text, std::map<std::string, std::string> &attributes) {
+  std::size_t start = 0;
+  while (start <= text.size()) {
+    std::size_t end = text.find(';', start);
+    if (end == std::string::npos)
+      end = text.size();
+    const std::size_t equals = text.find('=', start);
+    const std::size_t keyEnd = equals < end ? equals : end;
+    if (keyEnd == start)
+      return false;
+    std::string value;
+    if (keyEnd < end)
+      IRCMessage::unescapeTagValue(value, text, keyEnd + 1, end);
+    if (!attributes.insert(std::make_pair(text.substr(start, keyEnd - start), value)).second)
+      return false;
+    start = end + 1;
+  }
+  return true;
+}
+
+// ELIST filters as advertised in ISUPPORT: U (>n, <n), C and T (C>n, C<n,
+// T>n, T<n, in minutes), M (mask) and N (!mask). Plain channel names are
+// looked up directly instead of walking every channel.
+void parseListFilters(const std::vector<std::string> &filters, ListQuery &query) {
+  for (std::size_t i = 0; i < filters.size(); ++i) {
+    const std::string &filter = filters[i];
+    long value = 0;
+
+    if ((filter[0] == '>' || filter[0] == '<') && parseCount(filter.substr(1), value)) {
+      if (filter[0] == '>')
+        query.minUsers = static_cast<std::size_t>(value) + 1;
+      else
+        query.maxUsers = value > 0 ? static_cast<std::size_t>(value) - 1 : 0;
+      query.bySize = true;
+    } else if (filter.size() > 2 && (filter[0] == 'C' || filter[0] == 'T') &&
+               (filter[1] == '>' || filter[1] == '<') && parseCount(filter.substr(2), value)) {
+      long *bound = NULL;
+      if (filter[0] == 'C')
+        bound = filter[1] == '>' ? &query.minCreatedAge : &query.maxCreatedAge;
+      else
+        bound = filter[1] == '>' ? &query.minTopicAge : &query.maxTopicAge;
+      *bound = value * 60;
+    } else if (filter[0] == '!' && filter.size() > 1) {
+      query.excludedMasks.add(filter.substr(1), "", 0);
+    } else if (filter.find_first_of("*?") != std::string::npos) {
+      query.masks.add(filter, "", 0);
+    } else {
+      query.names.push_back(filter);
+    }
+  }
+}
+
+// +f parameter: <messages>:<seconds>[:<action>], the action being d (drop,
+// the default), m (drop and set +m for a while) or n (drop and notice ops).
+bool parseFloodParam(const std::string &param, unsigned &messages, unsigned &seconds, char &action) {
+  std::size_t colon = param.find(':');
+  if (colon == std::string::npos)
+    return false;
+  std::size_t second = param.find(':', colon + 1);
+
+  long count = 0;
+  long period = 0;
+  if (!parseCount(param.substr(0, colon), count) ||
+      !parseCount(param.substr(colon + 1, second == std::string::npos ? std::string::npos : second - colon - 1),
+                  period))
+    return false;
+  if (count < 1 || count > static_cast<long>(FLOOD_MAX_MESSAGES) || period < 1 ||
+      period > static_cast<long>(FLOOD_MAX_SECONDS))
+    return false;
+
+  action = 'd';
+  if (second != std::string::npos) {
+    std::string suffix = param.substr(second + 1);
+    if (suffix.size() != 1 || std::string("dmn").find(suffix[0]) == std::string::npos)
+      return false;
+    action = suffix[0];
+  }
+  messages = static_cast<unsigned>(count);
+  seconds = static_cast<unsigned>(period);
+  return true;
+}
+
+bool matchesListQuery(const ListQuery &query, const Channel &channel, std::time_t now) {
+  std::size_t users = channel.getMembersNumber();
+  if (users < query.minUsers || users > query.maxUsers)
+    return false;
+
+  long createdAge = static_cast<long>(now - channel.getCreatedAt());
+  if ((query.minCreatedAge >= 0 && createdAge <= query.minCreatedAge) ||
+      (query.maxCreatedAge >= 0 && createdAge >= query.maxCreatedAge))
+    return false;
+
+  if (query.minTopicAge >= 0 || query.maxTopicAge >= 0) {
+    if (channel.getTopicSetAt() == 0)
+      return false;
+    long topicAge = static_cast<long>(now - channel.getTopicSetAt());
+    if ((query.minTopicAge >= 0 && topicAge <= query.minTopicAge) ||
+        (query.maxTopicAge >= 0 && topicAge >= query.maxTopicAge))
+      return false;
+  }
+
+  const std::string name = MaskList::fold(channel.getName());
+  return (query.masks.size() == 0 || query.masks.matches(name)) && !query.excludedMasks.matches(name);
+}
 
 void handleSignal(int signalNumber) {
   (void)signalNumber;
   g_shutdown_requested = 1;
 }
+
+void handleUpgradeSignal(int signalNumber) {
+  (void)signalNumber;
+  g_upgrade_requested = 1;
+}
 }
 
 Server::Server() {
 }
 
 Server::Server(const int PORT, const std::string &PASSWORD)
-    : _port(PORT), _password(PASSWORD), _server_name("irc.server") {
+    : _port(PORT), _password(PASSWORD), _server_name("irc.server"), _next_client_id(1),
+      _max_clients(DEFAULT_MAX_CLIENTS), _keepalive_ms(DEFAULT_KEEPALIVE_SECONDS * 1000UL),
+      _ping_timeout_ms(DEFAULT_PING_TIMEOUT_SECONDS * 1000UL),
+      _registration_timeout_ms(DEFAULT_REGISTRATION_TIMEOUT_SECONDS * 1000UL),
+      _flood_moderate_ms(DEFAULT_FLOOD_MODERATE_SECONDS * 1000UL), _delivery_epoch(0), _join_seq(0),
+      _list_backlog(false), _history_max_bytes(0), _history_backlog(false), _next_search_id(1), _next_batch_id(1),
+      _flush_mode(FLUSH_LATENCY), _flush_window_us(DEFAULT_FLUSH_WINDOW_US), _flush_deadline(0), _backend(BACKEND_POLL),
+      _uring(NULL), _upgrade_socket(ERROR_CODE), _upgrade_deadline(0), _handed_off(false) {
+  std::memset(&_stats, 0, sizeof(_stats));
+  _admission.setLimits(DEFAULT_MAX_PER_IP, DEFAULT_MAX_CONN_RATE);
 
   _message_handlers["PASS"] = &Server::handlePASS;
   _message_handlers["CAP"] = &Server::handleCAP;
@@ -37,9 +233,11 @@ Server::Server(const int PORT, const std::string &PASSWORD)
   _message_handlers["QUIT"] = &Server::handleQUIT;
 
   _message_handlers["PING"] = &Server::handlePING;
+  _message_handlers["PONG"] = &Server::handlePONG;
   _message_handlers["JOIN"] = &Server::handleJOIN;
   _message_handlers["PART"] = &Server::handlePART;
   _message_handlers["PRIVMSG"] = &Server::handlePRIVMSG;
+  _message_handlers["NOTICE"] = &Server::handleNOTICE;
   _message_handlers["WHOIS"] = &Server::handleWHOIS;
   _message_handlers["LIST"] = &Server::handleLIST;
   _message_handlers["NAMES"] = &Server::handleNAMES;
@@ -49,17 +247,82 @@ Server::Server(const int PORT, const std::string &PASSWORD)
   _message_handlers["TOPIC"] = &Server::handleTOPIC;
   _message_handlers["INVITE"] = &Server::handleINVITE;
   _message_handlers["KICK"] = &Server::handleKICK;
+  _message_handlers["STATS"] = &Server::handleSTATS;
+  _message_handlers["MONITOR"] = &Server::handleMONITOR;
+  _message_handlers["CHATHISTORY"] = &Server::handleCHATHISTORY;
+  _message_handlers["SEARCH"] = &Server::handleSEARCH;
 
 }
 
 Server::~Server() {
+  // The log's writer may still be feeding the index, which goes first.
+  _history.closeLog();
+  delete _uring;
+}
+
+void Server::setBackend(EventBackend backend) {
+  _backend = backend;
+}
+
+// Limits of 0 disable the corresponding check.
+void Server::setAdmissionLimits(std::size_t maxClients, std::size_t maxPerIp, std::size_t maxPerSecond) {
+  _max_clients = maxClients;
+  _admission.setLimits(maxPerIp, maxPerSecond);
+}
+
+// Nothing fires sooner than the timer wheel turns, so shorter values are
+// raised to one tick.
+void Server::setClientTimeouts(unsigned long keepaliveMs, unsigned long pingTimeoutMs, unsigned long registrationMs) {
+  _keepalive_ms = std::max(keepaliveMs, TIMER_TICK_MS);
+  _ping_timeout_ms = std::max(pingTimeoutMs, TIMER_TICK_MS);
+  _registration_timeout_ms = std::max(registrationMs, TIMER_TICK_MS);
+}
+
+// How long a +f channel with the m action stays moderated once it trips.
+void Server::setFloodModeration(unsigned long moderateMs) {
+  _flood_moderate_ms = std::max(moderateMs, TIMER_TICK_MS);
+}
+
+// An empty directory keeps the history in memory only.
+void Server::setHistoryLog(const std::string &directory, unsigned long maxBytes) {
+  _history_dir = directory;
+  _history_max_bytes = maxBytes;
+}
+
+// What SIGUSR2 runs to start the process that takes over: normally the
+// server's own command line, so a binary replaced on disk is picked up.
+void Server::setUpgradeCommand(const std::vector<std::string> &command) {
+  _upgrade_command = command;
+}
+
+// Set in the process that takes over: run() resumes from the state read from
+// this socket instead of opening the port.
+void Server::setUpgradeSocket(int socket) {
+  _upgrade_socket = socket;
+}
+
+void Server::setFlushPolicy(FlushMode mode, unsigned long windowUs) {
+  _flush_mode = mode;
+  _flush_window_us = windowUs;
 }
 
 void Server::run() {
   std::signal(SIGINT, handleSignal);
   std::signal(SIGTERM, handleSignal);
-
-  initSocket(_port);
+  std::signal(SIGUSR2, handleUpgradeSignal);
+
+  HotRestart restart;
+  unsigned long handOffStarted = 0;
+  if (_upgrade_socket != ERROR_CODE) {
+    if (!restart.attach(_upgrade_socket) || !restart.receive())
+      throw std::runtime_error(restart.getError());
+    handOffStarted = restart.takeNumber();
+    _server_socket = restart.takeFd();
+    if (_server_socket == ERROR_CODE)
+      throw std::runtime_error("upgrade: no listening socket in the state handed over");
+  } else {
+    initSocket(_port);
+  }
 
   struct pollfd serverPollFd;
   serverPollFd.fd = _server_socket;
@@ -68,28 +331,82 @@ void Server::run() {
 
   _poll_fds.push_back(serverPollFd);
 
-  std::cout << "Server running on port " << _port << std::endl;
+  if (_backend == BACKEND_URING) {
+    _uring = new UringBackend();
+    if (!_uring->init()) {
+      std::cerr << "io_uring unavailable (" << _uring->getError() << "), falling back to poll()" << std::endl;
+      delete _uring;
+      _uring = NULL;
+    }
+  }
+
+  if (!_search.start())
+    std::cerr << "search: cannot start indexer, SEARCH will find nothing" << std::endl;
+  // The indexer wakes the loop through this slot when it has answers.
+  struct pollfd searchPollFd;
+  searchPollFd.fd = _search.getNotifyFd();
+  searchPollFd.events = POLLIN;
+  searchPollFd.revents = 0;
+  _poll_fds.push_back(searchPollFd);
+  if (_upgrade_socket != ERROR_CODE)
+    restoreState(restart, handOffStarted);
+  // The log is read back and fed to the index on its writer thread, so
+  // neither startup nor a process waiting for the acknowledgement above
+  // waits for the disk.
+  if (!_history_dir.empty() && !_history.openLog(_history_dir, _history_max_bytes, &_search))
+    std::cerr << _history.getLogError() << ", keeping history in memory only" << std::endl;
+
+  std::cout << "Server running on port " << _port << " (" << (_uring != NULL ? "io_uring" : "poll") << " backend)"
+            << std::endl;
   std::cout << "Waiting for connections..." << std::endl;
 
-  while (!g_shutdown_requested) {
-    for (size_t index = FIRST_CLIENT_INDEX; index < _poll_fds.size(); ++index) {
-      Client &client = *_clients[index - FIRST_CLIENT_INDEX];
-      short events = POLLIN;
-      if (client.hasPendingOutput())
-        events |= POLLOUT;
-      _poll_fds[index].events = events;
-    }
+  if (_uring != NULL)
+    runUring();
+  else
+    runPoll();
+
+  std::vector<std::string> report = getStatsReport();
+  for (std::size_t i = 0; i < report.size(); ++i)
+    std::cout << "[ STATS ] " << report[i] << std::endl;
+
+  // The sockets now belong to the new process: no goodbyes, just let go.
+  if (_handed_off) {
+    delete _uring;
+    _uring = NULL;
+    return;
+  }
 
-    int pollFd = poll(_poll_fds.data(), _poll_fds.size(), POLL_TIMEOUT);
+  while (_poll_fds.size() > FIRST_CLIENT_INDEX) {
+    removeClient(FIRST_CLIENT_INDEX, "");
+  }
+  reclaimChannels();
+  if (_server_socket != ERROR_CODE) {
+    if (_uring != NULL)
+      _uring->cancel(_server_socket);
+    close(_server_socket);
+    _server_socket = ERROR_CODE;
+  }
+  delete _uring;
+  _uring = NULL;
+}
+
+void Server::runPoll() {
+  while (!g_shutdown_requested) {
+    if (g_upgrade_requested && pumpHandOff())
+      break;
+    int pollFd = pollEvents();
     if (pollFd < 0) {
       if (g_shutdown_requested) {
         break;
       }
       continue;
     }
+    unsigned long iterationStart = TimerWheel::nowUs();
 
     if ((_poll_fds[SERVER_FD_INDEX].revents & POLLIN) != 0)
       acceptClient();
+    if ((_poll_fds[SEARCH_FD_INDEX].revents & POLLIN) != 0)
+      _search.clearNotify();
 
     for (size_t index = FIRST_CLIENT_INDEX; index < _poll_fds.size(); ++index) {
       int clientFd = _poll_fds[index].fd;
@@ -111,15 +428,153 @@ void Server::run() {
         flushClientOutput(client);
       }
     }
+
+    serveReadyClients();
+    runBroadcastJobs();
+    processTimers();
+    pumpListQueries();
+    collectHistoryLog();
+    collectSearchResults();
+    pumpHistoryReplays();
+    flushDirtyClients();
+    reclaimChannels();
+    trimPools();
+    recordLoopLatency(iterationStart);
   }
+}
 
-  while (_poll_fds.size() > FIRST_CLIENT_INDEX) {
-    removeClient(FIRST_CLIENT_INDEX);
+// Completion-driven loop: accept and recv stay armed as multishot requests, so
+// a wakeup needs no further syscalls; queued sends go out with the next wait.
+void Server::runUring() {
+  std::vector<UringEvent> events;
+
+  _uring->armAccept(_server_socket);
+  if (_search.getNotifyFd() != ERROR_CODE)
+    _uring->armWakeup(_search.getNotifyFd());
+  while (!g_shutdown_requested) {
+    if (g_upgrade_requested && pumpHandOff())
+      break;
+    events.clear();
+    if (_uring->wait(nextWakeupUs(), events) < 0) {
+      std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    unsigned long iterationStart = TimerWheel::nowUs();
+    for (std::size_t i = 0; i < events.size(); ++i)
+      handleUringEvent(events[i]);
+
+    serveReadyClients();
+    runBroadcastJobs();
+    processTimers();
+    pumpListQueries();
+    collectHistoryLog();
+    collectSearchResults();
+    pumpHistoryReplays();
+    flushDirtyClients();
+    reclaimChannels();
+    trimPools();
+    recordLoopLatency(iterationStart);
   }
-  if (_server_socket != ERROR_CODE) {
-    close(_server_socket);
-    _server_socket = ERROR_CODE;
+}
+
+void Server::handleUringEvent(const UringEvent &event) {
+  if (event.type == URING_ACCEPT) {
+    ++_stats.acceptCompletions;
+    if (event.result < 0)
+      return;
+    // Multishot accept reports no peer address; ask the socket. A peer that
+    // already reset has none left to give.
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
+    std::memset(&peer, 0, sizeof(peer));
+    if (getpeername(event.result, reinterpret_cast<struct sockaddr *>(&peer), &peerLen) == ERROR_CODE) {
+      close(event.result);
+      return;
+    }
+    if (admitConnection(event.result, peer.sin_addr.s_addr))
+      registerClient(event.result, peer.sin_addr.s_addr);
+    return;
+  }
+  if (event.type == URING_WAKEUP) {
+    _search.clearNotify();
+    return;
+  }
+
+  Client *client = findClientByFd(event.fd);
+  if (client == NULL || UringBackend::tagOf(client->getId()) != event.tag)
+    return;
+
+  if (event.type == URING_SEND) {
+    if (event.result < 0) {
+      handleHangup(*client);
+    } else if (client->hasPendingOutput()) {
+      flushClientOutput(*client);
+    }
+    return;
+  }
+
+  ++_stats.recvCompletions;
+  if (!event.more)
+    client->setRecvArmed(false);
+  // Out of buffers, or cancelled by pauseReading().
+  if (event.result == -ENOBUFS || event.result == -ECANCELED) {
+    if (!client->isRecvArmed() && !client->isReadPaused())
+      armClientRecv(*client);
+    return;
+  }
+  if (event.result <= 0) {
+    std::cout << "Client disconnected: " << event.fd << std::endl;
+    handleHangup(*client);
+    return;
+  }
+
+  processClientInput(*client, event.data, static_cast<std::size_t>(event.result));
+
+  client = findClientByFd(event.fd);
+  if (client != NULL && UringBackend::tagOf(client->getId()) == event.tag && !client->isRecvArmed() &&
+      !client->isReadPaused())
+    armClientRecv(*client);
+}
+
+// Time until the next armed timer or, in throughput mode, the end of the
+// pending flush window, whichever comes first; -1 to sleep until activity.
+long Server::nextWakeupUs() const {
+  unsigned long nowUs = TimerWheel::nowUs();
+  int timeoutMs = _timers.pollTimeout(nowUs / 1000UL);
+  long timeoutUs = timeoutMs == POLL_TIMEOUT ? POLL_TIMEOUT : static_cast<long>(timeoutMs) * 1000L;
+
+  // Queued commands, broadcast slices, or a LIST or history replay with
+  // entries for a drained client: come back right away instead of waiting
+  // for unrelated activity.
+  if (_list_backlog || _history_backlog || !_ready_clients.empty() || !_broadcast_jobs.empty())
+    return 0;
+  // A hot restart waiting for replies in progress must notice its deadline.
+  if (_upgrade_deadline != 0 && (timeoutUs == POLL_TIMEOUT || timeoutUs > HANDOFF_POLL_US))
+    timeoutUs = HANDOFF_POLL_US;
+
+  if (!_dirty_fds.empty()) {
+    long windowUs = 0;
+    if (_flush_mode == FLUSH_THROUGHPUT && _flush_deadline > nowUs)
+      windowUs = static_cast<long>(_flush_deadline - nowUs);
+    if (timeoutUs == POLL_TIMEOUT || windowUs < timeoutUs)
+      timeoutUs = windowUs;
+  }
+  return timeoutUs;
+}
+
+int Server::pollEvents() {
+  long timeoutUs = nextWakeupUs();
+  struct timespec timeout;
+  struct timespec *timeoutPtr = NULL;
+  if (timeoutUs != POLL_TIMEOUT) {
+    timeout.tv_sec = timeoutUs / 1000000L;
+    timeout.tv_nsec = (timeoutUs % 1000000L) * 1000L;
+    timeoutPtr = &timeout;
   }
+
+  ++_stats.pollCalls;
+  return ppoll(_poll_fds.data(), _poll_fds.size(), timeoutPtr, NULL);
 }
 
 void Server::initSocket(const int PORT) {
@@ -192,6 +647,7 @@ void Server::acceptClient() {
   // accept() is a blocking call by default - it will pause the program until a
   // client connects. But the poll() in Server::run() handles it
   const int CLIENT_SOCKET = accept(_server_socket, addr, &clientLen);
+  ++_stats.acceptCalls;
   if (CLIENT_SOCKET < 0) {
     if (g_shutdown_requested) {
       return;
@@ -201,103 +657,257 @@ void Server::acceptClient() {
     return;
   }
 
+  if (admitConnection(CLIENT_SOCKET, clientAddr.sin_addr.s_addr))
+    registerClient(CLIENT_SOCKET, clientAddr.sin_addr.s_addr);
+}
+
+// Runs before any per-client state exists: a refused socket gets one ERROR
+// line, best effort, and is closed straight away.
+bool Server::admitConnection(const int CLIENT_SOCKET, unsigned int addr) {
+  std::string reason;
+
+  if (_max_clients != 0 && _clients.size() >= _max_clients) {
+    ++_stats.rejectedGlobal;
+    reason = "Server full";
+  } else {
+    AdmissionVerdict verdict = _admission.admit(addr, TimerWheel::nowMs() / 1000UL);
+    if (verdict == ADMISSION_OK)
+      return true;
+    if (verdict == ADMISSION_NO_ADDRESS) {
+      reason = "Unknown host address";
+    } else if (verdict == ADMISSION_PER_IP) {
+      ++_stats.rejectedPerIp;
+      reason = "Too many connections from your host";
+    } else {
+      ++_stats.rejectedRate;
+      reason = "Connecting too fast";
+    }
+  }
+
+  std::string line = "ERROR :Closing Link: localhost (" + reason + ")\r\n";
+  send(CLIENT_SOCKET, line.c_str(), line.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+  ++_stats.sendCalls;
+  close(CLIENT_SOCKET);
+  return false;
+}
+
+void Server::registerClient(const int CLIENT_SOCKET, unsigned int addr) {
   setNonBlocking(CLIENT_SOCKET);
 
-  _clients.push_back(new Client(CLIENT_SOCKET));
+  Client *client = attachClient(CLIENT_SOCKET, _next_client_id++, addr);
+  unsigned long now = TimerWheel::nowMs();
+  client->setLastActivity(now);
+
+  scheduleTimer(TIMER_REGISTRATION, *client, now + _registration_timeout_ms);
+  scheduleTimer(TIMER_KEEPALIVE, *client, now + _keepalive_ms);
+
+  if (_uring != NULL)
+    armClientRecv(*client);
 
+  std::cout << "Client connected! Socket: " << CLIENT_SOCKET << std::endl;
+}
+
+// Pool, lookup tables and poll set; shared by new connections and those
+// taken over in a hot restart.
+Client *Server::attachClient(const int CLIENT_SOCKET, unsigned long id, unsigned int addr) {
+  Client *client = _client_pool.acquire();
+  client->reset(CLIENT_SOCKET, id);
+  client->setAddress(addr);
+  client->setFlushQueue(&_dirty_fds);
+  _clients.push_back(client);
+  _clients_by_fd[CLIENT_SOCKET] = client;
+
+  // The io_uring loop does not poll, but removeClient() still indexes clients
+  // through _poll_fds, so both backends keep it in sync.
   struct pollfd clientPollFd;
   clientPollFd.fd = CLIENT_SOCKET;
   clientPollFd.events = POLLIN;
   clientPollFd.revents = 0;
 
+  if (static_cast<std::size_t>(CLIENT_SOCKET) >= _poll_index.size())
+    _poll_index.resize(CLIENT_SOCKET + 1, ERROR_CODE);
+  _poll_index[CLIENT_SOCKET] = static_cast<int>(_poll_fds.size());
   _poll_fds.push_back(clientPollFd);
-
-  std::cout << "Client connected! Socket: " << CLIENT_SOCKET << std::endl;
+  return client;
 }
 
 void Server::handleClientData(Client &client) {
   char buffer[BUFFER_SIZE];
   ssize_t bytesRead = 0;
-  const int clientFd = client.getFd();
 
   bytesRead = recv(client.getFd(), buffer, sizeof(buffer) - ONE_BYTE, 0);
+  ++_stats.recvCalls;
   if (bytesRead > 0) {
-    buffer[bytesRead] = '\0';
-    std::string data(buffer, bytesRead);
+    processClientInput(client, buffer, static_cast<std::size_t>(bytesRead));
+  } else if (bytesRead == 0) {
+    std::cout << "Client disconnected: " << client.getFd() << std::endl;
+    handleHangup(client);
+  }
+}
 
-    std::cout << "Received " << bytesRead << " bytes from client " << client.getFd() << std::endl;
+void Server::processClientInput(Client &client, const char *data, std::size_t length) {
+  const int clientFd = client.getFd();
 
-    client.appendToBuffer(data);
+  std::cout << "Received " << length << " bytes from client " << clientFd << std::endl;
 
-    while (client.hasCompleteMessage()) {
-      std::string command = client.extractCommand();
+  client.setLastActivity(TimerWheel::nowMs());
+  client.appendToBuffer(std::string(data, length));
 
-      processCommand(client, command);
+  // Already waiting for its turn: new lines join the backlog.
+  if (!client.isReadyQueued())
+    runClientCommands(client);
+}
 
-      // Flush immediately so short-lived nc clients still receive numerics/errors
-      // before closing the connection.
-      if (client.hasPendingOutput()) {
-        flushClientOutput(client);
-      }
+// Runs at most COMMAND_BUDGET complete lines of one client. Leftovers put the
+// client on the ready queue, served round-robin once per loop iteration, so a
+// pipelining client cannot starve the others.
+void Server::runClientCommands(Client &client) {
+  const int clientFd = client.getFd();
 
-      bool stillConnected = false;
-      for (size_t index = FIRST_CLIENT_INDEX; index < _poll_fds.size(); ++index) {
-        if (_poll_fds[index].fd == clientFd) {
-          stillConnected = true;
-          break;
-        }
-      }
-      if (!stillConnected)
-        return;
-    }
-  } else if (bytesRead == 0) {
-    std::cout << "Client disconnected: " << client.getFd() << std::endl;
+  for (std::size_t budget = COMMAND_BUDGET; budget > 0 && client.hasCompleteMessage(); --budget) {
+    std::string command = client.extractCommand();
 
-    // Peer closed write-side; try one final flush of queued replies.
-    if (client.hasPendingOutput()) {
-      flushClientOutput(client);
-    }
+    ++_stats.commands;
+    processCommand(client, command);
 
-    for (size_t i = FIRST_CLIENT_INDEX; i < _poll_fds.size(); ++i) {
-      if (_poll_fds[i].fd == client.getFd()) {
-        removeClient(i);
-        break;
-      }
-    }
-    return;
+    if (findClientByFd(clientFd) != &client)
+      return;
   }
-  else {
-    return;
+
+  if (client.hasCompleteMessage()) {
+    client.setReadyQueued(true);
+    _ready_clients.push_back(std::make_pair(clientFd, client.getId()));
+    ++_stats.deferredClients;
+    pauseReading(client);
+  } else if (client.isClosing()) {
+    removeClientByFd(clientFd, "Connection closed");
   }
 }
 
-void Server::removeClient(size_t index) {
-  int clientFd = _poll_fds[index].fd;
+// Clients whose buffered input holds complete lines that nothing is going to
+// run otherwise (input kept while a hot restart stopped the loop) join the
+// ready queue.
+void Server::queueBufferedClients() {
+  for (std::size_t i = 0; i < _clients.size(); ++i) {
+    Client &client = *_clients[i];
+    if (client.isReadyQueued() || !client.hasCompleteMessage())
+      continue;
+    client.setReadyQueued(true);
+    _ready_clients.push_back(std::make_pair(client.getFd(), client.getId()));
+    pauseReading(client);
+  }
+}
 
-  if (index < FIRST_CLIENT_INDEX || index >= _poll_fds.size())
-    return;
+// Serves only the clients queued before this call; those that still have
+// lines left rejoin at the back for the next iteration, the others are read
+// from again.
+void Server::serveReadyClients() {
+  for (std::size_t pending = _ready_clients.size(); pending > 0; --pending) {
+    std::pair<int, unsigned long> entry = _ready_clients.front();
+    _ready_clients.pop_front();
 
-  for (std::map<std::string, Channel *>::iterator channelIt = _channels.begin(); channelIt != _channels.end();) {
-    Channel *channel = channelIt->second;
-    if (channel->isMember(clientFd)) {
-      channel->removeMember(clientFd);
-    }
-    if (channel->getMembers().empty()) {
-      std::cout << "\033[41m" << "Channel deleted:" << "\033[0m " << channel->getName() << std::endl;
-      delete channel;
-      std::map<std::string, Channel *>::iterator toErase = channelIt++;
-      _channels.erase(toErase);
+    Client *client = findClientByFd(entry.first);
+    if (client == NULL || client->getId() != entry.second)
       continue;
-    }
-    ++channelIt;
+    client->setReadyQueued(false);
+    runClientCommands(*client);
+
+    client = findClientByFd(entry.first);
+    if (client != NULL && client->getId() == entry.second && !client->isReadPaused())
+      resumeReading(*client);
   }
+}
 
-  close(_poll_fds[index].fd);
+void Server::recordLoopLatency(unsigned long startUs) {
+  unsigned long elapsed = TimerWheel::nowUs() - startUs;
+
+  ++_stats.loopIterations;
+  _stats.lastLoopUs = elapsed;
+  if (elapsed > _stats.maxLoopUs)
+    _stats.maxLoopUs = elapsed;
+}
 
-  _poll_fds.erase(_poll_fds.begin() + index);
-  delete _clients[index - FIRST_CLIENT_INDEX];
-  _clients.erase(_clients.begin() + (index - FIRST_CLIENT_INDEX));
+// Peer closed its side. Lines it sent before closing still run, under the
+// same command budget as everyone's and with reading stopped;
+// runClientCommands() removes the client once none are left, and
+// removeClient() makes one final attempt to deliver whatever replies are
+// still queued.
+void Server::handleHangup(Client &client) {
+  if (client.isClosing())
+    return;
+  client.setClosing(true);
+  pauseReading(client);
+  if (!client.isReadyQueued())
+    runClientCommands(client);
+}
+
+void Server::removeClientByFd(int fd, const std::string &quitReason) {
+  if (fd < 0 || static_cast<std::size_t>(fd) >= _poll_index.size() || _poll_index[fd] == ERROR_CODE)
+    return;
+  removeClient(static_cast<size_t>(_poll_index[fd]), quitReason);
+}
+
+// An empty quitReason removes the client silently (server shutdown);
+// otherwise its channel neighbours get one QUIT line each.
+void Server::removeClient(size_t index, const std::string &quitReason) {
+  if (index < FIRST_CLIENT_INDEX || index >= _poll_fds.size())
+    return;
+
+  int clientFd = _poll_fds[index].fd;
+
+  // Replies are flushed once per loop iteration, so give anything still
+  // queued (e.g. numerics preceding a QUIT) one last non-blocking chance.
+  // With io_uring it has to wait for the client's send in flight, so the
+  // backend writes it and closes the fd.
+  Client *leaving = _clients[index - FIRST_CLIENT_INDEX];
+  if (_uring != NULL) {
+    _uring->closeClient(clientFd, UringBackend::tagOf(leaving->getId()), leaving->getOutputBuffer());
+  } else if (leaving->hasPendingOutput()) {
+    send(clientFd, leaving->getOutputBuffer().c_str(), leaving->getOutputBuffer().size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    ++_stats.sendCalls;
+  }
+
+  if (!quitReason.empty() && !leaving->getChannels().empty())
+    notifyNeighbors(*leaving, ":" + leaving->getNickname() + "!" + leaving->getUsername() + "@localhost QUIT :" +
+                                  quitReason + "\r\n");
+
+  std::vector<std::string> joined = leaving->getChannels();
+  for (std::size_t i = 0; i < joined.size(); ++i) {
+    std::map<std::string, Channel *>::iterator channelIt = _channels.find(joined[i]);
+    if (channelIt != _channels.end())
+      leaveChannel(*leaving, *channelIt->second);
+  }
+
+  if (_welcomed_clients.find(clientFd) != _welcomed_clients.end())
+    notifyMonitors(*leaving, leaving->getNickname(), false);
+  dropMonitors(*leaving);
+  std::map<std::string, Client *>::iterator nickIt = _clients_by_nick.find(leaving->getNickname());
+  if (nickIt != _clients_by_nick.end() && nickIt->second == leaving)
+    _clients_by_nick.erase(nickIt);
+
+  if (_uring == NULL)
+    close(clientFd);
+
+  // Order in the poll set carries no meaning, so the last entry fills the hole
+  // instead of shifting everything behind it.
+  size_t last = _poll_fds.size() - 1;
+  if (index != last) {
+    _poll_fds[index] = _poll_fds[last];
+    _clients[index - FIRST_CLIENT_INDEX] = _clients[last - FIRST_CLIENT_INDEX];
+    _poll_index[_poll_fds[index].fd] = static_cast<int>(index);
+  }
+  _poll_fds.pop_back();
+  _clients.pop_back();
+  _poll_index[clientFd] = ERROR_CODE;
+
+  _admission.release(leaving->getAddress());
+  _searches_in_flight.erase(leaving->getId());
+  leaving->reset(ERROR_CODE, 0);
+  _client_pool.release(leaving);
+  _clients_by_fd.erase(clientFd);
   _welcomed_clients.erase(clientFd);
+  _list_queries.erase(clientFd);
+  _history_replays.erase(clientFd);
 
   std::cout << "Client " << clientFd << " removed from poll set" << std::endl;
 }
@@ -315,11 +925,14 @@ void Server::processCommand(Client &client, const std::string &raw)
 {
 	IRCMessage msg(raw);
   if (!msg.isValid()) {
+    if (msg.isTooLong())
+      sendError(client, "417", ":Input line was too long");
     return;
   }
 	std::string cmd = msg.getCommand();
 	std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-	if (!client.isAuthenticated() && cmd != "PASS" && cmd != "NICK" && cmd != "USER" && cmd != "QUIT" && cmd != "CAP")
+	if (!client.isAuthenticated() && cmd != "PASS" && cmd != "NICK" && cmd != "USER" && cmd != "QUIT" && cmd != "CAP" &&
+	    cmd != "PONG")
 	{
 		sendError(client, ERR_NOTREGISTERED, "");
 		return;
@@ -389,6 +1002,12 @@ void Server::sendError(Client &client, errorCode code, const std::string &contex
   case ERR_UNKNOWNMODE:
     message = context + " :is unknown mode char to me";
     break;
+  case ERR_BANLISTFULL:
+    message = context + " " + channel + " :Channel list is full";
+    break;
+  case ERR_INVALIDMODEPARAM:
+    message = context + " " + channel + " " + command + " :Invalid mode parameter";
+    break;
   case ERR_CANNOTSENDTOCHAN:
     message = context + " :Cannot send to channel";
     break;
@@ -398,6 +1017,9 @@ void Server::sendError(Client &client, errorCode code, const std::string &contex
   case ERR_NOTEXTTOSEND:
     message = ":No text to send";
     break;
+  case ERR_TOOMANYTARGETS:
+    message = context + " :Too many recipients. No message delivered";
+    break;
   case ERR_NEEDMOREPARAMS:
     message = context + " :Not enough parameters";
     break;
@@ -437,6 +1059,10 @@ void Server::sendError(Client &client, errorCode code, const std::string &contex
 }
 
 void Server::sendReply(Client &client, const std::string &message) {
+  client.queueOutput(formatReply(message));
+}
+
+std::string Server::formatReply(const std::string &message) const {
   std::string reply;
 
   if (message.find(":") == 0) {
@@ -449,7 +1075,7 @@ void Server::sendReply(Client &client, const std::string &message) {
     reply += "\r\n";
   }
 
-  client.queueOutput(reply);
+  return reply;
 }
 
 void Server::sendRaw(Client &client, const std::string &message) {
@@ -457,20 +1083,220 @@ void Server::sendRaw(Client &client, const std::string &message) {
 }
 
 void Server::flushClientOutput(Client &client) {
+  std::size_t writes = client.markFlushed();
   std::string &outBuffer = client.getOutputBuffer();
   if (outBuffer.empty())
     return;
 
-  ssize_t bytesSent = send(client.getFd(), outBuffer.c_str(), outBuffer.size(), 0);
-  if (bytesSent > 0) {
+  _stats.queuedWrites += writes;
+  if (writes > 1)
+    _stats.coalescedWrites += writes - 1;
+
+  if (_uring != NULL) {
+    _uring->submitSend(client.getFd(), UringBackend::tagOf(client.getId()), outBuffer);
+    return;
+  }
+
+  ssize_t bytesSent = send(client.getFd(), outBuffer.c_str(), outBuffer.size(), MSG_NOSIGNAL);
+  ++_stats.sendCalls;
+  if (bytesSent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      removeClientByFd(client.getFd(), "Write error");
+      return;
+    }
+  } else {
     client.consumeOutput(static_cast<std::size_t>(bytesSent));
-  } else if (bytesSent < 0) {
-    for (size_t index = FIRST_CLIENT_INDEX; index < _poll_fds.size(); ++index) {
-      if (_poll_fds[index].fd == client.getFd()) {
-        removeClient(index);
-        break;
-      }
+  }
+  updatePollInterest(client);
+}
+
+// POLLOUT is only requested while a flush leaves bytes behind and dropped as
+// soon as one drains the buffer, so interest changes follow the clients that
+// actually wrote instead of being recomputed for every connection per wakeup.
+// POLLIN is dropped while reading is paused and the kernel holds the input.
+void Server::updatePollInterest(const Client &client) {
+  int index = _poll_index[client.getFd()];
+  short events = client.isReadPaused() ? 0 : POLLIN;
+
+  if (client.hasPendingOutput())
+    events |= POLLOUT;
+  _poll_fds[index].events = events;
+}
+
+// Read backpressure for a client whose input waits in the ready queue, or
+// that hung up. With io_uring the multishot recv is cancelled; anything it
+// still delivers joins the buffer, which is then bounded by what was in
+// flight.
+void Server::pauseReading(Client &client) {
+  if (_uring == NULL)
+    updatePollInterest(client);
+  else if (client.isRecvArmed())
+    _uring->cancelRecv(client.getFd(), UringBackend::tagOf(client.getId()));
+}
+
+// A recv whose cancel has not completed yet is re-armed by
+// handleUringEvent() when it ends.
+void Server::resumeReading(Client &client) {
+  if (_uring == NULL)
+    updatePollInterest(client);
+  else if (!client.isRecvArmed())
+    armClientRecv(client);
+}
+
+void Server::armClientRecv(Client &client) {
+  _uring->armRecv(client.getFd(), UringBackend::tagOf(client.getId()));
+  client.setRecvArmed(true);
+}
+
+void Server::disconnectClient(Client &client, const std::string &reason) {
+  const int clientFd = client.getFd();
+
+  sendRaw(client, "ERROR :Closing Link: localhost (" + reason + ")\r\n");
+  removeClientByFd(clientFd, reason);
+}
+
+void Server::scheduleTimer(TimerKind kind, const Client &client, unsigned long expires, const std::string &channel) {
+  Timer timer;
+  timer.kind = kind;
+  timer.fd = client.getFd();
+  timer.clientId = client.getId();
+  timer.expires = expires;
+  timer.channel = channel;
+  _timers.schedule(timer);
+}
+
+void Server::processTimers() {
+  std::vector<Timer> expired;
+
+  _timers.advance(TimerWheel::nowMs(), expired);
+  for (std::size_t i = 0; i < expired.size(); ++i)
+    handleTimer(expired[i]);
+}
+
+// Timers are never cancelled: each one re-validates the client state when it
+// fires and re-arms itself lazily if activity happened in the meantime.
+void Server::handleTimer(const Timer &timer) {
+  if (timer.kind == TIMER_UNMODERATE) {
+    liftModeration(timer.channel);
+    return;
+  }
+  // Invites carry their own expiry; the timer only sweeps the channel, and
+  // must do so even if the invited client is already gone.
+  if (timer.kind == TIMER_INVITE_EXPIRY) {
+    std::map<std::string, Channel *>::iterator it = _channels.find(timer.channel);
+    if (it != _channels.end())
+      it->second->pruneInvites(TimerWheel::nowMs());
+    return;
+  }
+
+  Client *client = findClientByFd(timer.fd);
+  if (client == NULL || client->getId() != timer.clientId)
+    return;
+
+  unsigned long now = TimerWheel::nowMs();
+
+  switch (timer.kind) {
+  case TIMER_REGISTRATION:
+    if (!client->isAuthenticated())
+      disconnectClient(*client, "Registration timeout");
+    break;
+
+  case TIMER_KEEPALIVE:
+    if (now - client->getLastActivity() < _keepalive_ms) {
+      scheduleTimer(TIMER_KEEPALIVE, *client, client->getLastActivity() + _keepalive_ms);
+      break;
     }
+    client->setPingSentAt(now);
+    sendRaw(*client, "PING :" + _server_name + "\r\n");
+    scheduleTimer(TIMER_PING_TIMEOUT, *client, now + _ping_timeout_ms);
+    break;
+
+  case TIMER_PING_TIMEOUT:
+    if (client->getLastActivity() < client->getPingSentAt()) {
+      disconnectClient(*client, "Ping timeout");
+      break;
+    }
+    client->setPingSentAt(0);
+    scheduleTimer(TIMER_KEEPALIVE, *client, client->getLastActivity() + _keepalive_ms);
+    break;
+
+  case TIMER_INVITE_EXPIRY:
+  case TIMER_UNMODERATE:
+    break;
+  }
+}
+
+// Charges one message to a +f channel. Once the bucket runs dry every message
+// is dropped until it refills; the configured action fires on the first drop.
+bool Server::admitFlood(Client &client, Channel &channel) {
+  unsigned long now = TimerWheel::nowMs();
+  FloodVerdict verdict = channel.consumeFloodToken(now);
+  if (verdict == FLOOD_PASS)
+    return true;
+
+  ++_stats.floodDropped;
+  if (verdict == FLOOD_LIMITED)
+    return false;
+
+  ++_stats.floodTrips;
+  const std::string &name = channel.getName();
+  if (channel.getFloodAction() == 'm' && !channel.getMode('m')) {
+    channel.setMode('m', true);
+    channel.setModeratedUntil(now + _flood_moderate_ms);
+    fanOut(channel, ":" + _server_name + " MODE " + name + " +m\r\n", -1);
+
+    Timer timer;
+    timer.kind = TIMER_UNMODERATE;
+    timer.fd = -1;
+    timer.clientId = 0;
+    timer.expires = now + _flood_moderate_ms;
+    timer.channel = name;
+    _timers.schedule(timer);
+  } else if (channel.getFloodAction() == 'n') {
+    fanOut(channel,
+           ":" + _server_name + " NOTICE " + name + " :Flood limit " + channel.getFloodParam() + " reached (last: " +
+               client.getNickname() + ")\r\n",
+           -1, true);
+  }
+  return false;
+}
+
+void Server::liftModeration(const std::string &channelName) {
+  std::map<std::string, Channel *>::iterator it = _channels.find(channelName);
+  if (it == _channels.end())
+    return;
+
+  Channel &channel = *it->second;
+  unsigned long until = channel.getModeratedUntil();
+  if (until == 0 || until > TimerWheel::nowMs())
+    return;
+
+  channel.setModeratedUntil(0);
+  channel.setMode('m', false);
+  fanOut(channel, ":" + _server_name + " MODE " + channelName + " -m\r\n", -1);
+}
+
+// Each client's replies already sit in one contiguous buffer, so one send()
+// per dirty client per iteration gives the batching MSG_MORE/TCP_CORK would.
+void Server::flushDirtyClients() {
+  if (_dirty_fds.empty())
+    return;
+
+  if (_flush_mode == FLUSH_THROUGHPUT) {
+    unsigned long now = TimerWheel::nowUs();
+    if (_flush_deadline == 0)
+      _flush_deadline = now + _flush_window_us;
+    if (now < _flush_deadline)
+      return;
+  }
+  _flush_deadline = 0;
+
+  std::vector<int> dirty;
+  dirty.swap(_dirty_fds);
+  for (std::size_t i = 0; i < dirty.size(); ++i) {
+    Client *client = findClientByFd(dirty[i]);
+    if (client != NULL)
+      flushClientOutput(*client);
   }
 }
 
@@ -478,6 +1304,21 @@ const std::string &Server::getServerName() const {
   return _server_name;
 }
 
+// Splits a comma separated parameter (targets, channels, keys). Empty items
+// are dropped unless keepEmpty is set, which keeps key lists aligned with
+// their channel list.
+std::vector<std::string> Server::splitList(const std::string &list, bool keepEmpty) const {
+  std::vector<std::string> items;
+  std::istringstream iss(list);
+
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    if (keepEmpty || !item.empty())
+      items.push_back(item);
+  }
+  return items;
+}
+
 std::vector<std::string> Server::splitCommand(const std::string &command) {
   std::vector<std::string> args;
   std::istringstream iss(command);
@@ -491,25 +1332,27 @@ std::vector<std::string> Server::splitCommand(const std::string &command) {
 
 std::string Server::getClientChannels(const Client &client) const {
   std::string result;
+  const std::vector<std::string> &joined = client.getChannels();
 
-  for (std::map<std::string, Channel *>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
-    if (it->second->isMember(client.getFd())) {
-      if (!result.empty())
-        result += " ";
-      result += it->first;
-    }
+  for (std::size_t i = 0; i < joined.size(); ++i) {
+    if (!result.empty())
+      result += " ";
+    result += joined[i];
   }
 
   return result;
 }
 
 Client *Server::findClientByNick(const std::string &nick) {
-  for (std::size_t i = 0; i < _clients.size(); ++i) {
-    if (_clients[i]->getNickname() == nick) {
-      return _clients[i];
-    }
-  }
-  return NULL;
+  std::map<std::string, Client *>::iterator it = _clients_by_nick.find(nick);
+
+  return it != _clients_by_nick.end() ? it->second : NULL;
+}
+
+Client *Server::findClientByFd(int fd) {
+  std::map<int, Client *>::iterator it = _clients_by_fd.find(fd);
+
+  return it != _clients_by_fd.end() ? it->second : NULL;
 }
 
 void Server::handlePASS(Client &client, const IRCMessage &msg) {
@@ -530,22 +1373,44 @@ void Server::handlePASS(Client &client, const IRCMessage &msg) {
   sendError(client, ERR_PASSWDMISMATCH, "");
 }
 
+// CAP LS [version], LIST, REQ :<caps> and END (IRCv3 capability
+// negotiation). LS or REQ before registration hold the welcome back until
+// END; afterwards capabilities can still be toggled at any time. A REQ naming
+// anything unknown is refused as a whole, as the spec requires. With LS 302
+// or later cap-notify comes enabled and can't be dropped.
 void Server::handleCAP(Client &client, const IRCMessage &msg) {
-  (void)client;
   if (msg.getParamCount() < 1) {
+    sendError(client, ERR_NEEDMOREPARAMS, "CAP");
     return;
   }
 
   std::string subcommand = msg.getParams()[0];
   std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+  const std::string nick = client.hasNick() ? client.getNickname() : "*";
+  const bool welcomed = _welcomed_clients.find(client.getFd()) != _welcomed_clients.end();
 
   if (subcommand == "LS") {
-    sendReply(client, "CAP * LS :");
+    long version = 0;
+    if (msg.getParamCount() > 1 && parseCount(msg.getParams()[1], version) && version >= 302) {
+      client.setCapVersion(static_cast<unsigned int>(version));
+      client.setCap(CAP_CAP_NOTIFY, true);
+    }
+    if (!welcomed)
+      client.setNegotiating(true);
+    std::vector<std::string> offered;
+    for (std::size_t i = 0; i < SUPPORTED_CAP_COUNT; ++i)
+      offered.push_back(SUPPORTED_CAPS[i].name);
+    sendCapList(client, "LS", offered);
     return;
   }
 
   if (subcommand == "LIST") {
-    sendReply(client, "CAP * LIST :");
+    std::vector<std::string> enabled;
+    for (std::size_t i = 0; i < SUPPORTED_CAP_COUNT; ++i) {
+      if (client.hasCap(SUPPORTED_CAPS[i].bit))
+        enabled.push_back(SUPPORTED_CAPS[i].name);
+    }
+    sendCapList(client, "LIST", enabled);
     return;
   }
 
@@ -554,13 +1419,56 @@ void Server::handleCAP(Client &client, const IRCMessage &msg) {
     if (requestedCaps.empty() && msg.getParamCount() > 1) {
       requestedCaps = msg.getParams()[1];
     }
-    sendReply(client, "CAP * NAK :" + requestedCaps);
+    if (!welcomed)
+      client.setNegotiating(true);
+
+    // All or nothing: one unknown name NAKs the whole request.
+    std::vector<std::string> requested = splitCommand(requestedCaps);
+    unsigned int enable = 0;
+    unsigned int disable = 0;
+    for (std::size_t i = 0; i < requested.size(); ++i) {
+      const bool removing = requested[i][0] == '-';
+      unsigned int bit = findCapability(removing ? requested[i].substr(1) : requested[i]);
+      if (bit == 0 || (removing && bit == CAP_CAP_NOTIFY && client.getCapVersion() >= 302)) {
+        sendReply(client, "CAP " + nick + " NAK :" + requestedCaps);
+        return;
+      }
+      (removing ? disable : enable) |= bit;
+    }
+    client.setCap(disable, false);
+    client.setCap(enable, true);
+    sendReply(client, "CAP " + nick + " ACK :" + requestedCaps);
     return;
   }
 
   if (subcommand == "END") {
+    if (client.isNegotiating()) {
+      client.setNegotiating(false);
+      checkAndSendWelcome(client);
+    }
     return;
   }
+
+  sendReply(client, "410 " + nick + " " + msg.getParams()[0] + " :Invalid CAP command");
+}
+
+// CAP 302 clients get long lists split over several lines, every line but
+// the last marked with '*'; older clients get them on one line.
+void Server::sendCapList(Client &client, const std::string &subcommand, const std::vector<std::string> &names) {
+  const std::string head = "CAP " + (client.hasNick() ? client.getNickname() : std::string("*")) + " " + subcommand;
+  const bool multiline = client.getCapVersion() >= 302;
+  std::string batch;
+  std::string line;
+
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    if (multiline && !line.empty() && line.size() + 1 + names[i].size() > CAP_LINE_BUDGET) {
+      batch += formatReply(head + " * :" + line);
+      line.clear();
+    }
+    line += (line.empty() ? "" : " ") + names[i];
+  }
+  batch += formatReply(head + " :" + line);
+  sendRaw(client, batch);
 }
 
 void Server::handleNICK(Client &client, const IRCMessage &msg) {
@@ -576,16 +1484,41 @@ void Server::handleNICK(Client &client, const IRCMessage &msg) {
     return;
   }
 
-  for (size_t i = 0; i < _clients.size(); ++i) {
-    if (_clients[i]->getFd() != client.getFd() && _clients[i]->getNickname() == nickname) {
-      sendError(client, ERR_NICKNAMEINUSE, nickname);
-      return;
-    }
+  Client *holder = findClientByNick(nickname);
+  if (holder != NULL && holder != &client) {
+    sendError(client, ERR_NICKNAMEINUSE, nickname);
+    return;
   }
 
+  // Once registered, a nick change is announced with the old prefix to the
+  // client itself and, once each, to everyone sharing a channel with it.
+  const bool welcomed = _welcomed_clients.find(client.getFd()) != _welcomed_clients.end();
+  const std::string nickMsg =
+      ":" + client.getNickname() + "!" + client.getUsername() + "@localhost NICK :" + nickname + "\r\n";
+
+  const std::string oldNick = client.getNickname();
+  if (!oldNick.empty())
+    _clients_by_nick.erase(oldNick);
+  _clients_by_nick[nickname] = &client;
   client.setNickname(nickname);
-  sendReply(client, "NICK set to: " + nickname);
-  checkAndSendWelcome(client);
+  const std::vector<std::string> &joined = client.getChannels();
+  for (std::size_t i = 0; i < joined.size(); ++i) {
+    std::map<std::string, Channel *>::iterator it = _channels.find(joined[i]);
+    if (it != _channels.end())
+      it->second->invalidateNames();
+  }
+
+  if (!welcomed) {
+    sendReply(client, "NICK set to: " + nickname);
+    checkAndSendWelcome(client);
+    return;
+  }
+  sendRaw(client, nickMsg);
+  notifyNeighbors(client, nickMsg);
+  if (oldNick != nickname) {
+    notifyMonitors(client, oldNick, false);
+    notifyMonitors(client, nickname, true);
+  }
 }
 
 void Server::handleUSER(Client &client, const IRCMessage &msg) {
@@ -607,20 +1540,14 @@ void Server::handleUSER(Client &client, const IRCMessage &msg) {
 }
 
 void Server::handleQUIT(Client &client, const IRCMessage &msg) {
-  (void)msg;
-
   struct linger lingerOption;
   lingerOption.l_onoff = 1;
   lingerOption.l_linger = 0;
   setsockopt(client.getFd(), SOL_SOCKET, SO_LINGER, &lingerOption, sizeof(lingerOption));
 
   // shutdown(client.getFd(), SHUT_RDWR); uso somente no MAC para o teste do Quit
-  for (std::size_t i = FIRST_CLIENT_INDEX; i < _poll_fds.size(); ++i) {
-    if (_poll_fds[i].fd == client.getFd()) {
-      removeClient(i);
-      break;
-    }
-  }
+  std::string reason = msg.hasTrailing() ? "Quit: " + msg.getTrailing() : "Client Quit";
+  removeClientByFd(client.getFd(), reason);
 }
 
 void Server::handlePING(Client &client, const IRCMessage &msg) {
@@ -634,6 +1561,16 @@ void Server::handlePING(Client &client, const IRCMessage &msg) {
   sendReply(client, pong);
 }
 
+void Server::handlePONG(Client &client, const IRCMessage &msg) {
+  (void)msg;
+  // Any inbound line already refreshed the activity stamp; PONG just clears
+  // the outstanding keepalive probe early.
+  client.setPingSentAt(0);
+}
+
+// JOIN #a,#b,#c keyA,keyB is handled as one batch: the channel limit is
+// checked once up front and the JOIN echo, topic and NAMES of every joined
+// channel are assembled into a single write to the joining client.
 void Server::handleJOIN(Client &client, const IRCMessage &msg) {
   if (!client.isAuthenticated()) {
     sendError(client, ERR_NOTREGISTERED, "");
@@ -645,53 +1582,73 @@ void Server::handleJOIN(Client &client, const IRCMessage &msg) {
     return;
   }
 
-  std::string channelName = msg.getParams()[0];
-  if (!isValidChannelName(channelName)) {
-    sendError(client, ERR_BADCHANMASK, channelName);
-    return;
-  }
+  std::vector<std::string> channelNames = splitList(msg.getParams()[0]);
+  std::vector<std::string> channelKeys;
+  if (msg.getParamCount() > 1)
+    channelKeys = splitList(msg.getParams()[1], true);
 
-  std::size_t currentChannels = 0;
-  for (std::map<std::string, Channel *>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
-    if (it->second->isMember(client.getFd())) {
-      ++currentChannels;
-    }
-  }
-  if (currentChannels >= MAX_CHANNELS_PER_USER) {
-    sendError(client, ERR_TOOMANYCHANNELS, channelName);
-    return;
-  }
+  const std::size_t joinedBefore = client.getChannels().size();
+  std::size_t slotsLeft = 0;
+  if (joinedBefore < static_cast<std::size_t>(MAX_CHANNELS_PER_USER))
+    slotsLeft = MAX_CHANNELS_PER_USER - joinedBefore;
 
-  bool channelCreated = false;
-  std::map<std::string, Channel *>::iterator channelIt = _channels.find(channelName);
-  if (channelIt == _channels.end()) {
-    channelCreated = true;
-  }
+  const std::string joinPrefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost JOIN :";
+  std::string burst;
 
-  Channel *channel = getChannels(channelName);
-  if (channel->isMember(client.getFd())) {
-    return;
-  }
+  for (std::size_t i = 0; i < channelNames.size(); ++i) {
+    const std::string &channelName = channelNames[i];
+    if (!isValidChannelName(channelName)) {
+      sendError(client, ERR_BADCHANMASK, channelName);
+      continue;
+    }
 
-  std::string channelKey = msg.getParamCount() > 1 ? msg.getParams()[1] : "";
-  errorCode joinError = ERR_NOSUCHCHANNEL;
-  if (!canJoin(client, *channel, channelKey, joinError)) {
-    sendError(client, joinError, channelName);
-    return;
-  }
-  channel->addMember(&client);
-  if (channelCreated) {
-    channel->addOperator(client.getFd());
-  }
+    // A channel is only created once the join is certain to succeed, so a
+    // refused JOIN never leaves an empty channel behind.
+    std::map<std::string, Channel *>::iterator channelIt = _channels.find(channelName);
+    bool channelCreated = channelIt == _channels.end();
+    if (!channelCreated && channelIt->second->isMember(client.getFd()))
+      continue;
 
-  std::string nick = client.getNickname();
-  std::string user = client.getUsername();
-  std::string host = "localhost";
+    if (slotsLeft == 0) {
+      sendError(client, ERR_TOOMANYCHANNELS, channelName);
+      continue;
+    }
 
-  std::string joinMsg = ":" + nick + "!" + user + "@" + host + " JOIN :" + channelName + "\r\n";
+    if (!channelCreated) {
+      std::string channelKey = i < channelKeys.size() ? channelKeys[i] : "";
+      errorCode joinError = ERR_NOSUCHCHANNEL;
+      if (!canJoin(client, *channelIt->second, channelKey, joinError)) {
+        sendError(client, joinError, channelName);
+        continue;
+      }
+    }
 
-  sendRaw(client, joinMsg);
-  channel->broadcast(joinMsg, client.getFd());
+    Channel *channel = getChannels(channelName);
+    channel->consumeInvite(client.getId(), TimerWheel::nowMs());
+    joinChannel(client, *channel);
+    if (channelCreated) {
+      channel->addOperator(client.getFd());
+    }
+    --slotsLeft;
+
+    std::string joinMsg = joinPrefix + channelName + "\r\n";
+    fanOut(*channel, joinMsg, client.getFd(), channel->getMode('u') && !channel->isOperator(client.getFd()));
+
+    burst += joinMsg;
+    if (!channel->getTopic().empty())
+      burst += formatReply("332 " + client.getNickname() + " " + channelName + " :" + channel->getTopic());
+    // Bots and bouncers with draft/no-implicit-names ask for NAMES when
+    // they want it; the JOIN alone tells them the join worked.
+    if (client.hasCap(CAP_NO_IMPLICIT_NAMES)) {
+      ++_stats.implicitNamesSkipped;
+      continue;
+    }
+    burst += namesReply(client, *channel);
+    ++_stats.implicitNames;
+  }
+
+  if (!burst.empty())
+    sendRaw(client, burst);
 }
 
 void Server::handlePART(Client &client, const IRCMessage &msg) {
@@ -727,71 +1684,109 @@ void Server::handlePART(Client &client, const IRCMessage &msg) {
   }
   partMsg += "\r\n";
 
-  channel.broadcast(partMsg, client.getFd());
-  channel.removeMember(client.getFd());
-
-  if (channel.getMembersNumber() == 0) {
-    _channels.erase(it);
-  }
+  fanOut(channel, partMsg, client.getFd(), channel.getMode('u') && !channel.isOperator(client.getFd()));
+  leaveChannel(client, channel);
 
   sendRaw(client, partMsg);
 }
 
 void Server::handlePRIVMSG(Client &client, const IRCMessage &msg) {
+  relayMessage(client, msg, "PRIVMSG");
+}
+
+void Server::handleNOTICE(Client &client, const IRCMessage &msg) {
+  relayMessage(client, msg, "NOTICE");
+}
+
+// Shared by PRIVMSG and NOTICE. The target is a comma separated list; NOTICE
+// never triggers an error reply (RFC 2812, 3.3.2).
+void Server::relayMessage(Client &client, const IRCMessage &msg, const std::string &command) {
+  const bool replyErrors = command != "NOTICE";
+
   if (!client.isAuthenticated()) {
-    sendError(client, ERR_NOTREGISTERED, "");
+    if (replyErrors)
+      sendError(client, ERR_NOTREGISTERED, "");
     return;
   }
 
   if (msg.getParamCount() < 1) {
-    sendError(client, ERR_NORECIPIENT, "", "", "PRIVMSG");
+    if (replyErrors)
+      sendError(client, ERR_NORECIPIENT, "", "", command);
     return;
   }
 
   if (msg.getTrailing().empty()) {
-    sendError(client, ERR_NOTEXTTOSEND, "");
+    if (replyErrors)
+      sendError(client, ERR_NOTEXTTOSEND, "");
     return;
   }
 
-  std::string target = msg.getParams()[0];
-  const std::string &message = msg.getTrailing();
+  std::vector<std::string> targets = splitList(msg.getParams()[0]);
+  if (targets.size() > MAX_TARGETS) {
+    if (replyErrors)
+      sendError(client, ERR_TOOMANYTARGETS, msg.getParams()[0]);
+    return;
+  }
 
-  std::string prefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
+  // Prefix and text are formatted once; each target only splices its name in.
+  const std::string head = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost " + command + " ";
+  const std::string body = " :" + msg.getTrailing() + "\r\n";
+  // Tags for message-tags clients: the send time, the client's own '+' tags
+  // and, for channel lines, the history msgid. Others get the bare line.
+  const unsigned long nowMs = HistoryStore::wallClockMs();
+  std::string tags = "@time=" + HistoryStore::formatTime(nowMs);
+  msg.appendClientTags(tags);
 
-  if (target[0] == '#' || target[0] == '&') {
-    std::map<std::string, Channel *>::iterator it = _channels.find(target);
-    if (it == _channels.end()) {
-      sendError(client, ERR_NOSUCHCHANNEL, target);
-      return;
-    }
+  // Recipients are stamped with this epoch when served, so a user reached
+  // through several targets gets the message once.
+  const unsigned long epoch = ++_delivery_epoch;
+  std::vector<std::pair<Channel *, std::string> > channelTargets;
+  std::vector<int> directFds;
 
-    Channel &channel = *it->second;
+  for (std::size_t i = 0; i < targets.size(); ++i) {
+    const std::string &target = targets[i];
 
-    if (!channel.isMember(client.getFd())) {
-      sendError(client, ERR_CANNOTSENDTOCHAN, target);
-      return;
-    }
-
-    /*
-    Verifica se nao esta mudo (+m mode) - simplificado por agora
-    (implementar depois com modos)
-    */
+    if (target[0] == '#' || target[0] == '&') {
+      std::map<std::string, Channel *>::iterator it = _channels.find(target);
+      if (it == _channels.end()) {
+        if (replyErrors)
+          sendError(client, ERR_NOSUCHCHANNEL, target);
+        continue;
+      }
 
-    std::string privmsg = prefix + " PRIVMSG " + target + " :" + message + "\r\n";
-    channel.broadcast(privmsg, client.getFd());
+      Channel &channel = *it->second;
+      if (!channel.isMember(client.getFd())) {
+        if (replyErrors)
+          sendError(client, ERR_CANNOTSENDTOCHAN, target);
+        continue;
+      }
 
-  } else {
-    Client *targetClient = findClientByNick(target);
-    if (targetClient == NULL) {
-      sendError(client, ERR_NOSUCHNICK, target);
-      return;
-    }
+      // Operators are exempt from +m and from the +f throttle.
+      if (!channel.isOperator(client.getFd()) &&
+          (channel.getMode('m') || (channel.getMode('f') && !admitFlood(client, channel)))) {
+        if (replyErrors)
+          sendError(client, ERR_CANNOTSENDTOCHAN, target);
+        continue;
+      }
 
-    /* Verifica se nao esta +g (server notice) ou outros modos */
+      const HistoryLine *stored = _history.append(channel.getName(), head + target + body, nowMs);
+      _search.add(channel.getName(), stored->getSeq(), stored->getTime(), stored->getLine());
+      channelTargets.push_back(std::make_pair(&channel, tags + ";msgid=" + stored->getMsgid() + " " + stored->getLine()));
+    } else {
+      Client *targetClient = findClientByNick(target);
+      if (targetClient == NULL) {
+        if (replyErrors)
+          sendError(client, ERR_NOSUCHNICK, target);
+        continue;
+      }
 
-    std::string privmsg = prefix + " PRIVMSG " + target + " :" + message + "\r\n";
-    sendRaw(*targetClient, privmsg);
+      if (targetClient->markDelivered(epoch)) {
+        targetClient->queueTagged(tags + " " + head + target + body);
+        directFds.push_back(targetClient->getFd());
+      }
+    }
   }
+  fanOutOnce(channelTargets, client.getFd(), epoch, directFds);
 }
 
 void Server::handleWHOIS(Client &client, const IRCMessage &msg) {
@@ -870,6 +1865,28 @@ void Server::sendMOTD(Client &client) {
   sendReply(client, "376 " + nick + " :End of /MOTD command.");
 }
 
+// RPL_BANLIST (367/368), RPL_EXCEPTLIST (348/349), RPL_INVITELIST (346/347)
+void Server::sendMaskList(Client &client, const Channel &channel, char mode) {
+  const std::string head = client.getNickname() + " " + channel.getName();
+  std::string entryCode = "367";
+  std::string endLine = "368 " + head + " :End of channel ban list";
+  if (mode == 'e') {
+    entryCode = "348";
+    endLine = "349 " + head + " :End of channel exception list";
+  } else if (mode == 'I') {
+    entryCode = "346";
+    endLine = "347 " + head + " :End of channel invite list";
+  }
+
+  const std::vector<MaskEntry> &entries = channel.getMaskList(mode).getEntries();
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    std::ostringstream line;
+    line << entryCode << " " << head << " " << entries[i].mask << " " << entries[i].setBy << " " << entries[i].setAt;
+    sendReply(client, line.str());
+  }
+  sendReply(client, endLine);
+}
+
 void Server::sendISupport(Client &client) {
   const std::string &nick = client.getNickname();
 
@@ -879,9 +1896,8 @@ void Server::sendISupport(Client &client) {
                          "TOPICLEN=307 "        // Maximo 307 caracteres no topico
                          "CHANTYPES=#& "        // Tipos de canais suportados (# e &)
                          "PREFIX=(ov)@+ "       // Prefixos: @ para operador, + para voice
-                         "CHANMODES=i,t,k,o,l " // Modos de canal suportados
+                         "CHANMODES=beI,k,fl,imtu " // Listas, com parametro, parametro ao ligar, flags
                          "MODES=4 "             // Numero maximo de modos por comando
-                         "MAXTARGETS=1 "        // Maximo de alvos por comando
                          "NETWORK=ft_irc "      // Nome da rede
                          "CASEMAPPING=ascii "   // Mapeamento de case (simplificado)
                          "CHARSET=ascii "       // Conjunto de caracteres
@@ -896,8 +1912,11 @@ void Server::sendISupport(Client &client) {
 
   std::ostringstream oss;
   oss << "MAXCHANNELS=" << MAX_CHANNELS_PER_USER << " ";
-  oss << "MAXBANS=30 "; // Maximo de bans por canal
+  oss << "MAXBANS=" << MAX_LIST_ENTRIES << " "; // Maximo de bans por canal
+  oss << "MAXLIST=beI:" << MAX_LIST_ENTRIES << " "; // Maximo por lista (+b, +e, +I)
   oss << "MAXPARA=32 "; // Maximo de parametros por comando
+  oss << "MAXTARGETS=" << MAX_TARGETS << " "; // Maximo de alvos por comando
+  oss << "TARGMAX=PRIVMSG:" << MAX_TARGETS << ",NOTICE:" << MAX_TARGETS << " ";
 
   features += oss.str();
 
@@ -906,23 +1925,354 @@ void Server::sendISupport(Client &client) {
   // Linha adicional para mais features se necessario
   std::string features2 = "STATUSMSG=@+ " // Mensagens para grupos (@ ou +)
                           "ELIST=CMNTU "  // Extensoes para LIST
-                          "EXTBAN=$,& "   // Tipos de extended bans
-                          "MONITOR=30 ";  // Maximo de usuarios no MONITOR
+                          "EXTBAN=$,& ";  // Tipos de extended bans
+
+  std::ostringstream oss2;
+  oss2 << "MONITOR=" << MONITOR_LIMIT << " "; // Maximo de usuarios no MONITOR
+  oss2 << "CHATHISTORY=" << HISTORY_REPLAY_LIMIT << " "; // Maximo de linhas por CHATHISTORY
+  oss2 << "MSGREFTYPES=timestamp,msgid "; // Referencias aceitas pelo CHATHISTORY
+  features2 += oss2.str();
 
   sendReply(client, "005 " + nick + " " + features2 + " :are also supported");
 }
 
-Channel *Server::getChannels(const std::string &name) {
-  std::map<std::string, Channel *>::iterator it = _channels.find(name);
-
-  if (it != _channels.end()) {
-    return it->second;
+std::vector<std::string> Server::getStatsReport() const {
+  std::vector<std::string> report;
+  std::ostringstream line;
+
+  line << "backend " << (_uring != NULL ? "io_uring" : "poll") << " flush_mode "
+       << (_flush_mode == FLUSH_THROUGHPUT ? "throughput" : "latency") << " window_us " << _flush_window_us;
+  report.push_back(line.str());
+  line.str("");
+  line << "syscalls poll " << _stats.pollCalls << " accept " << _stats.acceptCalls << " recv " << _stats.recvCalls
+       << " send " << _stats.sendCalls << " ring_enter " << (_uring != NULL ? _uring->getEnterCalls() : 0);
+  report.push_back(line.str());
+  if (_uring != NULL) {
+    line.str("");
+    line << "io_uring completions " << _uring->getCompletions() << " accept " << _stats.acceptCompletions << " recv "
+         << _stats.recvCompletions;
+    report.push_back(line.str());
+  }
+  line.str("");
+  line << "commands " << _stats.commands << " queued_writes " << _stats.queuedWrites << " sends_saved "
+       << _stats.coalescedWrites;
+  report.push_back(line.str());
+  line.str("");
+  line << "clients " << _clients.size() << " channels " << _channels.size() << " timers " << _timers.size();
+  report.push_back(line.str());
+  line.str("");
+  line << "channels live " << _channels.size() << " created " << _stats.channelsCreated << " reclaimed "
+       << _stats.channelsReclaimed << " pending " << _reclaim_channels.size();
+  report.push_back(line.str());
+  line.str("");
+  line << "names implicit " << _stats.implicitNames << " skipped " << _stats.implicitNamesSkipped;
+  report.push_back(line.str());
+  line.str("");
+  line << "list queries " << _list_queries.size() << " entries " << _stats.listEntries;
+  report.push_back(line.str());
+  line.str("");
+  std::size_t pendingJobs = 0;
+  for (std::map<Channel *, std::deque<BroadcastJob> >::const_iterator it = _broadcast_jobs.begin();
+       it != _broadcast_jobs.end(); ++it)
+    pendingJobs += it->second.size();
+  line << "broadcast jobs " << _stats.broadcastJobs << " done " << _stats.broadcastJobsDone << " pending "
+       << pendingJobs << " channels " << _broadcast_jobs.size() << " deliveries " << _stats.broadcastDeliveries;
+  report.push_back(line.str());
+  line.str("");
+  line << "flood dropped " << _stats.floodDropped << " trips " << _stats.floodTrips;
+  report.push_back(line.str());
+  line.str("");
+  line << "history channels " << _history.channelCount() << " lines " << _history.lineCount() << " bytes "
+       << _history.byteCount() << " evicted " << _history.evictedCount() << " queries " << _stats.historyQueries
+       << " replayed " << _stats.historyReplayed << " pending " << _history_replays.size() << " refused "
+       << _stats.historyRefused;
+  report.push_back(line.str());
+  line.str("");
+  HistoryLogStats logStats;
+  if (_history.getLogStats(logStats)) {
+    line << "history log segments " << logStats.segments << " bytes " << logStats.diskBytes << " pending "
+         << logStats.pending << " commits " << logStats.commits << " written " << logStats.written << " dropped "
+         << logStats.dropped << " failed " << logStats.failed << " merges " << logStats.merges << " expired "
+         << logStats.expired;
+    report.push_back(line.str());
+    line.str("");
+  }
+  const SearchStats searchStats = _search.getStats();
+  line << "search docs " << searchStats.docs << " tokens " << searchStats.tokens << " bytes "
+       << searchStats.postingBytes << " pending " << searchStats.pending << " queries " << _stats.searchQueries
+       << " answered " << searchStats.queries << " truncated " << searchStats.truncated << " compactions "
+       << searchStats.compactions << " refused " << _stats.searchRefused;
+  report.push_back(line.str());
+  line.str("");
+  line << "upgrade took_over clients " << _stats.upgradeClients << " channels " << _stats.upgradeChannels
+       << " handoff_us " << _stats.upgradeUs << " failed " << _stats.upgradeFailures;
+  report.push_back(line.str());
+  line.str("");
+  line << "admission rejected full " << _stats.rejectedGlobal << " per_ip " << _stats.rejectedPerIp << " rate "
+       << _stats.rejectedRate << " hosts " << _admission.size() << " slots " << _admission.capacity();
+  report.push_back(line.str());
+  line.str("");
+  line << "loop iterations " << _stats.loopIterations << " last_us " << _stats.lastLoopUs << " max_us "
+       << _stats.maxLoopUs << " ready_queue " << _ready_clients.size() << " deferred " << _stats.deferredClients;
+  report.push_back(line.str());
+  line.str("");
+  line << "pool clients live " << _client_pool.live() << " idle " << _client_pool.idle() << " high_water "
+       << _client_pool.highWater() << " slabs " << _client_pool.slabs() << " reused " << _client_pool.reused()
+       << " freed " << _client_pool.freed();
+  report.push_back(line.str());
+  line.str("");
+  line << "pool channels live " << _channel_pool.live() << " idle " << _channel_pool.idle() << " high_water "
+       << _channel_pool.highWater() << " slabs " << _channel_pool.slabs() << " reused " << _channel_pool.reused()
+       << " freed " << _channel_pool.freed();
+  report.push_back(line.str());
+  return report;
+}
+
+Channel *Server::getChannels(const std::string &name) {
+  std::map<std::string, Channel *>::iterator it = _channels.find(name);
+
+  if (it != _channels.end()) {
+    return it->second;
+  }
+
+  std::cout << "\033[42m" << "Channel created:" << "\033[0m " << name << std::endl;
+  Channel *newChannel = _channel_pool.acquire();
+  newChannel->reset(name);
+  _channels[name] = newChannel;
+  _channels_by_size.insert(std::make_pair(static_cast<std::size_t>(0), name));
+  ++_stats.channelsCreated;
+  return newChannel;
+}
+
+// All membership changes go through joinChannel()/leaveChannel() so that the
+// channel's member list, the client's channel list and the reference count
+// never disagree.
+void Server::joinChannel(Client &client, Channel &channel) {
+  if (channel.isMember(client.getFd()))
+    return;
+  channel.addMember(&client, ++_join_seq);
+  channel.retain();
+  client.addChannel(channel.getName());
+  reindexChannel(channel, channel.getMembersNumber() - 1);
+}
+
+void Server::leaveChannel(Client &client, Channel &channel) {
+  if (!channel.isMember(client.getFd()))
+    return;
+  channel.removeMember(client.getFd());
+  client.removeChannel(channel.getName());
+  reindexChannel(channel, channel.getMembersNumber() + 1);
+  // Broadcast jobs may keep the object alive a while longer, but the name is
+  // free at once: the next JOIN gets a fresh channel, not these modes.
+  if (channel.getMembersNumber() == 0)
+    detachChannel(channel);
+  releaseChannel(channel);
+}
+
+// Delivers line once to every client sharing at least one channel with
+// client. The union of neighbours is built in the same pass through the
+// delivery epoch stamps, without a temporary set; client itself is skipped.
+void Server::notifyNeighbors(Client &client, const std::string &line) {
+  const unsigned long epoch = ++_delivery_epoch;
+  const std::vector<std::string> &joined = client.getChannels();
+  std::vector<std::pair<Channel *, std::string> > targets;
+  std::vector<int> reachedOperators;
+
+  client.markDelivered(epoch);
+  for (std::size_t i = 0; i < joined.size(); ++i) {
+    std::map<std::string, Channel *>::iterator it = _channels.find(joined[i]);
+    if (it == _channels.end())
+      continue;
+    // A regular member of an auditorium channel is only visible to its
+    // operators; they are few, so they are served inline.
+    if (it->second->getMode('u') && !it->second->isOperator(client.getFd()))
+      it->second->broadcastToOperatorsOnce(line, client.getFd(), epoch, reachedOperators);
+    else
+      targets.push_back(std::make_pair(it->second, line));
+  }
+  fanOutOnce(targets, client.getFd(), epoch, reachedOperators);
+}
+
+// Channels below BROADCAST_JOB_THRESHOLD members are served inline. Larger
+// ones, and any channel that still has jobs queued (to keep its messages in
+// order), get a BroadcastJob that runBroadcastJobs() works through in slices.
+bool Server::needsSlicing(Channel &channel) const {
+  return channel.getMembersNumber() >= BROADCAST_JOB_THRESHOLD || _broadcast_jobs.count(&channel) != 0;
+}
+
+void Server::fanOut(Channel &channel, const std::string &message, int excludeFd, bool operatorsOnly) {
+  if (needsSlicing(channel)) {
+    BroadcastJob job = makeBroadcastJob(message, excludeFd, 0);
+    job.operatorsOnly = operatorsOnly;
+    queueBroadcast(channel, job);
+  } else if (operatorsOnly) {
+    channel.broadcastToOperators(message, excludeFd);
+  } else {
+    channel.broadcast(message, excludeFd);
+  }
+}
+
+// Deduplicated fan-out of one message to several channels. Inline targets
+// rely on the epoch stamps alone, which cannot be overwritten while they run.
+// A sliced target may run after other messages restamped its members, so it
+// also records which channels (inline ones and earlier sliced ones) and
+// which direct recipients already carried the message.
+void Server::fanOutOnce(const std::vector<std::pair<Channel *, std::string> > &targets, int excludeFd,
+                        unsigned long epoch, const std::vector<int> &directFds) {
+  std::vector<std::string> served;
+  std::vector<std::size_t> sliced;
+
+  for (std::size_t i = 0; i < targets.size(); ++i) {
+    if (needsSlicing(*targets[i].first)) {
+      sliced.push_back(i);
+      continue;
+    }
+    targets[i].first->broadcastOnce(targets[i].second, excludeFd, epoch);
+    served.push_back(targets[i].first->getName());
+  }
+
+  for (std::size_t i = 0; i < sliced.size(); ++i) {
+    Channel &channel = *targets[sliced[i]].first;
+    BroadcastJob job = makeBroadcastJob(targets[sliced[i]].second, excludeFd, epoch);
+    job.skipChannels = served;
+    job.skipFds = directFds;
+    queueBroadcast(channel, job);
+    served.push_back(channel.getName());
+  }
+}
+
+// Queuing costs the same whatever the channel's size: the members are only
+// walked slice by slice, and the join sequence number taken here is what
+// tells the ones the line is for from later arrivals.
+BroadcastJob Server::makeBroadcastJob(const std::string &message, int excludeFd, unsigned long epoch) const {
+  BroadcastJob job;
+  job.message = message;
+  job.excludeFd = excludeFd;
+  job.epoch = epoch;
+  job.joinSeq = _join_seq;
+  job.operatorsOnly = false;
+  job.started = false;
+  job.lastFd = -1;
+  return job;
+}
+
+// Each queued job holds a channel reference, so the channel outlives its
+// members if they all leave before the fan-out is over.
+void Server::queueBroadcast(Channel &channel, const BroadcastJob &job) {
+  channel.retain();
+  _broadcast_jobs[&channel].push_back(job);
+  ++_stats.broadcastJobs;
+}
+
+// Gives every channel with a backlog one slice of BROADCAST_SLICE members
+// per iteration. Jobs of the same channel run strictly one after another.
+void Server::runBroadcastJobs() {
+  for (std::map<Channel *, std::deque<BroadcastJob> >::iterator it = _broadcast_jobs.begin();
+       it != _broadcast_jobs.end();) {
+    Channel *channel = it->first;
+    std::deque<BroadcastJob> &jobs = it->second;
+    std::size_t budget = BROADCAST_SLICE;
+
+    while (budget > 0 && !jobs.empty()) {
+      if (!advanceBroadcast(*channel, jobs.front(), budget))
+        break;
+      jobs.pop_front();
+      ++_stats.broadcastJobsDone;
+      releaseChannel(*channel);
+    }
+
+    if (jobs.empty())
+      _broadcast_jobs.erase(it++);
+    else
+      ++it;
+  }
+}
+
+// Returns true once the job has visited every member. A client that took
+// over a departed recipient's fd joined later, so the sequence check covers
+// fd reuse as well.
+bool Server::advanceBroadcast(Channel &channel, BroadcastJob &job, std::size_t &budget) {
+  const std::map<int, Client *> &members = channel.getMembers();
+  std::map<int, Client *>::const_iterator it = job.started ? members.upper_bound(job.lastFd) : members.begin();
+
+  job.started = true;
+  for (; it != members.end() && budget > 0; ++it, --budget) {
+    job.lastFd = it->first;
+    if (it->first == job.excludeFd || !channel.joinedBy(it->first, job.joinSeq) ||
+        (job.operatorsOnly && !channel.isOperator(it->first)) || reachedElsewhere(job, *it->second))
+      continue;
+    it->second->queueTagged(job.message);
+    ++_stats.broadcastDeliveries;
+  }
+  return it == members.end();
+}
+
+// A skip channel only counts if the member was already in it when the line
+// was sent: joining it afterwards does not mean the line arrived there.
+bool Server::reachedElsewhere(const BroadcastJob &job, Client &member) const {
+  if (job.epoch == 0)
+    return false;
+  if (!member.markDelivered(job.epoch))
+    return true;
+  if (std::find(job.skipFds.begin(), job.skipFds.end(), member.getFd()) != job.skipFds.end())
+    return true;
+
+  for (std::size_t i = 0; i < job.skipChannels.size(); ++i) {
+    std::map<std::string, Channel *>::const_iterator it = _channels.find(job.skipChannels[i]);
+    if (it != _channels.end() && it->second->joinedBy(member.getFd(), job.joinSeq))
+      return true;
+  }
+  return false;
+}
+
+// _channels_by_size orders channels by member count so that LIST >N starts
+// at the first large enough channel instead of scanning all of them.
+void Server::reindexChannel(const Channel &channel, std::size_t previousSize) {
+  _channels_by_size.erase(std::make_pair(previousSize, channel.getName()));
+  _channels_by_size.insert(std::make_pair(channel.getMembersNumber(), channel.getName()));
+}
+
+// The last reference takes the name out of _channels at once, so a new JOIN
+// creates a fresh channel, but the object itself is only returned to the pool
+// by reclaimChannels() at the end of the loop iteration. Handlers further up
+// the stack may still hold a pointer to it until then.
+void Server::releaseChannel(Channel &channel) {
+  if (channel.release() > 0)
+    return;
+
+  detachChannel(channel);
+  std::cout << "\033[41m" << "Channel deleted:" << "\033[0m " << channel.getName() << std::endl;
+  _reclaim_channels.push_back(&channel);
+}
+
+// Takes the name out of _channels unless it already belongs to a newer
+// channel. The history of an invite-only or keyed channel is fenced off on
+// the way out: whoever creates the name next would otherwise read it.
+void Server::detachChannel(Channel &channel) {
+  std::map<std::string, Channel *>::iterator it = _channels.find(channel.getName());
+  if (it == _channels.end() || it->second != &channel)
+    return;
+  _channels.erase(it);
+  _channels_by_size.erase(std::make_pair(channel.getMembersNumber(), channel.getName()));
+  if (channel.isInviteOnly() || channel.hasKey()) {
+    _history.fence(channel.getName());
+    _search.forget(channel.getName());
+  }
+}
+
+void Server::reclaimChannels() {
+  for (std::size_t i = 0; i < _reclaim_channels.size(); ++i) {
+    _reclaim_channels[i]->reset("");
+    _channel_pool.release(_reclaim_channels[i]);
+    ++_stats.channelsReclaimed;
   }
+  _reclaim_channels.clear();
+}
 
-  std::cout << "\033[42m" << "Channel created:" << "\033[0m " << name << std::endl;
-  Channel *newChannel = new Channel(name);
-  _channels[name] = newChannel;
-  return newChannel;
+// Once per iteration, when nothing up the stack can still point into a slab.
+void Server::trimPools() {
+  _client_pool.trim();
+  _channel_pool.trim();
 }
 
 bool Server::isValidChannelName(const std::string &name) const {
@@ -970,6 +2320,10 @@ void Server::handleMODE(Client &client, const IRCMessage &msg) {
       modes += "i";
     if (channel->getMode('t'))
       modes += "t";
+    if (channel->getMode('u'))
+      modes += "u";
+    if (channel->getMode('m'))
+      modes += "m";
     if (channel->hasKey()) {
       modes += "k";
       params += " " + channel->getKey();
@@ -981,11 +2335,26 @@ void Server::handleMODE(Client &client, const IRCMessage &msg) {
     ss << channel->getLimit();
     params += " " + ss.str();
   }
+    if (channel->getMode('f')) {
+      modes += "f";
+      params += " " + channel->getFloodParam();
+    }
 
     sendReply(client, "324 " + client.getNickname() + " " + target + " " + modes + params);
     return;
   }
 
+  // MODE #chan b|e|I lists the masks; anyone may ask.
+  if (msg.getParamCount() == 2) {
+    std::string query = msg.getParams()[1];
+    if (!query.empty() && query[0] == '+')
+      query.erase(0, 1);
+    if (query.size() == 1 && std::string("beI").find(query[0]) != std::string::npos) {
+      sendMaskList(client, *channel, query[0]);
+      return;
+    }
+  }
+
   if (!channel->isOperator(client.getFd())) {
     sendError(client, ERR_CHANOPRIVSNEEDED, target);
     return;
@@ -1023,6 +2392,65 @@ void Server::handleMODE(Client &client, const IRCMessage &msg) {
       (adding ? plusFlags : minusFlags) += 't';
       break;
 
+    case 'u':
+      channel->setMode('u', adding);
+      (adding ? plusFlags : minusFlags) += 'u';
+      break;
+
+    case 'b':
+    case 'e':
+    case 'I': {
+      if (paramIndex >= msg.getParamCount()) {
+        sendMaskList(client, *channel, mode);
+        break;
+      }
+      std::string mask = MaskList::normalize(msg.getParams()[paramIndex++]);
+      MaskList &list = channel->getMaskList(mode);
+      if (adding) {
+        if (list.size() >= MAX_LIST_ENTRIES) {
+          sendError(client, ERR_BANLISTFULL, target, std::string(1, mode));
+          break;
+        }
+        if (!list.add(mask, client.getNickname(), std::time(NULL)))
+          break;
+      } else if (!list.remove(mask)) {
+        break;
+      }
+      (adding ? plusFlags : minusFlags) += mode;
+      modeParams.push_back(mask);
+      break;
+    }
+
+    case 'm':
+      channel->setMode('m', adding);
+      channel->setModeratedUntil(0);
+      (adding ? plusFlags : minusFlags) += 'm';
+      break;
+
+    case 'f':
+      if (adding) {
+        if (paramIndex < msg.getParamCount()) {
+          unsigned messages = 0;
+          unsigned seconds = 0;
+          char action = 'd';
+          const std::string &param = msg.getParams()[paramIndex++];
+          if (parseFloodParam(param, messages, seconds, action)) {
+            channel->setFlood(messages, seconds, action);
+            channel->setMode('f', true);
+            plusFlags += 'f';
+            modeParams.push_back(channel->getFloodParam());
+          } else {
+            sendError(client, ERR_INVALIDMODEPARAM, target, "f", param);
+          }
+        } else {
+          sendError(client, ERR_NEEDMOREPARAMS, "MODE");
+        }
+      } else {
+        channel->setMode('f', false);
+        minusFlags += 'f';
+      }
+      break;
+
     case 'k':
       if (adding) {
         if (channel->hasKey()) {
@@ -1111,25 +2539,106 @@ void Server::handleMODE(Client &client, const IRCMessage &msg) {
   }
 }
 
+// LIST only records the query; pumpListQueries() streams the 322 lines a
+// batch per loop iteration while the client's output keeps draining.
 void Server::handleLIST(Client &client, const IRCMessage &msg) {
   if (!client.isAuthenticated()) {
     sendError(client, ERR_NOTREGISTERED, "");
     return;
   }
 
-  std::string senderNick = client.getNickname();
-
   // RPL_LISTSTART (321)
-  sendReply(client, "321 " + senderNick + " Channel :Users Name");
-
-  std::string filter;
+  sendReply(client, "321 " + client.getNickname() + " Channel :Users Name");
+
+  ListQuery query;
+  query.clientId = client.getId();
+  query.nextName = 0;
+  query.minUsers = 0;
+  query.maxUsers = static_cast<std::size_t>(-1);
+  query.minCreatedAge = -1;
+  query.maxCreatedAge = -1;
+  query.minTopicAge = -1;
+  query.maxTopicAge = -1;
+  query.bySize = false;
+  query.started = false;
+  query.lastSize = 0;
   if (msg.getParamCount() > 0) {
-    filter = msg.getParams()[0];
+    parseListFilters(splitList(msg.getParams()[0]), query);
   }
 
-  for (std::map<std::string, Channel *>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
- 
-    Channel *channel = it->second;
+  _list_queries[client.getFd()] = query;
+}
+
+void Server::pumpListQueries() {
+  _list_backlog = false;
+
+  for (std::map<int, ListQuery>::iterator it = _list_queries.begin(); it != _list_queries.end();) {
+    Client *client = findClientByFd(it->first);
+    if (client == NULL || client->getId() != it->second.clientId) {
+      _list_queries.erase(it++);
+      continue;
+    }
+    if (client->getOutputBuffer().size() >= LIST_OUTPUT_HIGH_WATER) {
+      ++it;
+      continue;
+    }
+    if (advanceListQuery(*client, it->second)) {
+      _list_queries.erase(it++);
+      continue;
+    }
+    _list_backlog = true;
+    ++it;
+  }
+}
+
+// Emits up to LIST_BATCH_ENTRIES matching channels, examining at most
+// LIST_SCAN_BUDGET of them, as a single write. Returns true once the walk
+// is over and RPL_LISTEND has been queued.
+bool Server::advanceListQuery(Client &client, ListQuery &query) {
+  const std::string head = ":" + _server_name + " 322 " + client.getNickname() + " ";
+  const std::time_t now = std::time(NULL);
+  std::string batch;
+  std::size_t emitted = 0;
+  std::size_t scanned = 0;
+  bool finished = false;
+
+  while (emitted < LIST_BATCH_ENTRIES && scanned < LIST_SCAN_BUDGET) {
+    const Channel *channel = NULL;
+
+    if (!query.names.empty()) {
+      if (query.nextName >= query.names.size()) {
+        finished = true;
+        break;
+      }
+      std::map<std::string, Channel *>::const_iterator found = _channels.find(query.names[query.nextName++]);
+      if (found != _channels.end())
+        channel = found->second;
+    } else if (query.bySize) {
+      std::set<std::pair<std::size_t, std::string> >::const_iterator next =
+          query.started ? _channels_by_size.upper_bound(std::make_pair(query.lastSize, query.lastName))
+                        : _channels_by_size.lower_bound(std::make_pair(query.minUsers, std::string()));
+      if (next == _channels_by_size.end() || next->first > query.maxUsers) {
+        finished = true;
+        break;
+      }
+      query.lastSize = next->first;
+      query.lastName = next->second;
+      channel = _channels.find(next->second)->second;
+    } else {
+      std::map<std::string, Channel *>::const_iterator next =
+          query.started ? _channels.upper_bound(query.lastName) : _channels.begin();
+      if (next == _channels.end()) {
+        finished = true;
+        break;
+      }
+      query.lastName = next->first;
+      channel = next->second;
+    }
+    query.started = true;
+    ++scanned;
+
+    if (channel == NULL || !matchesListQuery(query, *channel, now))
+      continue;
 
     std::string topic = channel->getTopic();
     if (topic.empty()) {
@@ -1139,12 +2648,351 @@ void Server::handleLIST(Client &client, const IRCMessage &msg) {
     // RPL_LIST (322)
     std::ostringstream userCount;
     userCount << channel->getMembersNumber();
-
-    sendReply(client, "322 " + senderNick + " " + it->first + " " + userCount.str() + " :" + topic);
+    batch += head + channel->getName() + " " + userCount.str() + " :" + topic + "\r\n";
+    ++emitted;
   }
 
   // RPL_LISTEND (323)
-  sendReply(client, "323 " + senderNick + " :End of /LIST");
+  if (finished)
+    batch += formatReply("323 " + client.getNickname() + " :End of /LIST");
+  if (!batch.empty())
+    sendRaw(client, batch);
+  _stats.listEntries += emitted;
+  return finished;
+}
+
+// CHATHISTORY <LATEST|BEFORE|AFTER|AROUND> <channel> <ref> <limit>,
+// BETWEEN <channel> <ref> <ref> <limit> or TARGETS <timestamp> <timestamp>
+// <limit>. Only channels the client is in can be read. The matching lines are
+// captured as shared references and pumpHistoryReplays() streams them.
+void Server::handleCHATHISTORY(Client &client, const IRCMessage &msg) {
+  if (!client.isAuthenticated()) {
+    sendError(client, ERR_NOTREGISTERED, "");
+    return;
+  }
+
+  std::vector<std::string> args = msg.getParams();
+  if (msg.hasTrailing())
+    args.push_back(msg.getTrailing());
+  if (args.empty()) {
+    sendReply(client, "FAIL CHATHISTORY NEED_MORE_PARAMS :Missing parameters");
+    return;
+  }
+
+  std::string subcommand = args[0];
+  std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+  const bool between = subcommand == "BETWEEN";
+  if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER" && subcommand != "AROUND" &&
+      !between && subcommand != "TARGETS") {
+    sendReply(client, "FAIL CHATHISTORY INVALID_PARAMS " + args[0] + " :Unknown subcommand");
+    return;
+  }
+  if (args.size() < (between ? 5U : 4U)) {
+    sendReply(client, "FAIL CHATHISTORY NEED_MORE_PARAMS " + subcommand + " :Missing parameters");
+    return;
+  }
+  if (subcommand == "TARGETS") {
+    sendHistoryTargets(client, args);
+    return;
+  }
+
+  long requested = 0;
+  if (!parseCount(args[between ? 4 : 3], requested) || requested == 0) {
+    sendReply(client, "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Invalid limit");
+    return;
+  }
+  const std::size_t limit = std::min(static_cast<std::size_t>(requested), HISTORY_REPLAY_LIMIT);
+
+  const std::string &target = args[1];
+  std::map<std::string, Channel *>::iterator it = _channels.find(target);
+  if (it == _channels.end() || !it->second->isMember(client.getFd())) {
+    sendReply(client, "FAIL CHATHISTORY INVALID_TARGET " + subcommand + " " + target +
+                          " :Messages could not be retrieved");
+    return;
+  }
+
+  HistoryPoint point;
+  HistoryPoint second;
+  const bool latestAll = subcommand == "LATEST" && args[2] == "*";
+  if ((!latestAll && !HistoryStore::parsePoint(args[2], point)) ||
+      (between && !HistoryStore::parsePoint(args[3], second))) {
+    sendReply(client, "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Invalid message reference");
+    return;
+  }
+  if (isHistoryBacklogFull(client)) {
+    sendReply(client, "FAIL CHATHISTORY RATE_LIMITED " + subcommand + " " + target +
+                          " :Too many history requests in progress");
+    ++_stats.historyRefused;
+    return;
+  }
+
+  // The writer does not wake the loop, so pick up its latest offsets first.
+  collectHistoryLog();
+  HistoryReplay replay;
+  replay.clientId = client.getId();
+  replay.next = 0;
+  replay.batch = "chathistory " + target;
+  if (subcommand == "LATEST")
+    _history.latest(target, latestAll ? NULL : &point, limit, replay.lines);
+  else if (subcommand == "BEFORE")
+    _history.before(target, point, limit, replay.lines);
+  else if (subcommand == "AFTER")
+    _history.after(target, point, limit, replay.lines);
+  else if (subcommand == "AROUND")
+    _history.around(target, point, limit, replay.lines);
+  else
+    _history.between(target, point, second, limit, replay.lines);
+
+  ++_stats.historyQueries;
+  queueHistoryReplay(client, replay);
+}
+
+// A query issued while an earlier one is still streaming queues behind it.
+// An empty reply is dropped unless it still owes the client an (empty)
+// batch.
+void Server::queueHistoryReplay(Client &client, const HistoryReplay &replay) {
+  if (replay.lines.empty() && !client.hasCap(CAP_BATCH))
+    return;
+  _history_replays[client.getFd()].push_back(replay);
+}
+
+// Replies still streaming count as well as searches the index has not
+// answered yet, so neither command can pile work up for the other.
+bool Server::isHistoryBacklogFull(const Client &client) const {
+  std::size_t backlog = 0;
+  std::map<int, std::deque<HistoryReplay> >::const_iterator replays = _history_replays.find(client.getFd());
+  if (replays != _history_replays.end())
+    backlog += replays->second.size();
+  std::map<unsigned long, std::size_t>::const_iterator searches = _searches_in_flight.find(client.getId());
+  if (searches != _searches_in_flight.end())
+    backlog += searches->second;
+  return backlog >= HISTORY_CLIENT_BACKLOG;
+}
+
+// Joined channels with history between the two timestamps, most recently
+// active first, as "CHATHISTORY TARGETS <channel> <time>" lines.
+void Server::sendHistoryTargets(Client &client, const std::vector<std::string> &args) {
+  HistoryPoint from;
+  HistoryPoint to;
+  long requested = 0;
+  if (!HistoryStore::parsePoint(args[1], from) || !HistoryStore::parsePoint(args[2], to) || from.byMsgid ||
+      to.byMsgid || !parseCount(args[3], requested) || requested == 0) {
+    sendReply(client, "FAIL CHATHISTORY INVALID_PARAMS TARGETS :Invalid parameters");
+    return;
+  }
+  collectHistoryLog();
+  const unsigned long low = std::min(from.timeMs, to.timeMs);
+  const unsigned long high = std::max(from.timeMs, to.timeMs);
+
+  std::vector<std::pair<unsigned long, std::string> > active;
+  const std::vector<std::string> &joined = client.getChannels();
+  for (std::size_t i = 0; i < joined.size(); ++i) {
+    unsigned long last = 0;
+    if (_history.lastTime(joined[i], last) && last > low && last < high)
+      active.push_back(std::make_pair(last, joined[i]));
+  }
+  std::sort(active.rbegin(), active.rend());
+  if (active.size() > static_cast<std::size_t>(requested))
+    active.resize(static_cast<std::size_t>(requested));
+
+  std::string batch;
+  for (std::size_t i = 0; i < active.size(); ++i)
+    batch += formatReply("CHATHISTORY TARGETS " + active[i].second + " timestamp=" +
+                         HistoryStore::formatTime(active[i].first));
+  ++_stats.historyQueries;
+  if (!batch.empty())
+    sendRaw(client, batch);
+}
+
+// SEARCH <attributes>, soju.im/search style: "in=#chan;text=words;from=nick;
+// after=<time>;before=<time>;limit=N", values escaped like message tags. All
+// words must appear; without in= every joined channel is searched. The index
+// answers off the loop and collectSearchResults() streams the matches.
+void Server::handleSEARCH(Client &client, const IRCMessage &msg) {
+  if (!client.isAuthenticated()) {
+    sendError(client, ERR_NOTREGISTERED, "");
+    return;
+  }
+  std::vector<std::string> args = msg.getParams();
+  if (msg.hasTrailing())
+    args.push_back(msg.getTrailing());
+  if (args.empty()) {
+    sendReply(client, "FAIL SEARCH NEED_MORE_PARAMS :Missing parameters");
+    return;
+  }
+
+  SearchQuery query;
+  query.id = _next_search_id++;
+  query.fd = client.getFd();
+  query.clientId = client.getId();
+  query.afterMs = 0;
+  query.beforeMs = 0;
+  query.limit = SEARCH_REPLAY_LIMIT;
+  std::string channel;
+  std::string text;
+
+  std::map<std::string, std::string> attributes;
+  if (!parseSearchAttributes(args[0], attributes)) {
+    sendReply(client, "FAIL SEARCH INVALID_PARAMS :Invalid search attributes");
+    return;
+  }
+  for (std::map<std::string, std::string>::const_iterator it = attributes.begin(); it != attributes.end(); ++it) {
+    const std::string &key = it->first;
+    const std::string &value = it->second;
+    HistoryPoint point;
+    long requested = 0;
+    bool valid = true;
+    if (key == "in")
+      channel = value;
+    else if (key == "text")
+      text = value;
+    else if (key == "from")
+      query.nick = value;
+    else if (key == "after" || key == "before") {
+      valid = HistoryStore::parsePoint("timestamp=" + value, point);
+      if (valid)
+        (key == "after" ? query.afterMs : query.beforeMs) = point.timeMs;
+    } else if (key == "limit") {
+      valid = parseCount(value, requested) && requested > 0;
+      if (valid)
+        query.limit = std::min(static_cast<std::size_t>(requested), SEARCH_REPLAY_LIMIT);
+    }
+    if (!valid) {
+      sendReply(client, "FAIL SEARCH INVALID_PARAMS " + key + " :Invalid value");
+      return;
+    }
+  }
+
+  SearchIndex::tokenize(text, query.tokens);
+  if (query.tokens.empty() && query.nick.empty()) {
+    sendReply(client, "FAIL SEARCH INVALID_PARAMS text :Nothing to search for");
+    return;
+  }
+  if (!channel.empty()) {
+    std::map<std::string, Channel *>::iterator it = _channels.find(channel);
+    if (it == _channels.end() || !it->second->isMember(client.getFd())) {
+      sendReply(client, "FAIL SEARCH INVALID_PARAMS in :Messages could not be retrieved");
+      return;
+    }
+    query.channels.push_back(channel);
+  } else
+    query.channels = client.getChannels();
+  if (isHistoryBacklogFull(client)) {
+    sendReply(client, "FAIL SEARCH RATE_LIMITED :Too many history requests in progress");
+    ++_stats.searchRefused;
+    return;
+  }
+
+  ++_stats.searchQueries;
+  ++_searches_in_flight[client.getId()];
+  _search.submit(query);
+}
+
+// The log reads its disk copy back on the writer thread; if that fails it
+// closes and the history stays in memory only.
+void Server::collectHistoryLog() {
+  if (!_history.collectLog())
+    std::cerr << _history.getLogError() << ", keeping history in memory only" << std::endl;
+}
+
+// Matches come back as (channel, seq) pairs; the lines themselves are read
+// from the history store and streamed like a CHATHISTORY reply. A line that
+// aged out of the history since it was indexed is skipped.
+void Server::collectSearchResults() {
+  _search.collect(_search_results);
+  if (_search_results.empty())
+    return;
+  collectHistoryLog();
+  for (std::size_t i = 0; i < _search_results.size(); ++i) {
+    const SearchResult &result = _search_results[i];
+    std::map<unsigned long, std::size_t>::iterator inFlight = _searches_in_flight.find(result.clientId);
+    if (inFlight != _searches_in_flight.end() && --inFlight->second == 0)
+      _searches_in_flight.erase(inFlight);
+    Client *client = findClientByFd(result.fd);
+    if (client == NULL || client->getId() != result.clientId)
+      continue;
+    HistoryReplay replay;
+    replay.clientId = result.clientId;
+    replay.next = 0;
+    replay.batch = "soju.im/search";
+    for (std::size_t h = 0; h < result.hits.size(); ++h)
+      _history.lookup(result.hits[h].channel, result.hits[h].seq, replay.lines);
+    queueHistoryReplay(*client, replay);
+  }
+  _search_results.clear();
+}
+
+void Server::pumpHistoryReplays() {
+  _history_backlog = false;
+
+  for (std::map<int, std::deque<HistoryReplay> >::iterator it = _history_replays.begin();
+       it != _history_replays.end();) {
+    Client *client = findClientByFd(it->first);
+    if (client == NULL || client->getId() != it->second.front().clientId) {
+      _history_replays.erase(it++);
+      continue;
+    }
+    if (client->getOutputBuffer().size() >= LIST_OUTPUT_HIGH_WATER) {
+      ++it;
+      continue;
+    }
+    if (advanceHistoryReplay(*client, it->second.front())) {
+      it->second.pop_front();
+      if (it->second.empty()) {
+        _history_replays.erase(it++);
+        continue;
+      }
+    }
+    _history_backlog = true;
+    ++it;
+  }
+}
+
+// Batch references only need to be unique among the batches open on one
+// connection; a server-wide counter is simplest.
+std::string Server::nextBatchRef() {
+  std::ostringstream ref;
+  ref << std::hex << _next_batch_id++;
+  return ref.str();
+}
+
+// Queues up to HISTORY_REPLAY_SLICE stored lines as one write. Each line
+// carries its original time for server-time and message-tags clients, its
+// msgid for message-tags clients and the batch reference for batch clients,
+// whose first slice opens the batch and last one closes it. Returns true
+// once every line has gone out.
+bool Server::advanceHistoryReplay(Client &client, HistoryReplay &replay) {
+  const bool withTags = client.hasCap(CAP_MESSAGE_TAGS);
+  const bool withTime = withTags || client.hasCap(CAP_SERVER_TIME);
+  const bool batched = client.hasCap(CAP_BATCH) && !replay.batch.empty();
+  const std::size_t end = std::min(replay.lines.size(), replay.next + HISTORY_REPLAY_SLICE);
+  std::string batch;
+
+  if (batched && replay.ref.empty()) {
+    replay.ref = nextBatchRef();
+    batch += formatReply("BATCH +" + replay.ref + " " + replay.batch);
+  }
+  for (; replay.next < end; ++replay.next) {
+    const HistoryLine &line = *replay.lines[replay.next].get();
+    if (batched || withTime) {
+      batch += '@';
+      if (batched)
+        batch += "batch=" + replay.ref + (withTime ? ";" : "");
+      if (withTime)
+        batch += "time=" + HistoryStore::formatTime(line.getTime());
+      if (withTags)
+        batch += ";msgid=" + line.getMsgid();
+      batch += ' ';
+    }
+    batch += line.getLine();
+    ++_stats.historyReplayed;
+  }
+  const bool finished = replay.next >= replay.lines.size();
+  if (finished && batched)
+    batch += formatReply("BATCH -" + replay.ref);
+  if (!batch.empty())
+    sendRaw(client, batch);
+  return finished;
 }
 
 void Server::handleNAMES(Client &client, const IRCMessage &msg) {
@@ -1159,7 +3007,6 @@ void Server::handleNAMES(Client &client, const IRCMessage &msg) {
   }
 
   std::string channelName = msg.getParams()[0];
-  std::string senderNick = client.getNickname();
 
   std::map<std::string, Channel *>::iterator it = _channels.find(channelName);
   if (it == _channels.end()) {
@@ -1167,16 +3014,35 @@ void Server::handleNAMES(Client &client, const IRCMessage &msg) {
     return;
   }
 
-  Channel *channel = it->second;
+  sendRaw(client, namesReply(client, *it->second));
+}
+
+std::string Server::namesReply(const Client &client, const Channel &channel) const {
+  const std::string &senderNick = client.getNickname();
 
   // RPL_NAMREPLY (353)
   // Formato: :server 353 nick = #channel :@op1 +voice1 normal1
-  std::string userList = channel->getUserList();
+  // The channel caches the line tails; only the prefix is built per request.
+  const std::string head = ":" + _server_name + " 353 " + senderNick;
+  std::size_t budget = IRC_MAX_MESSAGE_LENGTH > head.size() ? IRC_MAX_MESSAGE_LENGTH - head.size() : 0;
+
+  // In an auditorium (+u) channel regular members only see the operators.
+  std::vector<std::string> operatorChunks;
+  const std::vector<std::string> *chunks = &operatorChunks;
+  if (channel.getMode('u') && !channel.isOperator(client.getFd()))
+    operatorChunks = channel.getOperatorNamesChunks(budget, client.getFd());
+  else
+    chunks = &channel.getNamesChunks(budget);
 
-  sendReply(client, "353 " + senderNick + " = " + channelName + " :" + userList);
+  std::string reply;
+  for (std::size_t i = 0; i < chunks->size(); ++i) {
+    reply += head;
+    reply += (*chunks)[i];
+  }
 
   // RPL_ENDOFNAMES (366)
-  sendReply(client, "366 " + senderNick + " " + channelName + " :End of /NAMES list");
+  reply += formatReply("366 " + senderNick + " " + channel.getName() + " :End of /NAMES list");
+  return reply;
 }
 
 void Server::handleTOPIC(Client &client, const IRCMessage &msg) {
@@ -1276,7 +3142,9 @@ void Server::handleINVITE(Client &client, const IRCMessage &msg) {
     return;
   }
 
-  channel->inviteMember(targetClient->getFd());
+  unsigned long now = TimerWheel::nowMs();
+  channel->inviteMember(targetClient->getId(), now + INVITE_EXPIRY_MS, now);
+  scheduleTimer(TIMER_INVITE_EXPIRY, *targetClient, now + INVITE_EXPIRY_MS, channelName);
 
   std::string prefix = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost";
   std::string inviteMsg = prefix + " INVITE " + targetNick + " :" + channelName + "\r\n";
@@ -1284,6 +3152,141 @@ void Server::handleINVITE(Client &client, const IRCMessage &msg) {
   sendReply(client, "341 " + client.getNickname() + " " + targetNick + " " + channelName);
 }
 
+// MONITOR + targets | - targets | C | L | S (IRCv3 monitor). Watchers are
+// indexed by nick, so presence changes only touch the clients watching it.
+void Server::handleMONITOR(Client &client, const IRCMessage &msg) {
+  if (msg.getParamCount() < 1) {
+    sendError(client, ERR_NEEDMOREPARAMS, "MONITOR");
+    return;
+  }
+
+  const std::string &action = msg.getParams()[0];
+  std::string targetList = msg.getParamCount() > 1 ? msg.getParams()[1] : msg.getTrailing();
+  std::vector<std::string> targets = splitList(targetList);
+
+  if (action == "+" || action == "-") {
+    if (targets.empty()) {
+      sendError(client, ERR_NEEDMOREPARAMS, "MONITOR");
+      return;
+    }
+  }
+
+  if (action == "+") {
+    std::vector<std::string> added;
+    for (std::size_t i = 0; i < targets.size(); ++i) {
+      const std::vector<std::string> &monitored = client.getMonitored();
+      if (std::find(monitored.begin(), monitored.end(), targets[i]) != monitored.end())
+        continue;
+      if (monitored.size() >= MONITOR_LIMIT) {
+        std::ostringstream full;
+        std::vector<std::string> rest(targets.begin() + i, targets.end());
+        std::string restList;
+        for (std::size_t j = 0; j < rest.size(); ++j)
+          restList += (j == 0 ? "" : ",") + rest[j];
+        full << "734 " << client.getNickname() << " " << MONITOR_LIMIT << " " << restList
+             << " :Monitor list is full.";
+        sendReply(client, full.str());
+        break;
+      }
+      client.addMonitor(targets[i]);
+      _monitor_watchers[targets[i]].insert(client.getFd());
+      added.push_back(targets[i]);
+    }
+    sendMonitorStatus(client, added);
+  } else if (action == "-") {
+    for (std::size_t i = 0; i < targets.size(); ++i) {
+      if (!client.removeMonitor(targets[i]))
+        continue;
+      std::map<std::string, std::set<int> >::iterator it = _monitor_watchers.find(targets[i]);
+      if (it != _monitor_watchers.end()) {
+        it->second.erase(client.getFd());
+        if (it->second.empty())
+          _monitor_watchers.erase(it);
+      }
+    }
+  } else if (action == "C" || action == "c") {
+    dropMonitors(client);
+  } else if (action == "L" || action == "l") {
+    sendNickBatch(client, "732", client.getMonitored());
+    sendReply(client, "733 " + client.getNickname() + " :End of MONITOR list");
+  } else if (action == "S" || action == "s") {
+    sendMonitorStatus(client, client.getMonitored());
+  }
+}
+
+// RPL_MONONLINE (730) with full prefixes for the online ones, RPL_MONOFFLINE
+// (731) for the rest.
+void Server::sendMonitorStatus(Client &client, const std::vector<std::string> &nicks) {
+  std::vector<std::string> online;
+  std::vector<std::string> offline;
+
+  for (std::size_t i = 0; i < nicks.size(); ++i) {
+    Client *target = findClientByNick(nicks[i]);
+    if (target != NULL && _welcomed_clients.find(target->getFd()) != _welcomed_clients.end())
+      online.push_back(target->getNickname() + "!" + target->getUsername() + "@localhost");
+    else
+      offline.push_back(nicks[i]);
+  }
+  sendNickBatch(client, "730", online);
+  sendNickBatch(client, "731", offline);
+}
+
+// Comma separated numeric, split so every line stays within 512 bytes.
+void Server::sendNickBatch(Client &client, const std::string &code, const std::vector<std::string> &items) {
+  const std::string head = code + " " + client.getNickname() + " :";
+  const std::size_t budget = IRC_MAX_MESSAGE_LENGTH - (_server_name.size() + 4 + head.size());
+  std::string line;
+
+  for (std::size_t i = 0; i < items.size(); ++i) {
+    if (!line.empty() && line.size() + 1 + items[i].size() > budget) {
+      sendReply(client, head + line);
+      line.clear();
+    }
+    line += (line.empty() ? "" : ",") + items[i];
+  }
+  if (!line.empty())
+    sendReply(client, head + line);
+}
+
+void Server::notifyMonitors(const Client &subject, const std::string &nick, bool online) {
+  std::map<std::string, std::set<int> >::iterator it = _monitor_watchers.find(nick);
+  if (it == _monitor_watchers.end())
+    return;
+
+  const std::string code = online ? " 730 " : " 731 ";
+  const std::string target = online ? nick + "!" + subject.getUsername() + "@localhost" : nick;
+  for (std::set<int>::iterator fd = it->second.begin(); fd != it->second.end(); ++fd) {
+    Client *watcher = findClientByFd(*fd);
+    if (watcher != NULL && watcher != &subject)
+      sendRaw(*watcher, ":" + _server_name + code + watcher->getNickname() + " :" + target + "\r\n");
+  }
+}
+
+void Server::dropMonitors(Client &client) {
+  const std::vector<std::string> &monitored = client.getMonitored();
+  for (std::size_t i = 0; i < monitored.size(); ++i) {
+    std::map<std::string, std::set<int> >::iterator it = _monitor_watchers.find(monitored[i]);
+    if (it == _monitor_watchers.end())
+      continue;
+    it->second.erase(client.getFd());
+    if (it->second.empty())
+      _monitor_watchers.erase(it);
+  }
+  client.clearMonitored();
+}
+
+void Server::handleSTATS(Client &client, const IRCMessage &msg) {
+  std::string query = msg.getParamCount() > 0 ? msg.getParams()[0] : "*";
+  std::vector<std::string> report = getStatsReport();
+
+  // RPL_STATSDEBUG (249)
+  for (std::size_t i = 0; i < report.size(); ++i)
+    sendReply(client, "249 " + client.getNickname() + " :" + report[i]);
+
+  // RPL_ENDOFSTATS (219)
+  sendReply(client, "219 " + client.getNickname() + " " + query + " :End of /STATS report");
+}
+
 void Server::handleKICK(Client &client, const IRCMessage &msg) {
   if (!client.isAuthenticated()) {
     sendError(client, ERR_NOTREGISTERED, "");
@@ -1337,13 +3340,12 @@ void Server::handleKICK(Client &client, const IRCMessage &msg) {
   std::string kickMsg = ":" + client.getNickname() + "!" + client.getUsername() + "@localhost KICK " + channelName +
                         " " + targetNick + " :" + reason + "\r\n";
 
-  broadcastToChannel(channelName, kickMsg);
+  // The target leaves right away, so it gets its copy directly instead of
+  // through a broadcast that may be sliced over later iterations.
+  broadcastToChannel(channelName, kickMsg, targetClient);
+  sendRaw(*targetClient, kickMsg);
 
-  channel->removeMember(targetClient->getFd());
-
-  if (channel->getMembersNumber() == 0) {
-    _channels.erase(it);
-  }
+  leaveChannel(*targetClient, *channel);
 }
 
 void Server::broadcastToChannel(const std::string &channelName, const std::string &message, Client *exclude) {
@@ -1356,25 +3358,35 @@ void Server::broadcastToChannel(const std::string &channelName, const std::strin
     if (exclude)
       FD = exclude->getFd();
 
-    channel->broadcast(message, FD);
+    fanOut(*channel, message, FD);
   }
 }
 
 void Server::checkAndSendWelcome(Client &client) {
-  if (client.isAuthenticated() && _welcomed_clients.find(client.getFd()) == _welcomed_clients.end()) {
+  if (client.isAuthenticated() && !client.isNegotiating() &&
+      _welcomed_clients.find(client.getFd()) == _welcomed_clients.end()) {
 
     _welcomed_clients.insert(client.getFd());
     sendWelcome(client);
+    notifyMonitors(client, client.getNickname(), true);
   }
 }
 
+// An INVITE lets the user past both +i and the ban list; +I only lifts +i.
 bool Server::canJoin(const Client &client, const Channel &channel, const std::string &key, errorCode &error) const {
+  const bool invited = channel.isInvited(client.getId(), TimerWheel::nowMs());
+  const std::string hostmask = client.getNickname() + "!" + client.getUsername() + "@localhost";
+
   if (channel.getMode('i')) {
-    if (!channel.isInvitedFd(client.getFd())) {
+    if (!invited && !channel.isInviteExempt(hostmask)) {
       error = ERR_INVITEONLYCHAN;
       return false;
     }
   }
+  if (!invited && channel.isBanned(hostmask)) {
+    error = ERR_BANNEDFROMCHAN;
+    return false;
+  }
   if (channel.getMode('l') && channel.getMembersNumber() >= channel.getLimit()) {
     error = ERR_CHANNELISFULL;
     return false;
@@ -1385,3 +3397,404 @@ bool Server::canJoin(const Client &client, const Channel &channel, const std::st
   }
   return true;
 }
+
+// SIGUSR2 asks for a hot restart. LIST, CHATHISTORY and SEARCH replies in
+// progress get HANDOFF_DRAIN_MS to finish first: the new process knows
+// nothing of them, so whatever is left by then is cut short. True once
+// another process has taken over.
+bool Server::pumpHandOff() {
+  const unsigned long now = TimerWheel::nowMs();
+  if (_upgrade_deadline == 0)
+    _upgrade_deadline = now + HANDOFF_DRAIN_MS;
+  if ((!_list_queries.empty() || !_history_replays.empty() || _search.hasOutstanding()) && now < _upgrade_deadline)
+    return false;
+
+  g_upgrade_requested = 0;
+  _upgrade_deadline = 0;
+  return handOff();
+}
+
+// Hands the listening socket, every client and every channel to a process
+// started from _upgrade_command (see HotRestart). Input stops first: poll()
+// is simply not called again, while io_uring has its recvs cancelled and its
+// sends drained. Until the new process acknowledges, this one keeps every
+// socket and carries on as before if anything fails.
+bool Server::handOff() {
+  const unsigned long started = TimerWheel::nowUs();
+
+  // Clients that hung up are not handed over, but the lines they left still
+  // run; every one of them is in the ready queue until it is gone.
+  for (bool closing = true; closing;) {
+    closing = false;
+    for (std::size_t i = 0; i < _clients.size() && !closing; ++i)
+      closing = _clients[i]->isClosing();
+    if (closing)
+      serveReadyClients();
+  }
+  // Slices still owed to channel members cannot be handed over.
+  while (!_broadcast_jobs.empty())
+    runBroadcastJobs();
+
+  if (_uring != NULL && !quiesceUring()) {
+    std::cerr << "upgrade: sends still in flight after " << HANDOFF_QUIESCE_MS << " ms, carrying on" << std::endl;
+    resumeUring();
+    queueBufferedClients();
+    ++_stats.upgradeFailures;
+    return false;
+  }
+
+  // The new process reopens the log, and a log has a single writer.
+  HistoryLogStats logStats;
+  const bool logged = _history.getLogStats(logStats);
+  _history.closeLog();
+
+  HotRestart restart;
+  saveState(restart, started);
+  if (!restart.spawn(_upgrade_command) || !restart.send() || !restart.awaitAcknowledgement()) {
+    std::cerr << restart.getError() << ", carrying on" << std::endl;
+    restart.abandon();
+    // Only restarts the writer; it reads the disk copy back on its own thread.
+    if (logged && !_history.openLog(_history_dir, _history_max_bytes))
+      std::cerr << _history.getLogError() << ", keeping history in memory only" << std::endl;
+    if (_uring != NULL)
+      resumeUring();
+    queueBufferedClients();
+    ++_stats.upgradeFailures;
+    return false;
+  }
+
+  std::cout << "upgrade: handed " << _clients.size() << " clients and " << _channels.size() << " channels over in "
+            << TimerWheel::nowUs() - started << " us (" << restart.getBytes() << " bytes of state, "
+            << restart.getFdCount() << " sockets)" << std::endl;
+  if (!_list_queries.empty() || !_history_replays.empty())
+    std::cerr << "upgrade: " << _list_queries.size() + _history_replays.size() << " replies in progress cut short"
+              << std::endl;
+  _handed_off = true;
+  return true;
+}
+
+// Ends every recv and the accept, and waits for the sends in flight, so that
+// no byte is left behind in this process's ring. Data arriving meanwhile
+// joins the clients' input buffers and is handed over with them.
+bool Server::quiesceUring() {
+  std::set<int> armed;
+
+  _uring->disarmAccept();
+  for (std::size_t i = 0; i < _clients.size(); ++i) {
+    if (!_clients[i]->isRecvArmed())
+      continue;
+    _uring->cancelRecv(_clients[i]->getFd(), UringBackend::tagOf(_clients[i]->getId()));
+    armed.insert(_clients[i]->getFd());
+  }
+
+  std::vector<UringEvent> events;
+  const unsigned long deadline = TimerWheel::nowMs() + HANDOFF_QUIESCE_MS;
+  while ((!armed.empty() || _uring->hasPendingSends()) && TimerWheel::nowMs() < deadline) {
+    events.clear();
+    if (_uring->wait(HANDOFF_POLL_US, events) < 0)
+      break;
+
+    for (std::size_t i = 0; i < events.size(); ++i) {
+      const UringEvent &event = events[i];
+      // Accepted before the cancel got there: registered, then stopped too.
+      if (event.type == URING_ACCEPT) {
+        handleUringEvent(event);
+        Client *accepted = event.result >= 0 ? findClientByFd(event.result) : NULL;
+        if (accepted != NULL) {
+          _uring->cancelRecv(event.result, UringBackend::tagOf(accepted->getId()));
+          armed.insert(event.result);
+        }
+        continue;
+      }
+      if (event.type != URING_RECV)
+        continue;
+
+      Client *client = findClientByFd(event.fd);
+      if (client == NULL || UringBackend::tagOf(client->getId()) != event.tag)
+        continue;
+      if (!event.more) {
+        armed.erase(event.fd);
+        client->setRecvArmed(false);
+      }
+      if (event.result > 0) {
+        client->setLastActivity(TimerWheel::nowMs());
+        client->appendToBuffer(std::string(event.data, static_cast<std::size_t>(event.result)));
+      }
+    }
+  }
+  return armed.empty() && !_uring->hasPendingSends();
+}
+
+// A hot restart that did not happen: accept and recv are armed again, and
+// output held back while sends were drained goes out.
+void Server::resumeUring() {
+  _uring->armAccept(_server_socket);
+  for (std::size_t i = 0; i < _clients.size(); ++i) {
+    Client &client = *_clients[i];
+    if (!client.isRecvArmed() && !client.isReadPaused())
+      armClientRecv(client);
+    if (client.hasPendingOutput())
+      flushClientOutput(client);
+  }
+}
+
+// Start time, listening socket and next client id, then the channels without
+// their members, the clients with the channels they are in (in join order),
+// and the history still in memory. restoreState() reads it back in order.
+void Server::saveState(HotRestart &restart, unsigned long startedUs) {
+  restart.putNumber(startedUs);
+  restart.putFd(_server_socket);
+  restart.putNumber(_next_client_id);
+
+  restart.putNumber(_channels.size());
+  for (std::map<std::string, Channel *>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
+    const Channel &channel = *it->second;
+    restart.putString(channel.getName());
+    restart.putString(channel.getTopic());
+    restart.putNumber(static_cast<unsigned long>(channel.getTopicSetAt()));
+    restart.putNumber(static_cast<unsigned long>(channel.getCreatedAt()));
+    restart.putString(channel.getKey());
+    restart.putNumber(channel.getLimit());
+    std::string modes;
+    for (const char *mode = STATE_MODES; *mode != '\0'; ++mode) {
+      if (channel.getMode(*mode))
+        modes += *mode;
+    }
+    restart.putString(modes);
+    restart.putString(channel.getFloodParam());
+    restart.putNumber(channel.getModeratedUntil());
+
+    std::vector<unsigned long> operators;
+    const std::map<int, Client *> &members = channel.getMembers();
+    for (std::map<int, Client *>::const_iterator member = members.begin(); member != members.end(); ++member) {
+      if (channel.isOperator(member->first))
+        operators.push_back(member->second->getId());
+    }
+    restart.putNumber(operators.size());
+    for (std::size_t i = 0; i < operators.size(); ++i)
+      restart.putNumber(operators[i]);
+
+    for (const char *list = STATE_MASK_LISTS; *list != '\0'; ++list) {
+      const std::vector<MaskEntry> &entries = channel.getMaskList(*list).getEntries();
+      restart.putNumber(entries.size());
+      for (std::size_t i = 0; i < entries.size(); ++i) {
+        restart.putString(entries[i].mask);
+        restart.putString(entries[i].setBy);
+        restart.putNumber(static_cast<unsigned long>(entries[i].setAt));
+      }
+    }
+    std::vector<std::pair<unsigned long, unsigned long> > invites;
+    channel.getInvites(invites);
+    restart.putNumber(invites.size());
+    for (std::size_t i = 0; i < invites.size(); ++i) {
+      restart.putNumber(invites[i].first);
+      restart.putNumber(invites[i].second);
+    }
+  }
+
+  restart.putNumber(_clients.size());
+  for (std::size_t i = 0; i < _clients.size(); ++i) {
+    Client &client = *_clients[i];
+    unsigned long flags = 0;
+    if (client.hasPassword())
+      flags |= STATE_PASSWORD;
+    if (client.hasNick())
+      flags |= STATE_NICK;
+    if (client.hasUser())
+      flags |= STATE_USER;
+    if (_welcomed_clients.find(client.getFd()) != _welcomed_clients.end())
+      flags |= STATE_WELCOMED;
+    if (client.isNegotiating())
+      flags |= STATE_NEGOTIATING;
+
+    restart.putFd(client.getFd());
+    restart.putNumber(client.getId());
+    restart.putNumber(client.getAddress());
+    restart.putNumber(flags);
+    restart.putString(client.getNickname());
+    restart.putString(client.getUsername());
+    restart.putString(client.getRealname());
+    restart.putNumber(client.getCaps());
+    restart.putNumber(client.getCapVersion());
+    restart.putNumber(client.getLastActivity());
+    restart.putNumber(client.getPingSentAt());
+    restart.putString(client.getBuffer());
+    restart.putString(client.getOutputBuffer());
+    restart.putStrings(client.getChannels());
+    restart.putStrings(client.getMonitored());
+  }
+
+  std::vector<std::pair<std::string, HistoryRef> > lines;
+  _history.snapshot(lines);
+  restart.putNumber(lines.size());
+  for (std::size_t i = 0; i < lines.size(); ++i) {
+    restart.putString(lines[i].first);
+    restart.putNumber(lines[i].second->getSeq());
+    restart.putNumber(lines[i].second->getTime());
+    restart.putString(lines[i].second->getLine());
+  }
+}
+
+// The new process's half of saveState(). Sockets arrive under new descriptor
+// numbers, so channels find their members and operators by client id, which
+// carries over. Nothing is read or sent before the old process has been told
+// to let go; a damaged state ends this process and leaves the old one be.
+void Server::restoreState(HotRestart &restart, unsigned long startedUs) {
+  const unsigned long now = TimerWheel::nowMs();
+  _next_client_id = restart.takeNumber();
+
+  std::map<Channel *, std::vector<unsigned long> > operators;
+  for (unsigned long count = restart.takeNumber(); count > 0 && restart.isIntact(); --count) {
+    const std::string name = restart.takeString();
+    Channel *channel = getChannels(name);
+    channel->setTopic(restart.takeString());
+    channel->setTopicSetAt(static_cast<std::time_t>(restart.takeNumber()));
+    channel->setCreatedAt(static_cast<std::time_t>(restart.takeNumber()));
+    channel->setKey(restart.takeString());
+    channel->setLimit(restart.takeNumber());
+    const std::string modes = restart.takeString();
+    for (std::size_t i = 0; i < modes.size(); ++i)
+      channel->setMode(modes[i], true);
+    unsigned messages = 0;
+    unsigned seconds = 0;
+    char action = 'd';
+    if (parseFloodParam(restart.takeString(), messages, seconds, action))
+      channel->setFlood(messages, seconds, action);
+
+    Timer timer;
+    timer.fd = -1;
+    timer.clientId = 0;
+    timer.channel = name;
+    const unsigned long moderatedUntil = restart.takeNumber();
+    channel->setModeratedUntil(moderatedUntil);
+    if (moderatedUntil != 0) {
+      timer.kind = TIMER_UNMODERATE;
+      timer.expires = moderatedUntil;
+      _timers.schedule(timer);
+    }
+
+    for (unsigned long ops = restart.takeNumber(); ops > 0 && restart.isIntact(); --ops)
+      operators[channel].push_back(restart.takeNumber());
+    for (const char *list = STATE_MASK_LISTS; *list != '\0'; ++list) {
+      for (unsigned long masks = restart.takeNumber(); masks > 0 && restart.isIntact(); --masks) {
+        const std::string mask = restart.takeString();
+        const std::string setBy = restart.takeString();
+        channel->getMaskList(*list).add(mask, setBy, static_cast<std::time_t>(restart.takeNumber()));
+      }
+    }
+    timer.kind = TIMER_INVITE_EXPIRY;
+    for (unsigned long invites = restart.takeNumber(); invites > 0 && restart.isIntact(); --invites) {
+      const unsigned long clientId = restart.takeNumber();
+      timer.expires = restart.takeNumber();
+      channel->inviteMember(clientId, timer.expires, now);
+      _timers.schedule(timer);
+    }
+  }
+
+  std::map<unsigned long, Client *> byId;
+  for (unsigned long count = restart.takeNumber(); count > 0 && restart.isIntact(); --count) {
+    const int fd = restart.takeFd();
+    const unsigned long id = restart.takeNumber();
+    const unsigned int addr = static_cast<unsigned int>(restart.takeNumber());
+    const unsigned long flags = restart.takeNumber();
+    const std::string nickname = restart.takeString();
+    const std::string username = restart.takeString();
+    const std::string realname = restart.takeString();
+    const unsigned int caps = static_cast<unsigned int>(restart.takeNumber());
+    const unsigned int capVersion = static_cast<unsigned int>(restart.takeNumber());
+    const unsigned long lastActivity = restart.takeNumber();
+    const unsigned long pingSentAt = restart.takeNumber();
+    const std::string input = restart.takeString();
+    const std::string output = restart.takeString();
+    std::vector<std::string> joined;
+    std::vector<std::string> monitored;
+    restart.takeStrings(joined);
+    restart.takeStrings(monitored);
+    if (!restart.isIntact())
+      break;
+
+    Client *client = attachClient(fd, id, addr);
+    _admission.adopt(addr, now / 1000UL);
+    client->setPassword((flags & STATE_PASSWORD) != 0);
+    if ((flags & STATE_NICK) != 0) {
+      client->setNickname(nickname);
+      _clients_by_nick[nickname] = client;
+    }
+    if ((flags & STATE_USER) != 0)
+      client->setUsername(username);
+    client->setRealname(realname);
+    client->setCap(caps, true);
+    client->setCapVersion(capVersion);
+    client->setNegotiating((flags & STATE_NEGOTIATING) != 0);
+    client->setLastActivity(lastActivity);
+    client->setPingSentAt(pingSentAt);
+    client->appendToBuffer(input);
+    if (!output.empty())
+      client->queueOutput(output);
+    if ((flags & STATE_WELCOMED) != 0)
+      _welcomed_clients.insert(fd);
+
+    for (std::size_t i = 0; i < joined.size(); ++i) {
+      std::map<std::string, Channel *>::iterator it = _channels.find(joined[i]);
+      if (it != _channels.end())
+        joinChannel(*client, *it->second);
+    }
+    for (std::size_t i = 0; i < monitored.size(); ++i) {
+      client->addMonitor(monitored[i]);
+      _monitor_watchers[monitored[i]].insert(fd);
+    }
+
+    if (!client->isAuthenticated())
+      scheduleTimer(TIMER_REGISTRATION, *client, now + _registration_timeout_ms);
+    if (pingSentAt != 0)
+      scheduleTimer(TIMER_PING_TIMEOUT, *client, pingSentAt + _ping_timeout_ms);
+    else
+      scheduleTimer(TIMER_KEEPALIVE, *client, lastActivity + _keepalive_ms);
+    byId[id] = client;
+  }
+
+  for (std::map<Channel *, std::vector<unsigned long> >::iterator it = operators.begin(); it != operators.end(); ++it) {
+    for (std::size_t i = 0; i < it->second.size(); ++i) {
+      std::map<unsigned long, Client *>::iterator op = byId.find(it->second[i]);
+      if (op != byId.end() && it->first->isMember(op->second->getFd()))
+        it->first->addOperator(op->second->getFd());
+    }
+  }
+  std::vector<Channel *> empty;
+  for (std::map<std::string, Channel *>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
+    if (it->second->getMembersNumber() == 0)
+      empty.push_back(it->second);
+  }
+  for (std::size_t i = 0; i < empty.size(); ++i)
+    releaseChannel(*empty[i]);
+
+  // With a log the indexer reads these lines back from disk once it is open.
+  const bool logged = !_history_dir.empty();
+  for (unsigned long count = restart.takeNumber(); count > 0 && restart.isIntact(); --count) {
+    const std::string channel = restart.takeString();
+    const unsigned long seq = restart.takeNumber();
+    const unsigned long timeMs = restart.takeNumber();
+    const std::string line = restart.takeString();
+    if (!restart.isIntact())
+      break;
+    _history.restore(channel, seq, timeMs, line);
+    if (!logged)
+      _search.add(channel, seq, timeMs, line);
+  }
+
+  if (!restart.isIntact() || !restart.atEnd())
+    throw std::runtime_error("upgrade: the state handed over is damaged");
+  if (!restart.acknowledge())
+    throw std::runtime_error(restart.getError());
+
+  if (_uring != NULL) {
+    for (std::size_t i = 0; i < _clients.size(); ++i)
+      armClientRecv(*_clients[i]);
+  }
+  queueBufferedClients();
+  _stats.upgradeClients = _clients.size();
+  _stats.upgradeChannels = _channels.size();
+  _stats.upgradeUs = TimerWheel::nowUs() - startedUs;
+  std::cout << "upgrade: took over " << _clients.size() << " clients and " << _channels.size() << " channels, "
+            << _stats.upgradeUs << " us after the hand-off began" << std::endl;
+}
@@ -0,0 +1,108 @@
+#include "../include/TimerWheel.hpp"
+#include <ctime>
+
+namespace {
+const std::size_t SLOT_MASK = TIMER_WHEEL_SLOTS - 1;
+const unsigned long WHEEL_SPAN = 1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+} // namespace
+
+TimerWheel::TimerWheel() : _current(nowMs() / TIMER_TICK_MS), _size(0) {
+}
+
+TimerWheel::~TimerWheel() {
+}
+
+unsigned long TimerWheel::nowMs() {
+  return nowUs() / 1000UL;
+}
+
+unsigned long TimerWheel::nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long>(ts.tv_sec) * 1000000UL + static_cast<unsigned long>(ts.tv_nsec) / 1000UL;
+}
+
+void TimerWheel::schedule(const Timer &timer) {
+  Timer rounded = timer;
+  unsigned long tick = (timer.expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+  if (tick <= _current)
+    tick = _current + 1;
+  rounded.expires = tick;
+  insert(rounded);
+  ++_size;
+}
+
+// Timer::expires holds the absolute tick once the timer is inside the wheel.
+void TimerWheel::insert(const Timer &timer) {
+  unsigned long tick = timer.expires;
+  unsigned long delta = tick > _current ? tick - _current : 0;
+
+  if (delta >= WHEEL_SPAN) {
+    tick = _current + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+
+  std::size_t level = 0;
+  while (level + 1 < TIMER_WHEEL_LEVELS && delta >= (1UL << (TIMER_WHEEL_BITS * (level + 1))))
+    ++level;
+
+  std::size_t slot = (tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+  _slots[level][slot].push_back(timer);
+}
+
+void TimerWheel::cascade(std::size_t level) {
+  std::size_t slot = (_current >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+  std::vector<Timer> pending;
+
+  pending.swap(_slots[level][slot]);
+  for (std::size_t i = 0; i < pending.size(); ++i)
+    insert(pending[i]);
+}
+
+void TimerWheel::advance(unsigned long now, std::vector<Timer> &expired) {
+  unsigned long target = now / TIMER_TICK_MS;
+
+  if (_size == 0) {
+    if (target > _current)
+      _current = target;
+    return;
+  }
+
+  while (_current < target) {
+    ++_current;
+
+    // Refill the lower levels from the coarser ones when their index wraps,
+    // coarsest first so that its timers land in the slot cascaded next.
+    for (std::size_t level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+      if ((_current & ((1UL << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+        cascade(level);
+    }
+
+    std::vector<Timer> &slot = _slots[0][_current & SLOT_MASK];
+    _size -= slot.size();
+    expired.insert(expired.end(), slot.begin(), slot.end());
+    slot.clear();
+  }
+}
+
+// Milliseconds until the next level-0 slot holding timers, or until the next
+// cascade boundary; -1 when nothing is armed so poll() may block forever.
+int TimerWheel::pollTimeout(unsigned long now) const {
+  if (_size == 0)
+    return -1;
+
+  unsigned long tick = _current + 1;
+  unsigned long boundary = (_current | SLOT_MASK) + 1;
+  while (tick < boundary && _slots[0][tick & SLOT_MASK].empty())
+    ++tick;
+
+  unsigned long due = tick * TIMER_TICK_MS;
+  if (due <= now)
+    return 0;
+  return static_cast<int>(due - now);
+}
+
+std::size_t TimerWheel::size() const {
+  return _size;
+}
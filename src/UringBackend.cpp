@@ -0,0 +1,498 @@
+#include "../include/UringBackend.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_BUFFER_COUNT = 256;
+const unsigned URING_BUFFER_SIZE = 4096;
+const unsigned short URING_BUFFER_GROUP = 1;
+
+// user_data layout: | type (4 bits) | client tag (28 bits) | fd (32 bits) |
+const int TYPE_SHIFT = 60;
+const int TAG_SHIFT = 32;
+const unsigned long TAG_MASK = 0xFFFFFFFUL;
+const unsigned long FD_MASK = 0xFFFFFFFFUL;
+
+unsigned long encodeUserData(UringEventType type, int fd, unsigned long tag) {
+  return (static_cast<unsigned long>(type) << TYPE_SHIFT) | ((tag & TAG_MASK) << TAG_SHIFT) |
+         (static_cast<unsigned long>(static_cast<unsigned>(fd)) & FD_MASK);
+}
+} // namespace
+
+UringBackend::UringBackend()
+    : _ring_fd(-1), _sq_ring(NULL), _cq_ring(NULL), _sqes(NULL), _sq_ring_size(0), _cq_ring_size(0), _sqes_size(0),
+      _sq_head(NULL), _sq_tail(NULL), _sq_mask(0), _sq_entries(0), _sq_local_tail(0), _cq_head(NULL), _cq_tail(NULL),
+      _cq_mask(0), _cqes(NULL), _buf_ring(NULL), _buffers(NULL), _buf_tail(0), _listen_fd(-1), _wakeup_fd(-1), _enter_calls(0),
+      _completions(0) {
+}
+
+UringBackend::~UringBackend() {
+  release();
+}
+
+const std::string &UringBackend::getError() const {
+  return _error;
+}
+
+unsigned long UringBackend::tagOf(unsigned long clientId) {
+  return clientId & TAG_MASK;
+}
+
+unsigned long UringBackend::getEnterCalls() const {
+  return _enter_calls;
+}
+
+unsigned long UringBackend::getCompletions() const {
+  return _completions;
+}
+
+bool UringBackend::hasPendingSends() const {
+  return !_sends.empty();
+}
+
+#ifdef __linux__
+
+bool UringBackend::init() {
+  struct io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+
+  // SINGLE_ISSUER (6.0+) doubles as the kernel version gate for multishot recv.
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  _ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+  if (_ring_fd < 0) {
+    _error = std::string("io_uring_setup: ") + std::strerror(errno);
+    return false;
+  }
+  if ((params.features & IORING_FEAT_EXT_ARG) == 0 || (params.features & IORING_FEAT_NODROP) == 0) {
+    _error = "io_uring: kernel lacks EXT_ARG/NODROP";
+    release();
+    return false;
+  }
+
+  _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMmap && _cq_ring_size > _sq_ring_size)
+    _sq_ring_size = _cq_ring_size;
+
+  _sq_ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+  if (_sq_ring == MAP_FAILED) {
+    _sq_ring = NULL;
+    _error = "io_uring: cannot map SQ ring";
+    release();
+    return false;
+  }
+  if (singleMmap) {
+    _cq_ring = _sq_ring;
+  } else {
+    _cq_ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    if (_cq_ring == MAP_FAILED) {
+      _cq_ring = NULL;
+      _error = "io_uring: cannot map CQ ring";
+      release();
+      return false;
+    }
+  }
+  _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+  if (_sqes == MAP_FAILED) {
+    _sqes = NULL;
+    _error = "io_uring: cannot map SQEs";
+    release();
+    return false;
+  }
+
+  char *sq = static_cast<char *>(_sq_ring);
+  char *cq = static_cast<char *>(_cq_ring);
+  _sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  _sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  _sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  _sq_entries = params.sq_entries;
+  _sq_local_tail = *_sq_tail;
+  unsigned *sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < _sq_entries; ++i)
+    sqArray[i] = i;
+  _cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  _cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  _cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  _cqes = cq + params.cq_off.cqes;
+
+  // Provided buffer ring (5.19+): the kernel picks a buffer per recv completion.
+  _buf_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (_buf_ring == MAP_FAILED) {
+    _buf_ring = NULL;
+    _error = "io_uring: cannot allocate buffer ring";
+    release();
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<unsigned long>(_buf_ring);
+  reg.ring_entries = URING_BUFFER_COUNT;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    _error = std::string("io_uring: provided buffer ring unsupported: ") + std::strerror(errno);
+    release();
+    return false;
+  }
+
+  _buffers = new char[URING_BUFFER_COUNT * URING_BUFFER_SIZE];
+  for (unsigned short bid = 0; bid < URING_BUFFER_COUNT; ++bid)
+    _recycle.push_back(bid);
+  recycleBuffers();
+  return true;
+}
+
+void UringBackend::release() {
+  if (_buf_ring != NULL)
+    munmap(_buf_ring, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+  if (_sqes != NULL)
+    munmap(_sqes, _sqes_size);
+  if (_cq_ring != NULL && _cq_ring != _sq_ring)
+    munmap(_cq_ring, _cq_ring_size);
+  if (_sq_ring != NULL)
+    munmap(_sq_ring, _sq_ring_size);
+  if (_ring_fd >= 0)
+    close(_ring_fd);
+  delete[] _buffers;
+
+  _buf_ring = NULL;
+  _sqes = NULL;
+  _cq_ring = NULL;
+  _sq_ring = NULL;
+  _ring_fd = -1;
+  _buffers = NULL;
+}
+
+void *UringBackend::getSqe() {
+  if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+    enter(0, -1);
+
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(_sqes) + (_sq_local_tail & _sq_mask);
+  std::memset(sqe, 0, sizeof(*sqe));
+  ++_sq_local_tail;
+  return sqe;
+}
+
+// Publishes queued SQEs and optionally waits for completions. A negative
+// timeout blocks until at least minComplete completions are available.
+int UringBackend::enter(unsigned minComplete, long timeoutUs) {
+  __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+  unsigned toSubmit = _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void *argp = NULL;
+  std::size_t argSize = 0;
+  if (minComplete > 0 && timeoutUs >= 0) {
+    ts.tv_sec = timeoutUs / 1000000L;
+    ts.tv_nsec = (timeoutUs % 1000000L) * 1000L;
+    std::memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<unsigned long>(&ts);
+    flags |= IORING_ENTER_EXT_ARG;
+    argp = &arg;
+    argSize = sizeof(arg);
+  }
+
+  ++_enter_calls;
+  return static_cast<int>(syscall(__NR_io_uring_enter, _ring_fd, toSubmit, minComplete, flags, argp, argSize));
+}
+
+void UringBackend::armAccept(int listenFd) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  _listen_fd = listenFd;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenFd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = encodeUserData(URING_ACCEPT, listenFd, 0);
+}
+
+// Reports POLLIN on fd as URING_WAKEUP; the caller drains the fd.
+void UringBackend::armWakeup(int fd) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  _wakeup_fd = fd;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = encodeUserData(URING_WAKEUP, fd, 0);
+}
+
+void UringBackend::armRecv(int fd, unsigned long tag) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = encodeUserData(URING_RECV, fd, tag);
+}
+
+void UringBackend::prepSend(unsigned long userData, const PendingSend &pending) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = pending.fd;
+  sqe->addr = reinterpret_cast<unsigned long>(pending.data.data() + pending.offset);
+  sqe->len = static_cast<unsigned>(pending.data.size() - pending.offset);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = userData;
+}
+
+// Takes ownership of the bytes in data (the kernel reads them asynchronously)
+// unless a send is already in flight for this client; its completion will
+// pick up whatever accumulated in the meantime.
+bool UringBackend::submitSend(int fd, unsigned long tag, std::string &data) {
+  unsigned long userData = encodeUserData(URING_SEND, fd, tag);
+
+  if (data.empty() || _sends.find(userData) != _sends.end())
+    return false;
+
+  PendingSend &pending = _sends[userData];
+  pending.fd = fd;
+  pending.offset = 0;
+  pending.data.swap(data);
+  pending.closing = false;
+  prepSend(userData, pending);
+  return true;
+}
+
+void UringBackend::cancel(int fd) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = encodeUserData(URING_CANCEL, fd, 0);
+  // Submit right away so the cancel reaches the kernel before the fd is closed
+  // and possibly handed out again by accept.
+  enter(0, -1);
+}
+
+// Ends a client's multishot recv alone, leaving its sends running. The last
+// completion arrives without the more flag.
+void UringBackend::cancelRecv(int fd, unsigned long tag) {
+  struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(getSqe());
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = encodeUserData(URING_RECV, fd, tag);
+  sqe->user_data = encodeUserData(URING_CANCEL, fd, 0);
+  enter(0, -1);
+}
+
+// Last output of a client that is going away, then close(). Writing it
+// directly while a ring send is in flight could overtake that send, so the
+// send is cancelled instead and the fd stays open until its completion says
+// how much of it went out; whatever is left follows with one non-blocking
+// write. Completions for the fd are not reported any more.
+void UringBackend::closeClient(int fd, unsigned long tag, const std::string &data) {
+  std::map<unsigned long, PendingSend>::iterator it = _sends.find(encodeUserData(URING_SEND, fd, tag));
+  if (it == _sends.end()) {
+    cancel(fd);
+    if (!data.empty())
+      ::send(fd, data.data(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    return;
+  }
+  it->second.closing = true;
+  it->second.tail = data;
+  cancel(fd);
+}
+
+void UringBackend::finishClose(const PendingSend &pending) {
+  std::string rest = pending.data.substr(std::min(pending.offset, pending.data.size())) + pending.tail;
+  if (!rest.empty())
+    ::send(pending.fd, rest.data(), rest.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(pending.fd);
+}
+
+// Stops accepting; the final accept completion is not re-armed.
+void UringBackend::disarmAccept() {
+  if (_listen_fd < 0)
+    return;
+  const int listenFd = _listen_fd;
+  _listen_fd = -1;
+  cancel(listenFd);
+}
+
+void UringBackend::recycleBuffers() {
+  if (_recycle.empty())
+    return;
+
+  // Index the entries by hand: in C++ the header's flex-array member is
+  // preceded by an empty struct and no longer sits at offset 0.
+  struct io_uring_buf_ring *ring = static_cast<struct io_uring_buf_ring *>(_buf_ring);
+  struct io_uring_buf *bufs = static_cast<struct io_uring_buf *>(_buf_ring);
+  const unsigned short mask = static_cast<unsigned short>(URING_BUFFER_COUNT - 1);
+  for (std::size_t i = 0; i < _recycle.size(); ++i) {
+    struct io_uring_buf *buf = &bufs[(_buf_tail + i) & mask];
+    buf->addr = reinterpret_cast<unsigned long>(_buffers + _recycle[i] * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = _recycle[i];
+  }
+  _buf_tail = static_cast<unsigned short>(_buf_tail + _recycle.size());
+  __atomic_store_n(&ring->tail, _buf_tail, __ATOMIC_RELEASE);
+  _recycle.clear();
+}
+
+int UringBackend::wait(long timeoutUs, std::vector<UringEvent> &events) {
+  recycleBuffers();
+
+  int ret = enter(1, timeoutUs);
+  reap(events);
+  if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+    return 0;
+  return ret;
+}
+
+void UringBackend::reap(std::vector<UringEvent> &events) {
+  unsigned head = *_cq_head;
+  unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = static_cast<const struct io_uring_cqe *>(_cqes) + (head & _cq_mask);
+    unsigned long userData = static_cast<unsigned long>(cqe->user_data);
+
+    UringEvent event;
+    event.type = static_cast<UringEventType>(userData >> TYPE_SHIFT);
+    event.fd = static_cast<int>(userData & FD_MASK);
+    event.tag = (userData >> TAG_SHIFT) & TAG_MASK;
+    event.result = cqe->res;
+    event.data = NULL;
+    event.more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    ++_completions;
+
+    if (event.type == URING_CANCEL)
+      continue;
+
+    if (event.type == URING_ACCEPT && !event.more && _listen_fd >= 0) {
+      armAccept(_listen_fd);
+    } else if (event.type == URING_WAKEUP && !event.more) {
+      armWakeup(_wakeup_fd);
+    } else if (event.type == URING_RECV && (cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+      unsigned short bid = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      event.data = _buffers + bid * URING_BUFFER_SIZE;
+      _recycle.push_back(bid);
+    } else if (event.type == URING_SEND) {
+      std::map<unsigned long, PendingSend>::iterator it = _sends.find(userData);
+      if (it == _sends.end())
+        continue;
+      if (it->second.closing) {
+        if (event.result > 0)
+          it->second.offset += static_cast<std::size_t>(event.result);
+        finishClose(it->second);
+        _sends.erase(it);
+        continue;
+      }
+      if (event.result > 0) {
+        it->second.offset += static_cast<std::size_t>(event.result);
+        if (it->second.offset < it->second.data.size()) {
+          prepSend(userData, it->second);
+          continue;
+        }
+      }
+      _sends.erase(it);
+    }
+    events.push_back(event);
+  }
+  __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool UringBackend::init() {
+  _error = "io_uring is only available on Linux";
+  return false;
+}
+
+void UringBackend::release() {
+}
+
+void *UringBackend::getSqe() {
+  return NULL;
+}
+
+int UringBackend::enter(unsigned minComplete, long timeoutUs) {
+  (void)minComplete;
+  (void)timeoutUs;
+  return -1;
+}
+
+void UringBackend::armAccept(int listenFd) {
+  (void)listenFd;
+}
+
+void UringBackend::armWakeup(int fd) {
+  (void)fd;
+}
+
+void UringBackend::armRecv(int fd, unsigned long tag) {
+  (void)fd;
+  (void)tag;
+}
+
+void UringBackend::prepSend(unsigned long userData, const PendingSend &pending) {
+  (void)userData;
+  (void)pending;
+}
+
+bool UringBackend::submitSend(int fd, unsigned long tag, std::string &data) {
+  (void)fd;
+  (void)tag;
+  (void)data;
+  return false;
+}
+
+void UringBackend::cancel(int fd) {
+  (void)fd;
+}
+
+void UringBackend::cancelRecv(int fd, unsigned long tag) {
+  (void)fd;
+  (void)tag;
+}
+
+void UringBackend::closeClient(int fd, unsigned long tag, const std::string &data) {
+  (void)tag;
+  (void)data;
+  close(fd);
+}
+
+void UringBackend::finishClose(const PendingSend &pending) {
+  (void)pending;
+}
+
+void UringBackend::disarmAccept() {
+}
+
+void UringBackend::recycleBuffers() {
+}
+
+int UringBackend::wait(long timeoutUs, std::vector<UringEvent> &events) {
+  (void)timeoutUs;
+  (void)events;
+  return -1;
+}
+
+void UringBackend::reap(std::vector<UringEvent> &events) {
+  (void)events;
+}
+
+#endif